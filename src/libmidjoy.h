@@ -0,0 +1,121 @@
+/* libmidjoy.h
+ * Public API for embedding midjoy: MIDI in, gamepad state out, all in the caller's process.
+ * No uinput, no threads, and no syscalls between a MIDI byte and your callback.
+ * Link out/libmidjoy.a (or out/libmidjoy.so) with -lpthread.
+ *
+ * Give us MIDI bytes with mj_lib_feed(), or fds to read with mj_lib_add_fd().
+ * Call mj_lib_update() from your loop, or poll mj_lib_get_fd() yourself and call it when readable, with zero timeout.
+ * Timed map entries (turbo, long press) also run from mj_lib_update(), so call it regularly if the map uses them.
+ * Each frame that changes a pad calls your callback with the pad's whole state. The same state is there to poll any time.
+ * Not thread-safe: Use one instance from one thread.
+ */
+
+#ifndef LIBMIDJOY_H
+#define LIBMIDJOY_H
+
+#include <stdint.h>
+#include <string.h>
+
+#define MJ_PAD_KEY_COUNT 0x300 /* Same as Linux KEY_CNT. */
+#define MJ_PAD_ABS_COUNT 0x40  /* Same as Linux ABS_CNT. */
+
+/* One joystick: A MIDI device, or one player of a split device.
+ * Codes are Linux's, from <linux/input-event-codes.h>: BTN_SOUTH, ABS_X, and so on.
+ */
+struct mj_pad {
+  int devid;
+  int player; // 0-based
+  int connected; // Zero after the device disconnects; the last frame released everything.
+  uint64_t framec; // Frames so far. Changes every time the callback fires.
+  uint8_t keybits[MJ_PAD_KEY_COUNT>>3]; // Buttons down: Bit (code&7) of byte (code>>3).
+  int32_t absv[MJ_PAD_ABS_COUNT];
+};
+
+static inline int mj_pad_key(const struct mj_pad *pad,int code) {
+  if ((code<0)||(code>=MJ_PAD_KEY_COUNT)) return 0;
+  return (pad->keybits[code>>3]>>(code&7))&1;
+}
+
+/* Pad page: The daemon with --dstdev=shm:PATH keeps every pad in a shared file, for games that poll once per frame.
+ * You don't need the library for this part, just mmap PATH read-only and call mj_padpage_read on a slot.
+ * Layout is the header (64 bytes), then (slotc) slots of (slotsize) bytes, so every slot starts on a 64-byte boundary.
+ * Check (magic) before anything else.
+ * A slot belongs to one (devid,player) for the life of the daemon, and stays after disconnect with (connected) zero.
+ * Each slot is a seqlock: (seq) is odd while the daemon writes it, and goes up by two for every frame.
+ */
+#define MJ_PADPAGE_MAGIC "MIDJOYP\2"
+#define MJ_PADPAGE_READ_LIMIT 1000
+
+struct mj_padpage_header {
+  char magic[8];
+  uint32_t slotsize;
+  uint32_t slotc;
+  int32_t pid; // Zero after a clean exit.
+  uint32_t reserved;
+  int64_t starttime; // CLOCK_MONOTONIC in ns.
+  uint8_t pad[32]; // Fills out the first cache line, so slot zero starts on the next.
+};
+
+struct mj_padpage_slot {
+  uint32_t seq;
+  uint32_t reserved;
+  struct mj_pad pad; // (devid) -1 if unused.
+} __attribute__((aligned(64)));
+
+/* Copy a consistent snapshot of (slot) into (dst).
+ * Returns >0 if the slot is in use, 0 if not, or <0 if the writer kept us out for MJ_PADPAGE_READ_LIMIT tries.
+ */
+static inline int mj_padpage_read(struct mj_pad *dst,const struct mj_padpage_slot *slot) {
+  int i=MJ_PADPAGE_READ_LIMIT;
+  while (i-->0) {
+    uint32_t seq=__atomic_load_n(&slot->seq,__ATOMIC_ACQUIRE);
+    if (seq&1) continue;
+    memcpy(dst,&slot->pad,sizeof(struct mj_pad));
+    __atomic_thread_fence(__ATOMIC_ACQUIRE);
+    if (__atomic_load_n(&slot->seq,__ATOMIC_RELAXED)!=seq) continue;
+    return (dst->devid>=0)?1:0;
+  }
+  return -1;
+}
+
+struct mj_lib;
+
+/* New instance, with the map file at (mappath), or the built-in default if null.
+ * (cb) is optional.
+ */
+struct mj_lib *mj_lib_new(
+  const char *mappath,
+  void (*cb)(const struct mj_pad *pad,void *userdata),
+  void *userdata
+);
+
+void mj_lib_del(struct mj_lib *lib);
+
+/* Raw MIDI bytes from device (devid), which connects on first use.
+ * Messages may be split across calls anywhere.
+ */
+int mj_lib_feed(struct mj_lib *lib,int devid,const void *src,int srcc);
+
+/* Release everything on (devid)'s pads, and forget its parser state.
+ */
+int mj_lib_disconnect(struct mj_lib *lib,int devid);
+
+/* Read MIDI for (devid) from (fd) during mj_lib_update. It should be nonblocking.
+ * We own it now: At end of file or error we close it and disconnect (devid).
+ */
+int mj_lib_add_fd(struct mj_lib *lib,int devid,int fd);
+
+/* Wait up to (to_ms) for fds and timers, and process them. Negative waits forever.
+ */
+int mj_lib_update(struct mj_lib *lib,int to_ms);
+
+/* An epoll fd, readable when mj_lib_update has something to do.
+ */
+int mj_lib_get_fd(const struct mj_lib *lib);
+
+/* Current state of one pad, or null if it has never had a frame.
+ * The pointer stays valid until mj_lib_del.
+ */
+const struct mj_pad *mj_lib_get_pad(const struct mj_lib *lib,int devid,int player);
+
+#endif
@@ -6,57 +6,913 @@
 #include <stdio.h>
 #include <limits.h>
 #include <stdint.h>
+#include <linux/input.h>
+#include <linux/io_uring.h>
+#include <pthread.h>
+#include "libmidjoy.h"
 
 struct mj_input;
+struct mj_input_device;
 struct mj_output;
-struct pollfd;
+struct mj_output_device;
+struct mj_output_backend;
+struct mj_pipeline_worker;
+struct mj_stats;
+struct mj_stats_slot;
+struct mj_uring;
 
 /* Input.
  ****************************************************/
  
+/* Everything we wait on is a watch, and its epoll registration points directly at it.
+ * Other units can add their own fds with mj_input_watch_fd().
+ */
+struct mj_input_watch {
+  int fd;
+  int (*cb)(struct mj_input *input,struct mj_input_watch *watch);
+  void *userdata;
+};
+ 
+/* Hotplug discovery.
+ * NETLINK listens for kernel uevents in the sound subsystem, and never looks at anything else in /dev.
+ * INOTIFY watches srcdir, which works anywhere, eg a directory of FIFOs.
+ * AUTO is NETLINK if srcdir is /dev and the socket works, otherwise INOTIFY.
+ */
+#define MJ_INPUT_HOTPLUG_AUTO    0
+#define MJ_INPUT_HOTPLUG_NETLINK 1
+#define MJ_INPUT_HOTPLUG_INOTIFY 2
+
+/* A device that showed up but wouldn't open (usually udev hasn't set its permissions yet) is retried with backoff.
+ */
+#define MJ_INPUT_RETRY_LIMIT 16
+ 
 struct mj_input {
 
   /* Devices introduce themselves with an empty Sysex packet (f0f7), and farewell with an empty packet.
-   * (devid) is unique among connected devices, and derived from the file name, eg 2 for "/dev/midi2".
+   * (device->devid) is unique among connected devices, and derived from the file name, eg 2 for "/dev/midi2".
+   * (device->link) belongs to you. Typically you set it at the hello event, to find your own record in O(1) later.
    */
-  int (*cb)(int devid,const void *src,int srcc,void *userdata);
+  int (*cb)(struct mj_input_device *device,const void *src,int srcc,void *userdata);
   void *userdata;
   
   char *srcpath;
-  struct pollfd *pollfdv;
-  int pollfda;
-  int infd;
+  int epfd;
+  int hotplug; // MJ_INPUT_HOTPLUG_*. Set before mj_input_ready; after, it's never AUTO.
+  struct mj_input_watch inotify;
+  struct mj_input_watch netlink;
+  struct mj_input_watch retry; // timerfd, armed while (retryv) is not empty.
+  struct mj_input_retry {
+    int devid;
+    int attemptc;
+    int64_t due; // mj_now()
+    char base[32]; // Basename as we first saw it. (devid) alone doesn't say how it was spelled.
+  } retryv[MJ_INPUT_RETRY_LIMIT];
+  int retryc;
   int refresh; // Set nonzero to scan directory at next update
   struct mj_input_device {
-    int fd,devid;
-  } *devicev;
+    struct mj_input_watch watch; // (watch.fd) is the MIDI device.
+    int devid;
+    void *link;
+    int64_t rcvtime; // mj_now() at the first read of the span being delivered, valid during the callback.
+    uint8_t *rxv; // Receive buffer, (rxsize) bytes.
+    struct mj_stats_slot *stats; // Null if not publishing stats, or the page is full.
+    int reading; // io_uring only: A READ into (rxv) is in flight. 2 if a POLL went ahead of it.
+    int pollfirst; // io_uring only: This kernel won't wait in a READ here, always POLL first.
+    int cancel; // io_uring only: Said farewell, and waiting for the READ to come back before dropping.
+  } **devicev;
   int devicec,devicea;
+  struct mj_input_watch **watchv; // Foreign watches, from mj_input_watch_fd().
+  int watchc,watcha;
+  uint64_t waitc,readc; // epoll_wait and device read calls.
+  struct mj_input_device **sparev; // Preallocated device records, if mj_input_reserve() was called.
+  int sparec,sparea;
+  int *ignorev; // devids detached by request.
+  int ignorec,ignorea;
+  int detach; // Nonzero if a device in (ignorev) might still be connected.
+  int rxsize; // Receive buffer per device. Set before mj_input_ready, or zero for the default.
+  struct mj_stats *stats; // Optional, and we don't own it. Devices claim their slot when they open.
+  struct mj_uring *uring; // Optional. Set before mj_input_ready to read devices via io_uring. We don't own it.
 };
 
 void mj_input_cleanup(struct mj_input *input);
 int mj_input_set_srcdir(struct mj_input *input,const char *src,int srcc);
 int mj_input_ready(struct mj_input *input);
 
+/* Allocate (devicea) device records up front, and never allocate or free one again.
+ * Beyond that count, new devices are logged and ignored.
+ * Must be called before any device connects.
+ */
+int mj_input_reserve(struct mj_input *input,int devicea);
+
+/* Add an fd to our poll set; (cb) is called from mj_input_update when it's readable.
+ * We do not close it.
+ */
+int mj_input_watch_fd(
+  struct mj_input *input,
+  int fd,
+  int (*cb)(struct mj_input *input,struct mj_input_watch *watch),
+  void *userdata
+);
+void mj_input_unwatch_fd(struct mj_input *input,int fd);
+
+/* Stop reading a device and send its farewell, or allow it again and rescan.
+ * Detaching takes effect at the start of the next update, so it's safe to call from any callback.
+ * A detached device stays ignored even if it disappears and comes back.
+ */
+int mj_input_detach(struct mj_input *input,int devid);
+int mj_input_attach(struct mj_input *input,int devid);
+
+/* Wait up to (to_ms) for something to happen, and dispatch it.
+ * Negative (to_ms) to wait forever.
+ * Devices are nonblocking. Each wakeup reads until EAGAIN and delivers what arrived as one span,
+ * straight out of the device's receive buffer. A span is only split when the buffer fills.
+ */
 int mj_input_update(struct mj_input *input,int to_ms);
 
+/* MIDI.
+ ****************************************************/
+ 
+/* One complete message.
+ * (opcode) is the high nybble of a Channel Voice status (0x80..0xe0), or the full status byte for System messages.
+ * Zero if no message is ready.
+ * Sysex is special: MJ_MIDI_SYSEX_DATA for each run of payload, which is at (parser->sysexv,sysexc) and points into the input.
+ * Then MJ_MIDI_SYSEX_END, with (a) 1 if it ended with F7, or 0 if some other status byte cut it short.
+ */
+#define MJ_MIDI_SYSEX_DATA 0xf0
+#define MJ_MIDI_SYSEX_END  0xf7
+struct mj_midi_event {
+  uint8_t opcode;
+  uint8_t chid;
+  uint8_t a,b;
+};
+
+/* Incremental parser for one device's byte stream.
+ * Partial messages and Running Status carry across calls, and Realtime bytes may interrupt anything.
+ * Realtime (clock, active sensing, transport) never comes out as an event: Nothing downstream uses it,
+ * and a clocked keyboard sends 24 per beat. The parser only counts them.
+ * Zero is a valid initial state. It never allocates.
+ */
+struct mj_midi_parser {
+  uint8_t status; // Running Status, or the System Common message in progress, or zero.
+  uint8_t bufc;
+  uint8_t buf[2];
+  uint8_t sysex;
+  uint32_t errorc; // Malformed input dropped: Stray data, truncated messages, interrupted Sysex. Only increases.
+  uint32_t realtimev[8]; // Realtime messages dropped, by status byte minus 0xf8. Owner may harvest and zero them.
+  const uint8_t *sysexv; // Last MJ_MIDI_SYSEX_DATA. Only valid until the input buffer changes.
+  int sysexc;
+};
+
+/* Consume some of (src), stopping after the first complete message.
+ * Returns the length consumed, which is >0 if (srcc>0), with one exception:
+ * A status byte that interrupts Sysex yields MJ_MIDI_SYSEX_END and consumes nothing; the next call handles the byte.
+ * (event->opcode) is zero if we reached the end of input without completing a message.
+ */
+int mj_midi_parse(struct mj_midi_event *event,struct mj_midi_parser *parser,const void *src,int srcc);
+
+/* Map.
+ ****************************************************/
+ 
+/* What one MIDI key or controller does: a prebuilt event, emitted verbatim on press.
+ * (type) zero if unmapped.
+ * On release, EV_KEY sends value 0, and EV_ABS returns to 0 only if the axis still holds (value).
+ * MJ_MAP_ANALOG entries are always EV_ABS, and take their value from the MIDI message instead.
+ */
+struct mj_map_entry {
+  uint16_t type,code;
+  int32_t value;
+  uint8_t flags;
+  uint16_t ms; // MJ_MAP_TURBO: Toggle interval. MJ_MAP_LONG: Hold threshold.
+  uint16_t minms; // MJ_MAP_MIN: Shortest press we'll report.
+  uint16_t altcode; // MJ_MAP_LONG: EV_KEY to press instead, once held past (ms).
+};
+
+#define MJ_MAP_ANALOG 0x01
+#define MJ_MAP_14BIT  0x02 /* Controller pair; the entry appears at both MSB (0..31) and LSB (32..63). */
+#define MJ_MAP_CENTERED 0x04 /* Pitch wheel. Only matters for the default axis range. */
+#define MJ_MAP_TURBO  0x08 /* Switches only: Release and press again every (ms) while held. */
+#define MJ_MAP_LONG   0x10 /* Switches only: Tap for (code), or hold (ms) for (altcode). */
+#define MJ_MAP_MIN    0x20 /* Switches only: Hold at least (minms), however short the note. */
+#define MJ_MAP_TIMED (MJ_MAP_TURBO|MJ_MAP_LONG|MJ_MAP_MIN)
+
+/* One MIDI device can drive several joysticks ("players"), split by channel or by key range.
+ */
+#define MJ_MAP_PLAYER_LIMIT 16
+
+/* Everything is compiled into flat tables at load, so translation is a single indexed load.
+ */
+struct mj_map_profile {
+  int devid; // <0 to match any
+  char *name; // Null to match any. Compared against the sound card's id in sysfs.
+  struct mj_map_entry notev[16][128]; // [chid][noteid]
+  struct mj_map_entry ccv[16][128]; // [chid][controller], pressed when value>=64 unless analog.
+  struct mj_map_entry aftertouchv[16][128]; // [chid][noteid]
+  struct mj_map_entry pitchv[16];
+  struct mj_map_entry pressurev[16];
+  uint8_t keybits[KEY_CNT>>3];
+  uint8_t absbits[ABS_CNT>>3];
+  int absmin[ABS_CNT],absmax[ABS_CNT];
+  int playerc; // 1 + highest player index in use. Every player gets the same capabilities.
+  uint8_t noteplayerv[16][128]; // [chid][noteid] => player, for notes and aftertouch.
+  uint8_t chplayerv[16]; // [chid] => player, for everything else.
+};
+
+struct mj_map {
+  struct mj_map_profile **profilev;
+  int profilec,profilea;
+};
+
+void mj_map_del(struct mj_map *map);
+
+/* Load from a text file, or the built-in default if (path) null.
+ * Logs errors and returns null.
+ */
+struct mj_map *mj_map_load(const char *path);
+
+/* First profile matching devid or name, in file order.
+ * If none matches, a profile that maps nothing.
+ */
+const struct mj_map_profile *mj_map_select(const struct mj_map *map,int devid,const char *name);
+
+/* Latency.
+ ****************************************************/
+ 
+/* Log-scale buckets with 4 steps per power of two, in nanoseconds.
+ * Writers only use relaxed atomic adds, so readers on other threads may see a slightly torn picture but never block anyone.
+ */
+#define MJ_LATENCY_BUCKET_COUNT 256
+#define MJ_LATENCY_TRACE_SIZE 32 // Recent samples kept verbatim, must be a power of two.
+#define MJ_LATENCY_TRACE_INTERVAL 16 // Keep one trace sample of this many.
+
+struct mj_latency {
+  uint64_t bucketv[MJ_LATENCY_BUCKET_COUNT];
+  uint64_t count,max;
+  uint32_t samplec;
+  struct mj_latency_trace {
+    int64_t time; // Arrival, CLOCK_MONOTONIC ns.
+    int64_t latency; // ns
+    int eventc; // uinput events written
+  } tracev[MJ_LATENCY_TRACE_SIZE];
+};
+
+/* CLOCK_MONOTONIC in nanoseconds.
+ */
+int64_t mj_now();
+
+void mj_latency_add(struct mj_latency *latency,int64_t rcvtime,int64_t donetime,int eventc);
+
+/* Approximate, the upper bound of the containing bucket. (percentile) in 0..1.
+ */
+int64_t mj_latency_percentile(const struct mj_latency *latency,double percentile);
+
+void mj_latency_dump(const struct mj_latency *latency,FILE *dst,const char *label);
+
+/* Real-time.
+ ****************************************************/
+
+struct mj_rt {
+  int priority; // SCHED_FIFO priority 1..99, or zero to leave the scheduler alone.
+  int cpu; // Pin to this CPU, or <0 for any.
+  int stacksize; // Prefault so many bytes of stack.
+};
+
+/* Set scheduling class and affinity, lock all memory, and prefault the stack.
+ * Once this succeeds, debug builds enforce the no-allocation rule in the hot path.
+ */
+int mj_rt_apply(const struct mj_rt *rt);
+
+/* Debug builds ("make DEBUG=1") abort on any heap allocation between these, after mj_rt_apply().
+ * Per thread, so a worker's legitimate allocation doesn't trip over main's event path, or vice versa.
+ * Only the daemon checks. libmidjoy never replaces its host's allocator.
+ * Release builds compile them to nothing.
+ */
+#if MJ_DEBUG
+  extern _Thread_local int mj_rt_hotpath;
+  extern int mj_rt_enforce;
+  #define MJ_HOTPATH_BEGIN mj_rt_hotpath++;
+  #define MJ_HOTPATH_END mj_rt_hotpath--;
+#else
+  #define MJ_HOTPATH_BEGIN
+  #define MJ_HOTPATH_END
+#endif
+
+/* Timers.
+ ****************************************************/
+ 
+/* Hierarchical timer wheel with 1 ms ticks, behind a timerfd.
+ * Watch (fd) for readability and call mj_timer_wheel_update.
+ * The timerfd is only armed when something is due, so an idle wheel costs nothing.
+ * Timers are owned by the caller and must stay put while pending. Deadlines beyond about 4.6 hours get there in steps.
+ */
+#define MJ_TIMER_LEVEL_COUNT 4
+#define MJ_TIMER_SLOT_COUNT 64
+ 
+struct mj_timer {
+  struct mj_timer *next,**pprev; // (pprev) null when not pending.
+  int64_t expiry; // Tick.
+  void (*cb)(struct mj_timer *timer);
+};
+
+struct mj_timer_wheel {
+  int fd;
+  int64_t base; // mj_now() at tick zero.
+  int64_t tick; // Next tick to process.
+  int64_t armed; // Tick the timerfd is set for, or <0.
+  int firing;
+  struct mj_timer *slotv[MJ_TIMER_LEVEL_COUNT][MJ_TIMER_SLOT_COUNT];
+  uint64_t bitv[MJ_TIMER_LEVEL_COUNT]; // Occupied slots, possibly stale.
+};
+
+int mj_timer_wheel_init(struct mj_timer_wheel *wheel);
+void mj_timer_wheel_cleanup(struct mj_timer_wheel *wheel); // Pending timers are cancelled, not fired.
+int mj_timer_wheel_update(struct mj_timer_wheel *wheel);
+
+/* (deadline) is absolute, from mj_now(). Resetting a pending timer moves it.
+ */
+int mj_timer_set(struct mj_timer_wheel *wheel,struct mj_timer *timer,int64_t deadline);
+void mj_timer_cancel(struct mj_timer *timer);
+
 /* Output.
  ****************************************************/
  
+/* Events generated by one call to mj_output_events are buffered per device and delivered in a single write.
+ * If one call generates more than this, we write the full buffer and keep going.
+ */
+#define MJ_OUTPUT_EVENT_LIMIT 128
+
+/* Timed map entries (turbo, long press, minimum duration) each hold one of these while active.
+ * A device with all of them busy treats further timed entries as plain switches.
+ */
+#define MJ_OUTPUT_TIMER_LIMIT 32
+#define MJ_OUTPUT_TAP_MS 20 /* A tap on an MJ_MAP_LONG entry holds (code) this long, if there's no (minms). */
+ 
 struct mj_output {
   char *dstpath;
+  const struct mj_output_backend *backend;
+  char *mappath;
+  struct mj_map *map;
   struct mj_output_device {
     int fd,devid;
-    int x,y;
-  } *devicev;
+    const struct mj_map_profile *profile;
+    uint8_t keyv[KEY_CNT>>3]; // Buttons down, as last written. Only changes go out.
+    int absv[ABS_CNT]; // Last value written.
+    int abspendv[ABS_CNT]; // Analog values waiting for the next flush.
+    uint64_t absdirty; // Bits of (abspendv) to flush. ABS_CNT is 64.
+    uint8_t ccstatev[16][64]; // Last value of each 14-bit controller half.
+    struct mj_midi_parser parser;
+    struct input_event eventv[MJ_OUTPUT_EVENT_LIMIT];
+    int eventc;
+    int frameeventc; // Events written since the last SYN_REPORT, for latency reporting.
+    int unsyncedc; // Events written by this record that still need a SYN_REPORT. A frame with none gets no SYN at all.
+    uint64_t writec,writeeventc; // Backend writes, and events delivered by them.
+    struct mj_latency latency;
+    struct mj_stats_slot *stats; // Shared by all players. Null if not publishing, or mj_input didn't claim one.
+    int64_t expiry; // While lingering: mj_now() time to close it. Zero for never.
+    int persistent; // Prewarmed. Lingers forever after disconnect.
+    int failed; // A write failed, or it couldn't be recreated for a new map. Writes are discarded until it recreates or disconnects.
+    struct mj_timer_wheel *timers; // Null to ignore timed behaviours.
+    struct mj_output_timer {
+      struct mj_timer timer; // Must be first.
+      struct mj_output *output;
+      struct mj_output_device *device;
+      const struct mj_map_entry *entry; // Null if free.
+      int64_t presstime;
+      int state;
+    } timerv[MJ_OUTPUT_TIMER_LIMIT];
+    int timerc; // Busy count, to skip the search when zero.
+    int player; // Zero for the primary record, which owns the others and is the only one in (devicev).
+    struct mj_output_device *playerv[MJ_MAP_PLAYER_LIMIT]; // Primary only. Players beyond (playerc) point to the primary.
+    int playerc;
+    uint32_t netseq; // Network backend: Last sequence number sent.
+    int64_t nethello; // Network backend: mj_now() of the last HELLO we repeated. Zero for the one sent at open.
+    uint32_t netdropc; // Network backend: Frames the socket wouldn't take.
+    struct mj_pad *pad; // In-process and "shm:" backends: Where this record's state is published. Found at the first write.
+  } **devicev;
   int devicec,devicea;
+  struct mj_output_device **sparev; // Preallocated device records, if mj_output_reserve() was called.
+  int sparec,sparea;
+  struct mj_output_device **lingerv; // Disconnected but still open, waiting for their devid to come back.
+  int lingerc,lingera;
+  int grace; // ms to keep a disconnected device open. Zero to close immediately.
+  struct mj_timer_wheel *timers; // Default for new devices. Optional, and we don't own it.
+  
+  /* Optional. Sysex payloads are skipped unless this is set.
+   * Called with each run of payload as it's read, then once with (final) 1 if F7 ended it, or -1 if something else did.
+   * Always on the thread that parses, which is the main thread even when the pipeline is running.
+   */
+  int (*sysex)(int devid,const void *src,int srcc,int final,void *userdata);
+  void *sysexuserdata;
+  
+  struct mj_stats *stats; // Optional, and we don't own it. Devices find the slot mj_input claimed.
+  struct mj_uring *uring; // Optional. Stage writes here instead of writing. Only if all output is on the main thread.
+  struct mj_padpage *padpage; // "shm:" backend only. Created at the first open.
 };
 
 void mj_output_cleanup(struct mj_output *output);
 int mj_output_set_dstdev(struct mj_output *output,const char *src,int srcc);
+int mj_output_set_mappath(struct mj_output *output,const char *src,int srcc);
 int mj_output_ready(struct mj_output *output);
 
-int mj_output_connect_device(struct mj_output *output,int devid);
-int mj_output_disconnect_device(struct mj_output *output,int devid);
-int mj_output_events(struct mj_output *output,int devid,const void *src,int srcc);
+/* Allocate records for (devicea) devices up front, and never allocate or free one again.
+ * That's MJ_MAP_PLAYER_LIMIT records each, since every player of a split device takes its own.
+ * Beyond that count, connecting fails.
+ * Must be called before any device connects.
+ */
+int mj_output_reserve(struct mj_output *output,int devicea);
+
+/* Load the map file again and apply it to all connected devices.
+ * Held buttons are released and axes centered first.
+ * On any error, we log it and keep the old map.
+ * Devices keep the capabilities they were created with; new ones take effect when the device reconnects.
+ */
+int mj_output_reload_map(struct mj_output *output);
+
+/* Device records are stable until disconnected; hold on to them.
+ * Disconnecting with a (grace) period releases everything and leaves the device open.
+ * Connecting the same devid again before it expires reuses it, and the game never sees it go away.
+ */
+struct mj_output_device *mj_output_connect_device(struct mj_output *output,int devid);
+int mj_output_disconnect_device(struct mj_output *output,struct mj_output_device *device);
+struct mj_output_device *mj_output_device_by_devid(const struct mj_output *output,int devid);
+
+/* Create a device for (devid) now, before its MIDI device shows up, and keep it open forever.
+ * Call after mj_output_ready (and mj_output_reserve, if you're using it).
+ */
+int mj_output_prewarm(struct mj_output *output,int devid);
+
+/* Close lingering devices whose grace period has run out, as of (now).
+ * Returns ms until the next one expires, or <0 if there's nothing to wait for.
+ */
+int mj_output_expire(struct mj_output *output,int64_t now);
+
+/* Point a device and all its players at a different timer wheel, eg a worker thread's.
+ */
+void mj_output_set_timers(struct mj_output_device *device,struct mj_timer_wheel *timers);
+
+/* (rcvtime) is when (src) arrived, from mj_now(), for latency tracking. Zero to skip that.
+ */
+int mj_output_events(struct mj_output *output,struct mj_output_device *device,const void *src,int srcc,int64_t rcvtime);
+
+/* Forward a MJ_MIDI_SYSEX_DATA or MJ_MIDI_SYSEX_END event to (output->sysex), if set.
+ * Callers that parse on their own should route those two opcodes here instead of mj_output_event.
+ */
+int mj_output_sysex(struct mj_output *output,int devid,const struct mj_midi_parser *parser,const struct mj_midi_event *event);
+
+/* Where frames go. Usually picked by a prefix on dstdev; set (output->backend) before mj_output_ready to override.
+ * (open) makes the sink for one device, or one player of a split device. It returns an fd, or zero if it doesn't use one.
+ * Frames are delivered by (write), which returns <0 on any failure.
+ * (direct) if (write) is just write() to the fd, so io_uring can stand in for it.
+ * (close) is optional, to say goodbye before we close the fd.
+ */
+struct mj_output_backend {
+  const char *prefix;
+  int direct;
+  int (*open)(struct mj_output *output,const char *path,int devid,int player,const struct mj_map_profile *profile);
+  int (*write)(struct mj_output *output,struct mj_output_device *device,const void *src,int srcc);
+  void (*close)(struct mj_output *output,struct mj_output_device *device);
+};
+
+/* Open a sink the way a connecting device would, for (dstpath) in mj_output_set_dstdev's format.
+ * For the network receiver. Only sinks that take raw input_events with write(): uinput and "file:".
+ */
+int mj_output_open_sink(const char *dstpath,int devid,int player,const struct mj_map_profile *profile);
+
+/* Lower-level alternative to mj_output_events, for callers that parse on their own:
+ * Deliver any number of events, then commit once to write the frame.
+ */
+int mj_output_event(struct mj_output *output,struct mj_output_device *device,const struct mj_midi_event *event);
+int mj_output_commit(struct mj_output *output,struct mj_output_device *device,int64_t rcvtime);
+
+/* Print each device's latency report.
+ */
+void mj_output_dump_latency(const struct mj_output *output,FILE *dst);
+
+/* Pipeline.
+ ****************************************************/
+ 
+/* Optional threaded mode.
+ * The main thread reads and parses as usual, and pushes events onto a lock-free single-producer/single-consumer ring per device.
+ * Worker threads own the output devices: They connect, translate, and write.
+ * A slow UI_DEV_CREATE or a blocked write only delays the devices on that worker.
+ * Use mj_pipeline_rcvin as the mj_input callback, with the pipeline as its userdata.
+ */
+struct mj_pipeline {
+  struct mj_output *output;
+  int workerc; // How many output threads.
+  const int *cpuv; // Pin workers to these CPUs, round-robin. Optional.
+  int cpuc;
+  int ringsize; // Messages per device, rounded up to a power of two.
+  int devicea; // Preallocate so many devices, rings and all, at start, and never allocate another. Zero to allocate as they connect.
+  struct mj_pipeline_worker **workerv;
+  struct mj_pipe_device **sparev; // Idle preallocated devices, under (listlock).
+  int sparec;
+  pthread_mutex_t listlock; // Held by workers while connecting or disconnecting.
+  int stop;
+};
+
+int mj_pipeline_start(struct mj_pipeline *pipeline);
+
+/* Workers finish what's queued, then we join them.
+ * Output devices are not disconnected; clean up the output after this.
+ */
+void mj_pipeline_stop(struct mj_pipeline *pipeline);
+
+int mj_pipeline_rcvin(struct mj_input_device *device,const void *src,int srcc,void *userdata);
+
+/* Block until every worker is idle, and keep them that way until resumed.
+ * While paused, it's safe to touch the mj_output and its devices from the main thread.
+ * Noop if the pipeline isn't running.
+ */
+void mj_pipeline_pause(struct mj_pipeline *pipeline);
+void mj_pipeline_resume(struct mj_pipeline *pipeline);
+
+/* Pause every worker and call the mj_output function of the same name.
+ */
+int mj_pipeline_reload_map(struct mj_pipeline *pipeline);
+void mj_pipeline_dump_latency(struct mj_pipeline *pipeline,FILE *dst);
+
+/* mj_output_expire, with the locking that needs. Works whether running or not.
+ */
+int mj_pipeline_expire(struct mj_pipeline *pipeline);
+
+/* Control socket.
+ ****************************************************/
+ 
+/* Line-oriented commands on a Unix stream socket, served from the main loop. Send "help" for the list.
+ * Clients are nonblocking. A reply that doesn't fit in the socket buffer gets truncated, we never wait for it.
+ */
+struct mj_control {
+  struct mj_input *input;
+  struct mj_output *output;
+  struct mj_pipeline *pipeline; // Optional; we pause it while touching output devices.
+  int *timeout; // Main loop's timeout in ms, which we are allowed to change.
+  char *path;
+  int fd;
+  struct mj_control_client {
+    int fd;
+    char rbuf[256];
+    int rbufc;
+  } **clientv;
+  int clientc,clienta;
+};
+
+void mj_control_cleanup(struct mj_control *control);
+
+/* Bind and listen at (path), and start watching it via (control->input).
+ * Populate (input,output,pipeline,timeout) first.
+ */
+int mj_control_listen(struct mj_control *control,const char *path);
+
+/* Record and replay.
+ ****************************************************/
+ 
+/* Recording wraps the mj_input callback: Every delivery is logged with its devid and time, then passed along.
+ * The log is a fixed-size ring in a memory-mapped file, so recording costs a memcpy and no syscalls.
+ * When full, the oldest records are overwritten.
+ * Hellos and farewells are recorded too, so replay connects and disconnects the same way.
+ */
+struct mj_record {
+  int fd;
+  void *map;
+  size_t mapsize;
+  struct mj_record_header *header;
+  uint8_t *data;
+  int (*cb)(struct mj_input_device *device,const void *src,int srcc,void *userdata);
+  void *userdata;
+};
+
+void mj_record_cleanup(struct mj_record *record);
+
+/* Create or replace the log at (path), with room for (size) bytes of records.
+ */
+int mj_record_open(struct mj_record *record,const char *path,int size);
+
+/* Usable as mj_input's callback, with the record as userdata. Populate (cb,userdata) first.
+ */
+int mj_record_rcvin(struct mj_input_device *device,const void *src,int srcc,void *userdata);
+
+/* Replay feeds a log back through (input->cb), from a timerfd in the input's poll set.
+ * Realtime preserves the original spacing, and we track how late each delivery was.
+ * Fast delivers everything as quickly as the loop turns, a batch at a time.
+ * (done) is set once everything is delivered and every replayed device said farewell.
+ */
+#define MJ_REPLAY_DEVICE_LIMIT 64
+ 
+struct mj_replay {
+  struct mj_input *input;
+  int fast;
+  int fd;
+  void *map;
+  size_t mapsize;
+  const struct mj_record_header *header;
+  const uint8_t *data;
+  uint64_t p,end; // Cursor and limit, in the header's virtual positions.
+  int64_t starttime,basetime; // Our mj_now() at the start, and the first record's time.
+  int timerfd;
+  struct mj_input_device devicev[MJ_REPLAY_DEVICE_LIMIT]; // (devid) <0 if unused.
+  int devicec;
+  int done;
+  uint64_t recordc,bytec;
+  struct mj_latency lateness;
+};
+
+void mj_replay_cleanup(struct mj_replay *replay);
+int mj_replay_start(struct mj_replay *replay,struct mj_input *input,const char *path,int fast);
+void mj_replay_report(const struct mj_replay *replay,FILE *dst);
+
+/* Standard MIDI File playback.
+ * Plays a .mid file into (input->cb) as one more device, from a timerfd in the input's poll set, same as replay.
+ * All tracks are merged at load into one array sorted by time, with tempo already applied, so playing only walks it.
+ * Deadlines are absolute on mj_now()'s clock from the start, so lateness never accumulates.
+ * Everything due at one wakeup goes out as one span, like one read from a device.
+ * Formats 0 and 1 only. Meta events other than tempo and end of track are ignored.
+ */
+#define MJ_SMF_DEFAULT_DEVID 128 /* Clear of any /dev/midiN we're likely to see. */
+#define MJ_SMF_SPAN_LIMIT 256
+
+struct mj_smf_event {
+  int64_t time; // ns from start
+  uint32_t p,c; // Sysex only: Payload in the file.
+  uint8_t v[3]; // Channel message, or F0 for Sysex (we add the F0), or F7 for an escape (sent as is).
+  uint8_t vc; // Length of (v) to send, zero for an escape.
+};
+
+struct mj_smf {
+  struct mj_input *input;
+  int fd;
+  void *map;
+  size_t mapsize;
+  struct mj_smf_event *eventv;
+  int eventc,eventp;
+  int64_t starttime;
+  int timerfd;
+  struct mj_input_device device;
+  int done;
+  uint8_t spanv[MJ_SMF_SPAN_LIMIT];
+  int spanc;
+  uint64_t bytec;
+  int64_t latesum; // ns
+  struct mj_latency lateness;
+};
+
+void mj_smf_cleanup(struct mj_smf *smf);
+int mj_smf_start(struct mj_smf *smf,struct mj_input *input,const char *path,int devid);
+void mj_smf_report(const struct mj_smf *smf,FILE *dst);
+
+/* Stats page.
+ ****************************************************/
+ 
+/* Counters per device in a shared memory-mapped file (eg /run/midjoy.stats), for monitors to read without asking us.
+ * Each slot belongs to one devid for the life of the process, and accumulates across reconnects.
+ * Every counter has exactly one writer thread, so updates are a relaxed load and store, no locked instructions.
+ * Readers see each counter whole, but not a consistent snapshot across counters.
+ * Layout is the 64-byte header, then (slotc) slots of (slotsize) bytes, each on its own cache line.
+ */
+#define MJ_STATS_MAGIC "MIDJOYS\3"
+#define MJ_STATS_DEFAULT_PATH "/run/midjoy.stats"
+#define MJ_STATS_DEFAULT_SLOTC 64
+#define MJ_STATS_VOICE_COUNT 7 /* Channel Voice 0x80..0xe0 by high nybble. */
+#define MJ_STATS_SYSTEM_COUNT 16 /* System 0xf0..0xff. */
+#define MJ_STATS_OPCODE_COUNT (MJ_STATS_VOICE_COUNT+MJ_STATS_SYSTEM_COUNT) /* Voice then System, for mj_stats_msgc(). */
+
+struct mj_stats_header {
+  char magic[8];
+  uint32_t slotsize;
+  uint32_t slotc;
+  int32_t pid; // Zero after a clean exit.
+  uint32_t reserved;
+  int64_t starttime; // mj_now(). CLOCK_MONOTONIC is the same in every process.
+  uint8_t pad[32]; // Header is one cache line, so every slot starts on its own.
+};
+
+struct mj_stats_slot {
+  // Main thread: mj_input, and whoever parses.
+  int32_t devid; // -1 if unused. Stored with release, after the rest of the slot is ready.
+  uint32_t connected;
+  uint64_t connectc,disconnectc;
+  uint64_t readc,bytec;
+  uint64_t errorc; // Parse errors, see mj_midi_parser.
+  uint64_t systemv[MJ_STATS_SYSTEM_COUNT]; // Sysex at its end, and Realtime. The parser counts these, never the output.
+  // The thread that owns the output device. From here on, no line is shared with main when the pipeline runs.
+  uint64_t voicev[MJ_STATS_VOICE_COUNT] __attribute__((aligned(64)));
+  uint64_t eventc,writec; // uinput events, and the writes that carried them.
+  int64_t lastevent; // Receive time, from mj_now(), of the last input that produced output.
+} __attribute__((aligned(64)));
+
+#define MJ_STATS_ADD(slot,field,n) do { if (slot) { \
+  __atomic_store_n(&(slot)->field,__atomic_load_n(&(slot)->field,__ATOMIC_RELAXED)+(n),__ATOMIC_RELAXED); \
+} } while (0)
+#define MJ_STATS_SET(slot,field,v) do { if (slot) __atomic_store_n(&(slot)->field,(v),__ATOMIC_RELAXED); } while (0)
+#define MJ_STATS_VOICE_INDEX(opcode) (((opcode)>>4)-8)
+#define MJ_STATS_SYSTEM_INDEX(opcode) ((opcode)&0x0f)
+
+/* Count for opcode (p) in 0..MJ_STATS_OPCODE_COUNT-1, for readers who don't care which thread counted it.
+ */
+static inline uint64_t mj_stats_msgc(const struct mj_stats_slot *slot,int p) {
+  if (p<MJ_STATS_VOICE_COUNT) return slot->voicev[p];
+  return slot->systemv[p-MJ_STATS_VOICE_COUNT];
+}
+
+struct mj_stats {
+  int fd;
+  void *map;
+  size_t mapsize;
+  struct mj_stats_header *header;
+  struct mj_stats_slot *slotv;
+  int slotc;
+};
+
+/* Unmap, and mark the header stopped. The file stays, with final counts.
+ */
+void mj_stats_cleanup(struct mj_stats *stats);
+
+/* Create or replace the file at (path), with room for (slotc) devices, or zero for the default.
+ */
+int mj_stats_open(struct mj_stats *stats,const char *path,int slotc);
+
+/* Slot for (devid), claiming a fresh one if (create) and there's room.
+ * Only the main thread may create. Anyone may look up.
+ * Null if (stats) is null, or no slot.
+ */
+struct mj_stats_slot *mj_stats_get(struct mj_stats *stats,int devid,int create);
+
+/* Move the Realtime counts out of (parser) and into (slot), and zero them in (parser).
+ * Noop if (slot) null; the counts keep waiting.
+ */
+void mj_stats_add_realtime(struct mj_stats_slot *slot,struct mj_midi_parser *parser);
+
+/* io_uring.
+ ****************************************************/
+ 
+/* Optional replacement for epoll_wait, device reads, and output writes, selected at runtime (--io=uring).
+ * Each MIDI device has a READ standing in the ring, and output writes are staged in memory.
+ * One io_uring_enter submits the re-armed reads and all staged writes, and waits for the next completions.
+ * Everything else mj_input watches stays on epoll, and the ring polls the epoll fd.
+ * Raw syscalls, no liburing. Main thread only: With the pipeline running, workers still write for themselves.
+ *
+ * uinput can't write without blocking, so the kernel hands those writes to its own worker threads.
+ * To keep each device's events in order, a batch of writes is one linked chain,
+ * and the next batch waits until the previous one has completed. Staging is double-buffered for that.
+ */
+#define MJ_URING_ENTRIES 256
+#define MJ_URING_STAGE_SIZE (64<<10)
+#define MJ_URING_WRITE_LIMIT 64 /* Per batch. */
+#define MJ_URING_STAMP_LIMIT 256 /* Latency samples per batch. Past that, they're taken at staging. */
+#define MJ_URING_USER_WRITE 1 /* user_data below 16 is reserved. Pointers are at least 16-aligned. */
+#define MJ_URING_USER_CANCEL 2
+#define MJ_URING_USER_POLL 3 /* A POLL linked ahead of a READ, when the kernel wouldn't wait in the READ. */
+#define MJ_URING_USER_EPOLL 4 /* mj_input's poll on its epoll fd. */
+
+struct mj_uring {
+  int fd;
+  void *sqmap,*cqmap; // Same thing if the kernel has IORING_FEAT_SINGLE_MMAP.
+  size_t sqmapsize,cqmapsize;
+  struct io_uring_sqe *sqev;
+  size_t sqevsize;
+  uint32_t *sqhead,*sqtail,*sqarray;
+  uint32_t sqmask,sqentries;
+  uint32_t *cqhead,*cqtail;
+  uint32_t cqmask;
+  struct io_uring_cqe *cqev;
+  uint32_t pendingc; // SQEs written but not submitted.
+  
+  // Writes: (stage) collects this batch while the other buffer might be in flight.
+  struct mj_uring_stage {
+    uint8_t *v;
+    int c;
+    struct mj_uring_write { int fd,p,c; int *failed; } writev[MJ_URING_WRITE_LIMIT];
+    int writec;
+    struct mj_uring_stamp { struct mj_latency *latency; int64_t rcvtime; int eventc; } stampv[MJ_URING_STAMP_LIMIT];
+    int stampc;
+  } stagev[2];
+  int stage; // Index in (stagev) being collected.
+  int inflightc; // Writes submitted and not yet completed.
+  
+  // Completions that arrived while we were waiting for writes, to deliver at the next mj_uring_update.
+  struct io_uring_cqe *deferv;
+  int deferc,defera;
+  
+  uint64_t enterc,batchc;
+};
+
+void mj_uring_cleanup(struct mj_uring *uring);
+
+/* Fails if the kernel doesn't have io_uring, or lacks a feature we need. Caller should fall back to epoll.
+ */
+int mj_uring_init(struct mj_uring *uring);
+
+/* A zeroed SQE to fill in. It goes with the next submission.
+ * Submits early if the ring is full. Null only if that fails.
+ */
+struct io_uring_sqe *mj_uring_sqe(struct mj_uring *uring);
+
+/* Copy into the stage, to write at the next mj_uring_update. Fails only if it can't make room.
+ * If the write fails when it completes, we log it and set (*failed), unless that's set already. Not optional.
+ */
+int mj_uring_write(struct mj_uring *uring,int fd,const void *src,int srcc,int *failed);
+
+/* Add a latency sample for the frame just staged, once its batch has completed. Same as mj_latency_add otherwise.
+ */
+void mj_uring_stamp(struct mj_uring *uring,struct mj_latency *latency,int64_t rcvtime,int eventc);
+
+/* Submit everything, wait up to (to_ms) for at least one completion, and deliver all completions.
+ * Writes are handled internally. Anything else goes to (cb). Fails if (cb) or the ring itself does; failed writes only flag their owner.
+ */
+int mj_uring_update(
+  struct mj_uring *uring,int to_ms,
+  int (*cb)(struct mj_uring *uring,const struct io_uring_cqe *cqe,void *userdata),
+  void *userdata
+);
+
+/* Block until every staged write has been written. Other completions are held for the next update.
+ * For teardown, before closing the fds.
+ */
+int mj_uring_drain_writes(struct mj_uring *uring);
+
+/* Network output.
+ ****************************************************/
+ 
+/* dstdev "udp:HOST:PORT" or "unix:PATH" sends each device's frames as datagrams, for midjoy-netrecv on the far side.
+ * One socket per device (and player). Every frame has a sequence number, counting from the HELLO at zero.
+ * A gap in sequence is loss. Sending never blocks: A frame the socket won't take is dropped, and the receiver sees the gap.
+ * HELLO carries the capabilities, so the receiver can create a matching joystick. We repeat it at most once a second
+ * while the device is active, so a receiver that starts late (or lost the first one) catches up.
+ * Multi-byte fields are little-endian.
+ */
+#define MJ_NET_VERSION 1
+#define MJ_NET_HELLO  1
+#define MJ_NET_EVENTS 2
+#define MJ_NET_BYE    3
+#define MJ_NET_HELLO_INTERVAL_NS 1000000000ll
+#define MJ_NET_UDP  1
+#define MJ_NET_UNIX 2
+
+struct mj_net_header {
+  uint8_t magic[2]; // "MJ"
+  uint8_t version;
+  uint8_t kind; // MJ_NET_*
+  int32_t devid;
+  uint32_t seq; // Per (devid,player).
+  uint8_t player;
+  uint8_t reserved;
+  uint16_t eventc; // EVENTS: Count of mj_net_event following.
+};
+
+struct mj_net_event {
+  uint16_t type,code;
+  int32_t value;
+};
+
+struct mj_net_hello {
+  uint8_t keybits[KEY_CNT>>3];
+  uint8_t absbits[ABS_CNT>>3];
+  int32_t absmin[ABS_CNT],absmax[ABS_CNT];
+};
+
+#define MJ_NET_FRAME_LIMIT (sizeof(struct mj_net_header)+sizeof(struct mj_net_hello)) /* Largest frame; EVENTS are smaller. */
+
+/* Socket for (kind) at (path), "HOST:PORT" or a filesystem path.
+ * (listen) to bind it, otherwise we connect it, but a Unix path with nobody listening yet is not an error.
+ */
+int mj_net_socket(int kind,const char *path,int listen);
+
+/* Backend hooks for mj_output.
+ */
+int mj_net_open_udp(struct mj_output *output,const char *path,int devid,int player,const struct mj_map_profile *profile);
+int mj_net_open_unix(struct mj_output *output,const char *path,int devid,int player,const struct mj_map_profile *profile);
+int mj_net_write(struct mj_output *output,struct mj_output_device *device,const void *src,int srcc);
+void mj_net_close(struct mj_output *output,struct mj_output_device *device);
+
+/* Receiver side. Fill (profile) capabilities from a HELLO. Everything else in it is untouched.
+ */
+void mj_net_hello_decode(struct mj_map_profile *profile,const struct mj_net_hello *hello);
+
+/* Pad page.
+ ****************************************************/
+
+/* The "shm:PATH" output backend: Each joystick's whole state in a shared file, layout in libmidjoy.h.
+ * Slots are claimed by (devid,player) at open, under the pipeline's list lock if there is one, and never released.
+ * Every slot has one writer, the thread that owns its device. It publishes (keyv) and (absv) at each SYN_REPORT.
+ */
+#define MJ_PADPAGE_DEFAULT_SLOTC 64
+
+struct mj_padpage {
+  int fd;
+  void *map;
+  size_t mapsize;
+  struct mj_padpage_header *header;
+  struct mj_padpage_slot *slotv;
+  int slotc;
+};
+
+/* Unmap, and mark the header stopped. The file stays, with the final (disconnected) state.
+ */
+void mj_padpage_del(struct mj_padpage *page);
+
+/* Backend hooks for mj_output.
+ */
+int mj_padpage_open(struct mj_output *output,const char *path,int devid,int player,const struct mj_map_profile *profile);
+int mj_padpage_write(struct mj_output *output,struct mj_output_device *device,const void *src,int srcc);
+void mj_padpage_close(struct mj_output *output,struct mj_output_device *device);
 
 #endif
@@ -0,0 +1,309 @@
+#define _GNU_SOURCE
+#include "midjoy.h"
+#include <unistd.h>
+#include <errno.h>
+#include <stdarg.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+
+#define MJ_CONTROL_CLIENT_LIMIT 16
+
+/* Cleanup.
+ */
+ 
+static void mj_control_client_del(struct mj_control *control,struct mj_control_client *client) {
+  if (client->fd>0) {
+    mj_input_unwatch_fd(control->input,client->fd);
+    close(client->fd);
+  }
+  free(client);
+}
+ 
+void mj_control_cleanup(struct mj_control *control) {
+  if (control->clientv) {
+    while (control->clientc-->0) mj_control_client_del(control,control->clientv[control->clientc]);
+    free(control->clientv);
+  }
+  if (control->fd>0) {
+    mj_input_unwatch_fd(control->input,control->fd);
+    close(control->fd);
+  }
+  if (control->path) {
+    unlink(control->path);
+    free(control->path);
+  }
+  memset(control,0,sizeof(struct mj_control));
+}
+
+/* Reply buffer.
+ */
+ 
+struct mj_control_reply {
+  char v[8192];
+  int c;
+};
+
+static void mj_control_reply(struct mj_control_reply *reply,const char *fmt,...) {
+  if (reply->c>=sizeof(reply->v)-1) return;
+  va_list vargs;
+  va_start(vargs,fmt);
+  int err=vsnprintf(reply->v+reply->c,sizeof(reply->v)-reply->c,fmt,vargs);
+  va_end(vargs);
+  if (err<0) return;
+  reply->c+=err;
+  if (reply->c>=sizeof(reply->v)) reply->c=sizeof(reply->v)-1; // Truncated. vsnprintf's terminator isn't part of the reply.
+}
+
+/* Commands.
+ */
+ 
+static void mj_control_cmd_help(struct mj_control *control,struct mj_control_reply *reply,const char *arg) {
+  mj_control_reply(reply,
+    "list: Connected devices.\n"
+    "stats: Counters per device.\n"
+    "latency: Latency report per device.\n"
+    "reload: Reload the map file.\n"
+    "map PATH: Switch to a different map file, and load it.\n"
+    "detach DEVID: Disconnect a device and ignore it.\n"
+    "attach DEVID: Allow a detached device again.\n"
+    "timeout MS: Main loop timeout, negative for none.\n"
+  );
+}
+ 
+static void mj_control_cmd_list(struct mj_control *control,struct mj_control_reply *reply,const char *arg) {
+  int i=0;
+  for (;i<control->input->devicec;i++) {
+    const struct mj_input_device *device=control->input->devicev[i];
+    mj_control_reply(reply,"input %d\n",device->devid);
+  }
+  mj_pipeline_pause(control->pipeline);
+  for (i=0;i<control->output->devicec;i++) {
+    const struct mj_output_device *device=control->output->devicev[i];
+    const struct mj_map_profile *profile=device->profile;
+    if (profile->name) mj_control_reply(reply,"output %d profile \"%s\"\n",device->devid,profile->name);
+    else if (profile->devid>=0) mj_control_reply(reply,"output %d profile %d\n",device->devid,profile->devid);
+    else mj_control_reply(reply,"output %d profile *\n",device->devid);
+  }
+  for (i=0;i<control->output->lingerc;i++) {
+    const struct mj_output_device *device=control->output->lingerv[i];
+    if (device->persistent) mj_control_reply(reply,"lingering %d prewarmed\n",device->devid);
+    else mj_control_reply(reply,"lingering %d expires %lld ms\n",device->devid,(long long)(device->expiry-mj_now())/1000000);
+  }
+  mj_pipeline_resume(control->pipeline);
+  for (i=0;i<control->input->ignorec;i++) {
+    mj_control_reply(reply,"detached %d\n",control->input->ignorev[i]);
+  }
+}
+ 
+static void mj_control_cmd_stats(struct mj_control *control,struct mj_control_reply *reply,const char *arg) {
+  mj_control_reply(reply,"input waits %llu reads %llu\n",
+    (unsigned long long)control->input->waitc,
+    (unsigned long long)control->input->readc
+  );
+  mj_pipeline_pause(control->pipeline);
+  int i=0;
+  for (;i<control->output->devicec;i++) {
+    const struct mj_output_device *device=control->output->devicev[i];
+    mj_control_reply(reply,"output %d writes %llu events %llu frames %llu\n",
+      device->devid,
+      (unsigned long long)device->writec,
+      (unsigned long long)device->writeeventc,
+      (unsigned long long)device->latency.count
+    );
+  }
+  mj_pipeline_resume(control->pipeline);
+}
+ 
+static void mj_control_cmd_latency(struct mj_control *control,struct mj_control_reply *reply,const char *arg) {
+  char *v=0;
+  size_t c=0;
+  FILE *f=open_memstream(&v,&c);
+  if (!f) return;
+  mj_pipeline_pause(control->pipeline);
+  mj_output_dump_latency(control->output,f);
+  mj_pipeline_resume(control->pipeline);
+  fclose(f);
+  mj_control_reply(reply,"%.*s",(int)c,v);
+  free(v);
+}
+ 
+static void mj_control_cmd_reload(struct mj_control *control,struct mj_control_reply *reply,const char *arg) {
+  mj_pipeline_pause(control->pipeline);
+  int err=mj_output_reload_map(control->output);
+  mj_pipeline_resume(control->pipeline);
+  if (err<0) mj_control_reply(reply,"error: Reload failed.\n");
+}
+ 
+static void mj_control_cmd_map(struct mj_control *control,struct mj_control_reply *reply,const char *arg) {
+  if (!arg[0]) {
+    mj_control_reply(reply,"error: Path required.\n");
+    return;
+  }
+  // Verify the new file before committing to it, so a typo doesn't leave us pointing at nothing.
+  struct mj_map *map=mj_map_load(arg);
+  if (!map) {
+    mj_control_reply(reply,"error: Failed to load map.\n");
+    return;
+  }
+  mj_map_del(map);
+  if (mj_output_set_mappath(control->output,arg,-1)<0) {
+    mj_control_reply(reply,"error: Out of memory.\n");
+    return;
+  }
+  mj_control_cmd_reload(control,reply,"");
+}
+ 
+static void mj_control_cmd_detach(struct mj_control *control,struct mj_control_reply *reply,const char *arg) {
+  if ((arg[0]<'0')||(arg[0]>'9')||(mj_input_detach(control->input,atoi(arg))<0)) {
+    mj_control_reply(reply,"error: Invalid devid.\n");
+  }
+}
+ 
+static void mj_control_cmd_attach(struct mj_control *control,struct mj_control_reply *reply,const char *arg) {
+  if ((arg[0]<'0')||(arg[0]>'9')||(mj_input_attach(control->input,atoi(arg))<0)) {
+    mj_control_reply(reply,"error: Not detached.\n");
+  }
+}
+ 
+static void mj_control_cmd_timeout(struct mj_control *control,struct mj_control_reply *reply,const char *arg) {
+  if (!control->timeout||!arg[0]) {
+    mj_control_reply(reply,"error: Invalid timeout.\n");
+    return;
+  }
+  *(control->timeout)=atoi(arg);
+}
+
+static const struct mj_control_command {
+  const char *name;
+  void (*fn)(struct mj_control *control,struct mj_control_reply *reply,const char *arg);
+} mj_control_commandv[]={
+  {"help",mj_control_cmd_help},
+  {"list",mj_control_cmd_list},
+  {"stats",mj_control_cmd_stats},
+  {"latency",mj_control_cmd_latency},
+  {"reload",mj_control_cmd_reload},
+  {"map",mj_control_cmd_map},
+  {"detach",mj_control_cmd_detach},
+  {"attach",mj_control_cmd_attach},
+  {"timeout",mj_control_cmd_timeout},
+};
+
+/* Execute one line and send the reply.
+ */
+ 
+static void mj_control_execute(struct mj_control *control,struct mj_control_client *client,char *src,int srcc) {
+  while (srcc&&((unsigned char)src[srcc-1]<=0x20)) srcc--;
+  while (srcc&&((unsigned char)src[0]<=0x20)) { src++; srcc--; }
+  if (!srcc) return;
+  src[srcc]=0;
+  int kwc=0;
+  while ((kwc<srcc)&&((unsigned char)src[kwc]>0x20)) kwc++;
+  const char *arg=src+kwc;
+  while (*arg&&((unsigned char)*arg<=0x20)) arg++;
+  
+  struct mj_control_reply reply={0};
+  const struct mj_control_command *command=mj_control_commandv;
+  int i=sizeof(mj_control_commandv)/sizeof(struct mj_control_command);
+  for (;i-->0;command++) {
+    if (strncmp(command->name,src,kwc)||command->name[kwc]) continue;
+    command->fn(control,&reply,arg);
+    break;
+  }
+  if (i<0) mj_control_reply(&reply,"error: Unknown command '%.*s'.\n",kwc,src);
+  else if ((reply.c<7)||memcmp(reply.v,"error: ",7)) mj_control_reply(&reply,"ok\n");
+  send(client->fd,reply.v,reply.c,MSG_DONTWAIT|MSG_NOSIGNAL);
+}
+
+/* Client readable.
+ */
+ 
+static int mj_control_update_client(struct mj_input *input,struct mj_input_watch *watch) {
+  struct mj_control *control=watch->userdata;
+  struct mj_control_client *client=0;
+  int clientp=control->clientc;
+  while (clientp-->0) {
+    if (control->clientv[clientp]->fd==watch->fd) {
+      client=control->clientv[clientp];
+      break;
+    }
+  }
+  if (!client) return 0;
+  
+  int err=recv(client->fd,client->rbuf+client->rbufc,sizeof(client->rbuf)-1-client->rbufc,MSG_DONTWAIT);
+  if ((err<0)&&((errno==EAGAIN)||(errno==EINTR))) return 0;
+  if (err<=0) {
+    control->clientc--;
+    memmove(control->clientv+clientp,control->clientv+clientp+1,sizeof(void*)*(control->clientc-clientp));
+    mj_control_client_del(control,client);
+    return 0;
+  }
+  client->rbufc+=err;
+  
+  int linep=0,i=0;
+  for (;i<client->rbufc;i++) {
+    if (client->rbuf[i]!=0x0a) continue;
+    mj_control_execute(control,client,client->rbuf+linep,i-linep);
+    linep=i+1;
+  }
+  if (linep) {
+    client->rbufc-=linep;
+    memmove(client->rbuf,client->rbuf+linep,client->rbufc);
+  } else if (client->rbufc>=sizeof(client->rbuf)-1) {
+    static const char msg[]="error: Line too long.\n";
+    send(client->fd,msg,sizeof(msg)-1,MSG_DONTWAIT|MSG_NOSIGNAL);
+    client->rbufc=0;
+  }
+  return 0;
+}
+
+/* Accept connection.
+ */
+ 
+static int mj_control_update_server(struct mj_input *input,struct mj_input_watch *watch) {
+  struct mj_control *control=watch->userdata;
+  int fd=accept4(control->fd,0,0,SOCK_NONBLOCK|SOCK_CLOEXEC);
+  if (fd<0) return 0;
+  if (control->clientc>=MJ_CONTROL_CLIENT_LIMIT) {
+    close(fd);
+    return 0;
+  }
+  if (control->clientc>=control->clienta) {
+    int na=control->clienta+4;
+    void *nv=realloc(control->clientv,sizeof(void*)*na);
+    if (!nv) { close(fd); return 0; }
+    control->clientv=nv;
+    control->clienta=na;
+  }
+  struct mj_control_client *client=calloc(1,sizeof(struct mj_control_client));
+  if (!client) { close(fd); return 0; }
+  if (mj_input_watch_fd(control->input,fd,mj_control_update_client,control)<0) {
+    free(client);
+    close(fd);
+    return 0;
+  }
+  client->fd=fd;
+  control->clientv[control->clientc++]=client;
+  return 0;
+}
+
+/* Listen.
+ */
+ 
+int mj_control_listen(struct mj_control *control,const char *path) {
+  if (!control->input||!control->output||control->fd||!path) return -1;
+  struct sockaddr_un addr={.sun_family=AF_UNIX};
+  int pathc=strlen(path);
+  if (pathc>=sizeof(addr.sun_path)) return -1;
+  memcpy(addr.sun_path,path,pathc);
+  
+  if ((control->fd=socket(AF_UNIX,SOCK_STREAM|SOCK_NONBLOCK|SOCK_CLOEXEC,0))<0) return -1;
+  unlink(path); // In case a previous instance crashed. We assume nobody else is using our path.
+  if (bind(control->fd,(struct sockaddr*)&addr,sizeof(addr))<0) {
+    fprintf(stderr,"%s: Failed to bind control socket.\n",path);
+    return -1;
+  }
+  if (!(control->path=strdup(path))) return -1;
+  if (listen(control->fd,4)<0) return -1;
+  if (mj_input_watch_fd(control->input,control->fd,mj_control_update_server,control)<0) return -1;
+  return 0;
+}
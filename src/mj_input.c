@@ -4,27 +4,68 @@
 #include <dirent.h>
 #include <errno.h>
 #include <sys/inotify.h>
-#include <sys/poll.h>
+#include <sys/epoll.h>
+#include <sys/socket.h>
+#include <sys/timerfd.h>
+#include <poll.h>
+#include <linux/netlink.h>
 
 #define MJ_INPUT_DEFAULT_SRCDIR "/dev/"
+#define MJ_INPUT_EPOLL_LIMIT 16
+#define MJ_INPUT_DEFAULT_RXSIZE 4096
+#define MJ_INPUT_DRAIN_LIMIT 4 /* Buffers per wakeup, so one chatty device can't starve the rest. */
+#define MJ_INPUT_RETRY_FIRST_MS 10 /* Doubling each time... */
+#define MJ_INPUT_RETRY_ATTEMPTS 10 /* ...about 10 seconds in all. */
 
 static const uint8_t MJ_INPUT_HELLO_EVENT[]={0xf0,0xf7};
 
 /* Cleanup.
  */
  
-static void mj_input_device_cleanup(struct mj_input_device *device) {
-  if (device->fd>0) close(device->fd);
+static void mj_input_device_del(struct mj_input_device *device) {
+  if (!device) return;
+  if (device->watch.fd>0) close(device->watch.fd);
+  if (device->rxv) free(device->rxv);
+  free(device);
 }
 
+/* Return a device record to the spare pool, or free it if we're not pooling.
+ */
+ 
+static void mj_input_device_release(struct mj_input *input,struct mj_input_device *device) {
+  if (input->sparea) {
+    if (device->watch.fd>0) close(device->watch.fd);
+    uint8_t *rxv=device->rxv;
+    memset(device,0,sizeof(struct mj_input_device));
+    device->rxv=rxv;
+    input->sparev[input->sparec++]=device;
+  } else {
+    mj_input_device_del(device);
+  }
+}
+
+static void mj_input_uring_cancel_all(struct mj_input *input);
+
 void mj_input_cleanup(struct mj_input *input) {
+  if (input->uring) mj_input_uring_cancel_all(input);
   if (input->srcpath) free(input->srcpath);
-  if (input->infd>0) close(input->infd);
-  if (input->pollfdv) free(input->pollfdv);
+  if (input->inotify.fd>0) close(input->inotify.fd);
+  if (input->netlink.fd>0) close(input->netlink.fd);
+  if (input->retry.fd>0) close(input->retry.fd);
+  if (input->epfd>0) close(input->epfd);
   if (input->devicev) {
-    while (input->devicec-->0) mj_input_device_cleanup(input->devicev+input->devicec);
+    while (input->devicec-->0) mj_input_device_del(input->devicev[input->devicec]);
     free(input->devicev);
   }
+  if (input->watchv) {
+    while (input->watchc-->0) free(input->watchv[input->watchc]);
+    free(input->watchv);
+  }
+  if (input->sparev) {
+    while (input->sparec-->0) mj_input_device_del(input->sparev[input->sparec]);
+    free(input->sparev);
+  }
+  if (input->ignorev) free(input->ignorev);
   memset(input,0,sizeof(struct mj_input));
 }
 
@@ -44,62 +85,281 @@ int mj_input_set_srcdir(struct mj_input *input,const char *src,int srcc) {
   return 0;
 }
 
-/* Finish configuration.
+/* Register watch with epoll.
  */
  
-int mj_input_ready(struct mj_input *input) {
-  if (!input->srcpath) {
-    if (mj_input_set_srcdir(input,MJ_INPUT_DEFAULT_SRCDIR,-1)<0) return -1;
+static int mj_input_epoll_add(struct mj_input *input,struct mj_input_watch *watch) {
+  struct epoll_event event={
+    .events=EPOLLIN,
+    .data.ptr=watch,
+  };
+  return epoll_ctl(input->epfd,EPOLL_CTL_ADD,watch->fd,&event);
+}
+
+/* Foreign watches.
+ */
+ 
+int mj_input_watch_fd(
+  struct mj_input *input,
+  int fd,
+  int (*cb)(struct mj_input *input,struct mj_input_watch *watch),
+  void *userdata
+) {
+  if ((fd<0)||!cb) return -1;
+  if (input->watchc>=input->watcha) {
+    int na=input->watcha+8;
+    if (na>INT_MAX/sizeof(void*)) return -1;
+    void *nv=realloc(input->watchv,sizeof(void*)*na);
+    if (!nv) return -1;
+    input->watchv=nv;
+    input->watcha=na;
   }
-  if ((input->infd=inotify_init())<0) return -1;
-  if (inotify_add_watch(input->infd,input->srcpath,IN_CREATE|IN_ATTRIB)<0) return -1;
-  input->refresh=1;
+  struct mj_input_watch *watch=calloc(1,sizeof(struct mj_input_watch));
+  if (!watch) return -1;
+  watch->fd=fd;
+  watch->cb=cb;
+  watch->userdata=userdata;
+  if (mj_input_epoll_add(input,watch)<0) {
+    free(watch);
+    return -1;
+  }
+  input->watchv[input->watchc++]=watch;
   return 0;
 }
 
+void mj_input_unwatch_fd(struct mj_input *input,int fd) {
+  int i=input->watchc;
+  while (i-->0) {
+    struct mj_input_watch *watch=input->watchv[i];
+    if (watch->fd!=fd) continue;
+    epoll_ctl(input->epfd,EPOLL_CTL_DEL,fd,0);
+    free(watch);
+    input->watchc--;
+    memmove(input->watchv+i,input->watchv+i+1,sizeof(void*)*(input->watchc-i));
+    return;
+  }
+}
+
 /* Device list.
  */
  
-static int mj_input_fd_by_devid(const struct mj_input *input,int devid) {
-  const struct mj_input_device *device=input->devicev;
+static struct mj_input_device *mj_input_device_by_devid(const struct mj_input *input,int devid) {
   int i=input->devicec;
-  for (;i-->0;device++) if (device->devid==devid) return device->fd;
-  return -1;
+  while (i-->0) if (input->devicev[i]->devid==devid) return input->devicev[i];
+  return 0;
 }
- 
-static int mj_input_devid_by_fd(const struct mj_input *input,int fd) {
-  const struct mj_input_device *device=input->devicev;
+
+static void mj_input_drop_device(struct mj_input *input,struct mj_input_device *device) {
   int i=input->devicec;
-  for (;i-->0;device++) if (device->fd==fd) return device->devid;
-  return -1;
+  while (i-->0) {
+    if (input->devicev[i]!=device) continue;
+    MJ_STATS_ADD(device->stats,disconnectc,1);
+    MJ_STATS_SET(device->stats,connected,0);
+    epoll_ctl(input->epfd,EPOLL_CTL_DEL,device->watch.fd,0);
+    mj_input_device_release(input,device);
+    input->devicec--;
+    memmove(input->devicev+i,input->devicev+i+1,sizeof(void*)*(input->devicec-i));
+    return;
+  }
 }
 
-static void mj_input_drop_device_by_fd(struct mj_input *input,int fd) {
-  int i=0;
-  struct mj_input_device *device=input->devicev;
-  for (;i<input->devicec;i++,device++) {
-    if (device->fd==fd) {
-      mj_input_device_cleanup(device);
-      input->devicec--;
-      memmove(device,device+1,sizeof(struct mj_input_device)*(input->devicec-i));
-      return;
+/* io_uring: Each device has one READ in flight, into its whole (rxv).
+ * Some kernels won't wait in a READ on a nonblocking fd and fail it with EAGAIN instead.
+ * After that, we chain a POLL ahead of each READ, which amounts to the same thing.
+ * (poll) to do that just once: A FIFO that never had a writer reads EOF, but doesn't poll readable.
+ */
+ 
+static int mj_input_uring_read(struct mj_input *input,struct mj_input_device *device,int poll) {
+  struct io_uring_sqe *sqe;
+  if (poll||device->pollfirst) {
+    if (!(sqe=mj_uring_sqe(input->uring))) return -1;
+    sqe->opcode=IORING_OP_POLL_ADD;
+    sqe->fd=device->watch.fd;
+    sqe->poll32_events=POLLIN;
+    sqe->flags=IOSQE_IO_LINK;
+    sqe->user_data=MJ_URING_USER_POLL;
+  }
+  if (!(sqe=mj_uring_sqe(input->uring))) return -1;
+  sqe->opcode=IORING_OP_READ;
+  sqe->fd=device->watch.fd;
+  sqe->addr=(uintptr_t)device->rxv;
+  sqe->len=input->rxsize;
+  sqe->off=(uint64_t)-1;
+  sqe->user_data=(uintptr_t)device;
+  device->reading=(poll||device->pollfirst)?2:1;
+  return 0;
+}
+
+static int mj_input_uring_cancel(struct mj_input *input,uint64_t userdata) {
+  struct io_uring_sqe *sqe=mj_uring_sqe(input->uring);
+  if (!sqe) return -1;
+  sqe->opcode=IORING_OP_ASYNC_CANCEL;
+  sqe->addr=userdata;
+  sqe->user_data=MJ_URING_USER_CANCEL;
+  return 0;
+}
+
+static int mj_input_update_fd(struct mj_input *input,struct mj_input_watch *watch);
+
+static struct mj_input_device *mj_input_add_device(struct mj_input *input,int fd,int devid) {
+  struct mj_input_device *device;
+  if (input->sparea) {
+    if (!input->sparec) return 0;
+    device=input->sparev[--(input->sparec)];
+  } else {
+    if (input->devicec>=input->devicea) {
+      int na=input->devicea+8;
+      if (na>INT_MAX/sizeof(void*)) return 0;
+      void *nv=realloc(input->devicev,sizeof(void*)*na);
+      if (!nv) return 0;
+      input->devicev=nv;
+      input->devicea=na;
+    }
+    if (!(device=calloc(1,sizeof(struct mj_input_device)))) return 0;
+    if (!(device->rxv=malloc(input->rxsize))) {
+      free(device);
+      return 0;
     }
   }
+  device->watch.fd=fd;
+  device->watch.cb=mj_input_update_fd;
+  device->watch.userdata=device;
+  device->devid=devid;
+  if (input->uring) {
+    if (mj_input_uring_read(input,device,0)<0) {
+      device->watch.fd=-1;
+      mj_input_device_release(input,device);
+      return 0;
+    }
+  } else if (mj_input_epoll_add(input,&device->watch)<0) {
+    device->watch.fd=-1;
+    mj_input_device_release(input,device);
+    return 0;
+  }
+  input->devicev[input->devicec++]=device;
+  return device;
 }
 
-static int mj_input_add_device(struct mj_input *input,int fd,int devid) {
-  if (input->devicec>=input->devicea) {
-    int na=input->devicea+8;
-    if (na>INT_MAX/sizeof(struct mj_input_device)) return -1;
-    void *nv=realloc(input->devicev,sizeof(struct mj_input_device)*na);
+/* Detach and attach.
+ */
+ 
+static int mj_input_ignored(const struct mj_input *input,int devid) {
+  int i=input->ignorec;
+  while (i-->0) if (input->ignorev[i]==devid) return 1;
+  return 0;
+}
+
+int mj_input_detach(struct mj_input *input,int devid) {
+  if (mj_input_ignored(input,devid)) return 0;
+  if (input->ignorec>=input->ignorea) {
+    int na=input->ignorea+8;
+    if (na>INT_MAX/sizeof(int)) return -1;
+    void *nv=realloc(input->ignorev,sizeof(int)*na);
     if (!nv) return -1;
-    input->devicev=nv;
-    input->devicea=na;
+    input->ignorev=nv;
+    input->ignorea=na;
   }
-  struct mj_input_device *device=input->devicev+input->devicec++;
-  memset(device,0,sizeof(struct mj_input_device));
-  device->fd=fd;
-  device->devid=devid;
+  input->ignorev[input->ignorec++]=devid;
+  input->detach=1;
+  return 0;
+}
+
+int mj_input_attach(struct mj_input *input,int devid) {
+  int i=input->ignorec;
+  while (i-->0) {
+    if (input->ignorev[i]!=devid) continue;
+    input->ignorec--;
+    memmove(input->ignorev+i,input->ignorev+i+1,sizeof(int)*(input->ignorec-i));
+    input->refresh=1;
+    return 0;
+  }
+  return -1;
+}
+
+static int mj_input_drop_ignored(struct mj_input *input) {
+  int i=input->devicec;
+  while (i-->0) {
+    if (i>=input->devicec) continue;
+    struct mj_input_device *device=input->devicev[i];
+    if (device->cancel) continue;
+    if (!mj_input_ignored(input,device->devid)) continue;
+    int err=input->cb(device,0,0,input->userdata);
+    if (device->reading) {
+      // Its buffer is the kernel's until the READ comes back.
+      device->cancel=1;
+      if (mj_input_uring_cancel(input,(uintptr_t)device)<0) return -1;
+    } else {
+      mj_input_drop_device(input,device);
+    }
+    if (err<0) return -1;
+  }
+  return 0;
+}
+
+/* Retry with backoff.
+ */
+ 
+static void mj_input_arm_retry(struct mj_input *input) {
+  struct itimerspec spec={0};
+  int64_t due=0;
+  int i=input->retryc;
+  while (i-->0) if (!due||(input->retryv[i].due<due)) due=input->retryv[i].due;
+  if (due) {
+    spec.it_value.tv_sec=due/1000000000ll;
+    spec.it_value.tv_nsec=due%1000000000ll;
+  }
+  timerfd_settime(input->retry.fd,TFD_TIMER_ABSTIME,&spec,0);
+}
+
+static void mj_input_unschedule_retry(struct mj_input *input,int devid) {
+  int i=input->retryc;
+  while (i-->0) {
+    if (input->retryv[i].devid!=devid) continue;
+    input->retryc--;
+    memmove(input->retryv+i,input->retryv+i+1,sizeof(struct mj_input_retry)*(input->retryc-i));
+    return;
+  }
+}
+
+static void mj_input_schedule_retry(struct mj_input *input,int devid,const char *base,const char *path) {
+  if (input->retry.fd<=0) return;
+  struct mj_input_retry *retry=0;
+  int i=input->retryc;
+  while (i-->0) if (input->retryv[i].devid==devid) { retry=input->retryv+i; break; }
+  if (!retry) {
+    if (input->retryc>=MJ_INPUT_RETRY_LIMIT) return;
+    int basec=strlen(base);
+    if (basec>=sizeof(retry->base)) return;
+    retry=input->retryv+input->retryc++;
+    retry->devid=devid;
+    retry->attemptc=0;
+    memcpy(retry->base,base,basec+1);
+  } else if (retry->attemptc>=MJ_INPUT_RETRY_ATTEMPTS) {
+    fprintf(stderr,"%s: Giving up.\n",path);
+    mj_input_unschedule_retry(input,devid);
+    return;
+  }
+  retry->due=mj_now()+((int64_t)MJ_INPUT_RETRY_FIRST_MS<<retry->attemptc)*1000000ll;
+  retry->attemptc++;
+  mj_input_arm_retry(input);
+}
+
+static int mj_input_check_file(struct mj_input *input,const char *base);
+
+static int mj_input_update_retry(struct mj_input *input,struct mj_input_watch *watch) {
+  uint64_t expirations;
+  read(watch->fd,&expirations,sizeof(expirations));
+  int64_t now=mj_now();
+  // Copy the names out first. Checking a file changes (retryv).
+  char basev[MJ_INPUT_RETRY_LIMIT][sizeof(input->retryv[0].base)];
+  int basec=0,i;
+  for (i=0;i<input->retryc;i++) {
+    if (input->retryv[i].due<=now) memcpy(basev[basec++],input->retryv[i].base,sizeof(basev[0]));
+  }
+  for (i=0;i<basec;i++) {
+    if (mj_input_check_file(input,basev[i])<0) return -1;
+  }
+  mj_input_arm_retry(input);
   return 0;
 }
 
@@ -122,7 +382,16 @@ static int mj_input_check_file(struct mj_input *input,const char *base) {
   if (basep==4) return 0; // devid required
   
   // If we already have it, no worries, we're done.
-  if (mj_input_fd_by_devid(input,devid)>=0) return 0;
+  if (mj_input_device_by_devid(input,devid)) {
+    mj_input_unschedule_retry(input,devid);
+    return 0;
+  }
+  
+  // Likewise if it was detached by request.
+  if (mj_input_ignored(input,devid)) {
+    mj_input_unschedule_retry(input,devid);
+    return 0;
+  }
   
   // Get full path.
   char path[1024];
@@ -131,17 +400,33 @@ static int mj_input_check_file(struct mj_input *input,const char *base) {
   
   // Attempt to open the file. If it fails, just stop, no big deal.
   // (important that we not fail -- we might be waiting for a udev rule to make the device readable).
-  int fd=open(path,O_RDONLY);
-  if (fd<0) return 0;
+  // inotify will tell us when the permissions change, but netlink won't, so try again in a little while.
+  int fd=open(path,O_RDONLY|O_NONBLOCK|O_CLOEXEC);
+  if (fd<0) {
+    if ((errno==EACCES)||(errno==EPERM)||(errno==ENOENT)||(errno==EBUSY)) mj_input_schedule_retry(input,devid,base,path);
+    else mj_input_unschedule_retry(input,devid);
+    return 0;
+  }
+  mj_input_unschedule_retry(input,devid);
   
   // Add to our list.
-  if (mj_input_add_device(input,fd,devid)<0) {
+  // If the pool is exhausted, that's not fatal. Log it and carry on without this device.
+  struct mj_input_device *device=mj_input_add_device(input,fd,devid);
+  if (!device) {
     close(fd);
+    if (input->sparea) {
+      fprintf(stderr,"%s: Device limit %d reached, ignoring.\n",path,input->sparea);
+      return 0;
+    }
     return -1;
   }
   
+  device->stats=mj_stats_get(input->stats,devid,1);
+  MJ_STATS_ADD(device->stats,connectc,1);
+  MJ_STATS_SET(device->stats,connected,1);
+  
   // Send the hello event.
-  if (input->cb(devid,MJ_INPUT_HELLO_EVENT,sizeof(MJ_INPUT_HELLO_EVENT),input->userdata)<0) return -1;
+  if (input->cb(device,MJ_INPUT_HELLO_EVENT,sizeof(MJ_INPUT_HELLO_EVENT),input->userdata)<0) return -1;
   
   return 0;
 }
@@ -166,13 +451,14 @@ static int mj_input_scan(struct mj_input *input) {
 /* Read from inotify.
  */
  
-static int mj_input_update_inotify(struct mj_input *input) {
+static int mj_input_update_inotify(struct mj_input *input,struct mj_input_watch *watch) {
   char buf[1024];
-  int bufc=read(input->infd,buf,sizeof(buf));
+  int bufc=read(watch->fd,buf,sizeof(buf));
   if (bufc<=0) {
     fprintf(stderr,"%s: Failed to read from inotify. We will not detect any more connections.\n",input->srcpath);
-    close(input->infd);
-    input->infd=-1;
+    epoll_ctl(input->epfd,EPOLL_CTL_DEL,watch->fd,0);
+    close(watch->fd);
+    watch->fd=-1;
     return 0;
   }
   int bufp=0;
@@ -186,56 +472,273 @@ static int mj_input_update_inotify(struct mj_input *input) {
   return 0;
 }
 
+/* Read from netlink.
+ * Messages are "ACTION@DEVPATH" then NUL-terminated "KEY=VALUE" fields.
+ * We want ACTION=add, SUBSYSTEM=sound, and a DEVNAME whose basename we'd find in srcdir.
+ * Only the kernel (pid 0) is believed; udev's rebroadcasts go to a different group and we don't join it.
+ */
+ 
+static int mj_input_uevent(struct mj_input *input,const char *src,int srcc) {
+  const char *action=0,*subsystem=0,*devname=0;
+  int srcp=0;
+  while (srcp<srcc) {
+    const char *field=src+srcp;
+    int fieldc=0;
+    while ((srcp<srcc)&&src[srcp]) { srcp++; fieldc++; }
+    srcp++;
+    if ((fieldc>7)&&!memcmp(field,"ACTION=",7)) action=field+7;
+    else if ((fieldc>10)&&!memcmp(field,"SUBSYSTEM=",10)) subsystem=field+10;
+    else if ((fieldc>8)&&!memcmp(field,"DEVNAME=",8)) devname=field+8;
+  }
+  if (!action||!subsystem||!devname) return 0;
+  if (strcmp(action,"add")||strcmp(subsystem,"sound")) return 0;
+  const char *base=strrchr(devname,'/');
+  base=base?base+1:devname;
+  return mj_input_check_file(input,base);
+}
+ 
+static int mj_input_update_netlink(struct mj_input *input,struct mj_input_watch *watch) {
+  char buf[4096];
+  while (1) {
+    struct sockaddr_nl addr={0};
+    socklen_t addrlen=sizeof(addr);
+    int bufc=recvfrom(watch->fd,buf,sizeof(buf)-1,MSG_DONTWAIT,(struct sockaddr*)&addr,&addrlen);
+    if (bufc<0) {
+      if ((errno==EAGAIN)||(errno==EINTR)) return 0;
+      if (errno==ENOBUFS) {
+        // Overran the socket buffer; we missed something. Rescan to be sure.
+        input->refresh=1;
+        continue;
+      }
+      fprintf(stderr,"Failed to read from netlink. We will not detect any more connections.\n");
+      epoll_ctl(input->epfd,EPOLL_CTL_DEL,watch->fd,0);
+      close(watch->fd);
+      watch->fd=-1;
+      return 0;
+    }
+    if (addr.nl_pid) continue;
+    buf[bufc]=0;
+    if (mj_input_uevent(input,buf,bufc)<0) return -1;
+  }
+}
+
 /* Read from device.
+ * Drain until EAGAIN, then deliver everything at once. Flush early only if the buffer fills.
+ * EOF or a real error is a farewell, after delivering whatever came before it.
+ * So is the callback failing: That's this device's problem, and everything else keeps running.
  */
  
-static int mj_input_update_fd(struct mj_input *input,int fd) {
-  int devid=mj_input_devid_by_fd(input,fd);
-  char buf[1024];
-  int bufc=read(fd,buf,sizeof(buf));
-  if (bufc<=0) {
-    int err=input->cb(devid,0,0,input->userdata);
-    mj_input_drop_device_by_fd(input,fd);
+static int mj_input_update_fd(struct mj_input *input,struct mj_input_watch *watch) {
+  struct mj_input_device *device=watch->userdata;
+  int rxc=0,fillc=0,gone=0,err=0,readc=0,bytec=0;
+  MJ_HOTPATH_BEGIN
+  while (1) {
+    int n=read(watch->fd,device->rxv+rxc,input->rxsize-rxc);
+    readc++;
+    if (n>0) {
+      if (!rxc) device->rcvtime=mj_now();
+      rxc+=n;
+      bytec+=n;
+      if (rxc<input->rxsize) continue;
+      if ((err=input->cb(device,device->rxv,rxc,input->userdata))<0) break;
+      rxc=0;
+      if (++fillc>=MJ_INPUT_DRAIN_LIMIT) break;
+      continue;
+    }
+    if ((n<0)&&(errno==EINTR)) continue;
+    if ((n<0)&&(errno==EAGAIN)) break;
+    gone=1;
+    break;
+  }
+  input->readc+=readc;
+  MJ_STATS_ADD(device->stats,readc,readc);
+  MJ_STATS_ADD(device->stats,bytec,bytec);
+  if (rxc&&(err>=0)) err=input->cb(device,device->rxv,rxc,input->userdata);
+  if (err<0) {
+    fprintf(stderr,"MIDI %d: Failed to process input. Disconnecting it.\n",device->devid);
+    gone=1;
+  }
+  if (gone) {
+    input->cb(device,0,0,input->userdata);
+    mj_input_drop_device(input,device);
+  }
+  MJ_HOTPATH_END
+  return 0;
+}
+
+/* io_uring completions.
+ * Devices read straight into their buffers; every other watch is behind the epoll fd, which the ring polls.
+ */
+ 
+static int mj_input_uring_epoll(struct mj_input *input) {
+  struct io_uring_sqe *sqe=mj_uring_sqe(input->uring);
+  if (!sqe) return -1;
+  sqe->opcode=IORING_OP_POLL_ADD;
+  sqe->fd=input->epfd;
+  sqe->poll32_events=POLLIN;
+  sqe->len=IORING_POLL_ADD_MULTI;
+  sqe->user_data=MJ_URING_USER_EPOLL;
+  return 0;
+}
+
+static int mj_input_wait_epoll(struct mj_input *input,int to_ms);
+ 
+static int mj_input_uring_cb(struct mj_uring *uring,const struct io_uring_cqe *cqe,void *userdata) {
+  struct mj_input *input=userdata;
+  switch (cqe->user_data) {
+    case MJ_URING_USER_POLL: return 0; // Its READ reports for both.
+    case MJ_URING_USER_EPOLL: {
+        if (!(cqe->flags&IORING_CQE_F_MORE)&&(mj_input_uring_epoll(input)<0)) return -1;
+        if (cqe->res<0) return 0;
+        return mj_input_wait_epoll(input,0);
+      }
+  }
+  struct mj_input_device *device=(struct mj_input_device*)(uintptr_t)cqe->user_data;
+  int polled=(device->reading==2);
+  device->reading=0;
+  if (device->cancel) {
+    mj_input_drop_device(input,device);
     return 0;
   }
-  if (input->cb(devid,buf,bufc,input->userdata)<0) return -1;
+  if (cqe->res>0) {
+    int err;
+    MJ_HOTPATH_BEGIN
+    device->rcvtime=mj_now();
+    MJ_STATS_ADD(device->stats,readc,1);
+    MJ_STATS_ADD(device->stats,bytec,cqe->res);
+    if ((err=input->cb(device,device->rxv,cqe->res,input->userdata))>=0) {
+      err=mj_input_uring_read(input,device,0);
+    } else {
+      fprintf(stderr,"MIDI %d: Failed to process input. Disconnecting it.\n",device->devid);
+      input->cb(device,0,0,input->userdata);
+      mj_input_drop_device(input,device);
+      err=0;
+    }
+    MJ_HOTPATH_END
+    return err;
+  }
+  if (cqe->res==-EAGAIN) device->pollfirst=1;
+  if ((cqe->res==-EAGAIN)||(cqe->res==-EINTR)||(!cqe->res&&!polled)) return mj_input_uring_read(input,device,1);
+  // EOF or a real error: Farewell, same as the epoll path.
+  input->cb(device,0,0,input->userdata);
+  mj_input_drop_device(input,device);
+  return 0;
+}
+
+/* At cleanup, every READ must come back before we free its buffer.
+ * Cancelling one that's waiting for input is immediate, but don't hang forever on a stuck device:
+ * If it won't come back, we leak its buffer rather than let the kernel write into freed memory.
+ */
+
+static int mj_input_uring_cancelled(struct mj_uring *uring,const struct io_uring_cqe *cqe,void *userdata) {
+  if (cqe->user_data<16) return 0;
+  struct mj_input_device *device=(struct mj_input_device*)(uintptr_t)cqe->user_data;
+  device->reading=0;
   return 0;
 }
+ 
+static void mj_input_uring_cancel_all(struct mj_input *input) {
+  int i,readingc=0,repc=100;
+  for (i=input->devicec;i-->0;) {
+    if (!input->devicev[i]->reading) continue;
+    if (mj_input_uring_cancel(input,(uintptr_t)input->devicev[i])<0) break;
+    readingc++;
+  }
+  mj_input_uring_cancel(input,MJ_URING_USER_EPOLL);
+  while (readingc&&(repc-->0)) {
+    if (mj_uring_update(input->uring,10,mj_input_uring_cancelled,input)<0) break;
+    for (readingc=0,i=input->devicec;i-->0;) if (input->devicev[i]->reading) readingc++;
+  }
+  for (i=input->devicec;i-->0;) {
+    if (input->devicev[i]->reading) input->devicev[i]->rxv=0;
+  }
+}
 
-/* Populate pollfdv.
+/* Finish configuration.
  */
  
-static struct pollfd *mj_input_require_pollfdv(struct mj_input *input,int pvc) {
-  if (pvc<input->pollfda) return input->pollfdv+pvc;
-  int na=input->pollfda+8;
-  if (na>INT_MAX/sizeof(struct pollfd)) return 0;
-  void *nv=realloc(input->pollfdv,sizeof(struct pollfd)*na);
-  if (!nv) return 0;
-  input->pollfdv=nv;
-  input->pollfda=na;
-  struct pollfd *pollfd=input->pollfdv+pvc;
-  pollfd->fd=0;
-  pollfd->events=POLLIN|POLLERR|POLLHUP;
-  pollfd->revents=0;
-  return pollfd;
+static int mj_input_init_netlink(struct mj_input *input) {
+  int fd=socket(AF_NETLINK,SOCK_DGRAM|SOCK_NONBLOCK|SOCK_CLOEXEC,NETLINK_KOBJECT_UEVENT);
+  if (fd<0) return -1;
+  struct sockaddr_nl addr={
+    .nl_family=AF_NETLINK,
+    .nl_groups=1, // Kernel events.
+  };
+  if (bind(fd,(struct sockaddr*)&addr,sizeof(addr))<0) {
+    close(fd);
+    return -1;
+  }
+  input->netlink.fd=fd;
+  input->netlink.cb=mj_input_update_netlink;
+  if (mj_input_epoll_add(input,&input->netlink)<0) {
+    close(fd);
+    input->netlink.fd=-1;
+    return -1;
+  }
+  return 0;
 }
  
-static int mj_input_populate_pollfdv(struct mj_input *input) {
-  int pollfdc=0;
-  struct pollfd *pollfd;
-  if (input->infd>0) {
-    if (!(pollfd=mj_input_require_pollfdv(input,pollfdc))) return -1;
-    pollfdc++;
-    pollfd->fd=input->infd;
-  }
-  const struct mj_input_device *device=input->devicev;
-  int i=input->devicec;
-  for (;i-->0;device++) {
-    if (!(pollfd=mj_input_require_pollfdv(input,pollfdc))) return -1;
-    pollfdc++;
-    pollfd->fd=device->fd;
+int mj_input_ready(struct mj_input *input) {
+  if (!input->srcpath) {
+    if (mj_input_set_srcdir(input,MJ_INPUT_DEFAULT_SRCDIR,-1)<0) return -1;
+  }
+  if (input->rxsize<1) input->rxsize=MJ_INPUT_DEFAULT_RXSIZE;
+  if ((input->epfd=epoll_create1(EPOLL_CLOEXEC))<0) return -1;
+  
+  if (input->hotplug==MJ_INPUT_HOTPLUG_AUTO) {
+    if (!strcmp(input->srcpath,"/dev")||!strcmp(input->srcpath,"/dev/")) input->hotplug=MJ_INPUT_HOTPLUG_NETLINK;
+    else input->hotplug=MJ_INPUT_HOTPLUG_INOTIFY;
+    if ((input->hotplug==MJ_INPUT_HOTPLUG_NETLINK)&&(mj_input_init_netlink(input)<0)) {
+      input->hotplug=MJ_INPUT_HOTPLUG_INOTIFY;
+    }
+  } else if (input->hotplug==MJ_INPUT_HOTPLUG_NETLINK) {
+    if (mj_input_init_netlink(input)<0) {
+      fprintf(stderr,"Failed to open netlink socket for hotplug events.\n");
+      return -1;
+    }
   }
-  return pollfdc;
+  if (input->hotplug==MJ_INPUT_HOTPLUG_INOTIFY) {
+    if ((input->inotify.fd=inotify_init1(IN_CLOEXEC))<0) return -1;
+    if (inotify_add_watch(input->inotify.fd,input->srcpath,IN_CREATE|IN_ATTRIB)<0) return -1;
+    input->inotify.cb=mj_input_update_inotify;
+    if (mj_input_epoll_add(input,&input->inotify)<0) return -1;
+  }
+  
+  if ((input->retry.fd=timerfd_create(CLOCK_MONOTONIC,TFD_NONBLOCK|TFD_CLOEXEC))<0) return -1;
+  input->retry.cb=mj_input_update_retry;
+  if (mj_input_epoll_add(input,&input->retry)<0) return -1;
+  
+  if (input->uring) {
+    if (mj_input_uring_epoll(input)<0) return -1;
+  }
+  
+  input->refresh=1;
+  return 0;
+}
+
+/* Preallocate.
+ */
+ 
+int mj_input_reserve(struct mj_input *input,int devicea) {
+  if (input->sparea||input->devicec) return -1;
+  if ((devicea<1)||(devicea>INT_MAX/sizeof(void*))) return -1;
+  if (input->rxsize<1) input->rxsize=MJ_INPUT_DEFAULT_RXSIZE;
+  void *nv=realloc(input->devicev,sizeof(void*)*devicea);
+  if (!nv) return -1;
+  input->devicev=nv;
+  input->devicea=devicea;
+  if (!(input->sparev=malloc(sizeof(void*)*devicea))) return -1;
+  while (input->sparec<devicea) {
+    struct mj_input_device *device=calloc(1,sizeof(struct mj_input_device));
+    if (!device) return -1;
+    if (!(device->rxv=malloc(input->rxsize))) {
+      free(device);
+      return -1;
+    }
+    input->sparev[input->sparec++]=device;
+  }
+  input->sparea=devicea;
+  return 0;
 }
 
 /* Update.
@@ -243,30 +746,30 @@ static int mj_input_populate_pollfdv(struct mj_input *input) {
 
 int mj_input_update(struct mj_input *input,int to_ms) {
   if (!input->cb) return -1;
+  if (input->detach) {
+    input->detach=0;
+    if (mj_input_drop_ignored(input)<0) return -1;
+  }
   if (input->refresh) {
     input->refresh=0;
     return mj_input_scan(input);
   }
-  int pollfdc=mj_input_populate_pollfdv(input);
-  if (pollfdc<0) return -1;
-  if (!pollfdc) {
-    if (to_ms>0) usleep(to_ms*1000);
-    return 0;
-  }
-  if (poll(input->pollfdv,pollfdc,to_ms)<0) {
+  if (input->uring) return mj_uring_update(input->uring,to_ms,mj_input_uring_cb,input);
+  return mj_input_wait_epoll(input,to_ms);
+}
+
+static int mj_input_wait_epoll(struct mj_input *input,int to_ms) {
+  struct epoll_event eventv[MJ_INPUT_EPOLL_LIMIT];
+  int eventc=epoll_wait(input->epfd,eventv,MJ_INPUT_EPOLL_LIMIT,to_ms);
+  input->waitc++;
+  if (eventc<0) {
     if (errno==EINTR) return 0;
     return -1;
   }
-  struct pollfd *pollfd=input->pollfdv;
-  int i=pollfdc;
-  for (;i-->0;pollfd++) {
-    if (pollfd->revents) {
-      if (pollfd->fd==input->infd) {
-        if (mj_input_update_inotify(input)<0) return -1;
-      } else {
-        if (mj_input_update_fd(input,pollfd->fd)<0) return -1;
-      }
-    }
+  const struct epoll_event *event=eventv;
+  for (;eventc-->0;event++) {
+    struct mj_input_watch *watch=event->data.ptr;
+    if (watch->cb(input,watch)<0) return -1;
   }
   return 0;
 }
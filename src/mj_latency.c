@@ -0,0 +1,101 @@
+#include "midjoy.h"
+#include <time.h>
+
+/* Clock.
+ */
+ 
+int64_t mj_now() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC,&ts);
+  return (int64_t)ts.tv_sec*1000000000ll+ts.tv_nsec;
+}
+
+/* Bucket index and bounds.
+ * Values 0..3 get their own buckets, after that each power of two is split in four.
+ */
+ 
+static int mj_latency_bucket(uint64_t ns) {
+  if (ns<4) return ns;
+  int msb=63-__builtin_clzll(ns);
+  int bucket=(msb-1)*4+((ns>>(msb-2))&3);
+  if (bucket>=MJ_LATENCY_BUCKET_COUNT) return MJ_LATENCY_BUCKET_COUNT-1;
+  return bucket;
+}
+
+static uint64_t mj_latency_bucket_floor(int bucket) {
+  if (bucket<4) return bucket;
+  int msb=bucket/4+1;
+  return (uint64_t)(4+(bucket&3))<<(msb-2);
+}
+
+/* Add sample.
+ */
+ 
+void mj_latency_add(struct mj_latency *latency,int64_t rcvtime,int64_t donetime,int eventc) {
+  int64_t ns=donetime-rcvtime;
+  if (ns<0) ns=0;
+  __atomic_fetch_add(latency->bucketv+mj_latency_bucket(ns),1,__ATOMIC_RELAXED);
+  __atomic_fetch_add(&latency->count,1,__ATOMIC_RELAXED);
+  uint64_t max=__atomic_load_n(&latency->max,__ATOMIC_RELAXED);
+  while ((uint64_t)ns>max) {
+    if (__atomic_compare_exchange_n(&latency->max,&max,ns,1,__ATOMIC_RELAXED,__ATOMIC_RELAXED)) break;
+  }
+  uint32_t samplep=__atomic_fetch_add(&latency->samplec,1,__ATOMIC_RELAXED);
+  if (!(samplep%MJ_LATENCY_TRACE_INTERVAL)) {
+    struct mj_latency_trace *trace=latency->tracev+((samplep/MJ_LATENCY_TRACE_INTERVAL)&(MJ_LATENCY_TRACE_SIZE-1));
+    trace->time=rcvtime;
+    trace->latency=ns;
+    trace->eventc=eventc;
+  }
+}
+
+/* Percentile.
+ */
+ 
+int64_t mj_latency_percentile(const struct mj_latency *latency,double percentile) {
+  uint64_t count=__atomic_load_n(&latency->count,__ATOMIC_RELAXED);
+  if (!count) return 0;
+  uint64_t target=(uint64_t)(percentile*count);
+  if (target>=count) target=count-1;
+  uint64_t sum=0;
+  int i=0;
+  for (;i<MJ_LATENCY_BUCKET_COUNT;i++) {
+    sum+=__atomic_load_n(latency->bucketv+i,__ATOMIC_RELAXED);
+    if (sum>target) {
+      if (i>=MJ_LATENCY_BUCKET_COUNT-1) break;
+      int64_t ceiling=mj_latency_bucket_floor(i+1)-1;
+      uint64_t max=__atomic_load_n(&latency->max,__ATOMIC_RELAXED);
+      if (ceiling>max) return max;
+      return ceiling;
+    }
+  }
+  return __atomic_load_n(&latency->max,__ATOMIC_RELAXED);
+}
+
+/* Dump.
+ */
+ 
+void mj_latency_dump(const struct mj_latency *latency,FILE *dst,const char *label) {
+  uint64_t count=__atomic_load_n(&latency->count,__ATOMIC_RELAXED);
+  fprintf(dst,
+    "%s: %llu frames, p50 %.1fus, p99 %.1fus, p99.9 %.1fus, max %.1fus\n",
+    label,(unsigned long long)count,
+    mj_latency_percentile(latency,0.500)/1000.0,
+    mj_latency_percentile(latency,0.990)/1000.0,
+    mj_latency_percentile(latency,0.999)/1000.0,
+    __atomic_load_n(&latency->max,__ATOMIC_RELAXED)/1000.0
+  );
+  uint32_t samplec=__atomic_load_n(&latency->samplec,__ATOMIC_RELAXED);
+  uint32_t tracec=(samplec+MJ_LATENCY_TRACE_INTERVAL-1)/MJ_LATENCY_TRACE_INTERVAL;
+  if (!tracec) return;
+  uint32_t tracep=0;
+  if (tracec>MJ_LATENCY_TRACE_SIZE) {
+    tracep=tracec-MJ_LATENCY_TRACE_SIZE;
+    tracec=MJ_LATENCY_TRACE_SIZE;
+  }
+  int64_t now=mj_now();
+  for (;tracec-->0;tracep++) {
+    const struct mj_latency_trace *trace=latency->tracev+(tracep&(MJ_LATENCY_TRACE_SIZE-1));
+    fprintf(dst,"  %.3fs ago: %.1fus, %d events\n",(now-trace->time)/1e9,trace->latency/1000.0,trace->eventc);
+  }
+}
@@ -0,0 +1,286 @@
+/* mj_lib.c
+ * The embedding API from libmidjoy.h: mj_output with an in-process backend, and a small epoll loop of our own.
+ */
+
+#include "midjoy.h"
+#include <unistd.h>
+#include <errno.h>
+#include <sys/epoll.h>
+
+#define MJ_LIB_EPOLL_LIMIT 16
+#define MJ_LIB_RXSIZE 4096
+
+_Static_assert(MJ_PAD_KEY_COUNT==KEY_CNT,"MJ_PAD_KEY_COUNT must match KEY_CNT");
+_Static_assert(MJ_PAD_ABS_COUNT==ABS_CNT,"MJ_PAD_ABS_COUNT must match ABS_CNT");
+
+struct mj_lib {
+  struct mj_output output; // Must be first; the backend finds us from it.
+  struct mj_timer_wheel timers;
+  int epfd;
+  void (*cb)(const struct mj_pad *pad,void *userdata);
+  void *userdata;
+  struct mj_pad **padv; // Never removed, so pointers we hand out stay good.
+  int padc,pada;
+  struct mj_lib_source {
+    int fd,devid;
+  } **sourcev;
+  int sourcec,sourcea;
+  uint8_t rxv[MJ_LIB_RXSIZE];
+};
+
+/* Pads.
+ */
+
+static struct mj_pad *mj_lib_pad_get(const struct mj_lib *lib,int devid,int player) {
+  int i=lib->padc;
+  while (i-->0) {
+    struct mj_pad *pad=lib->padv[i];
+    if ((pad->devid==devid)&&(pad->player==player)) return pad;
+  }
+  return 0;
+}
+
+static struct mj_pad *mj_lib_pad_add(struct mj_lib *lib,int devid,int player) {
+  if (lib->padc>=lib->pada) {
+    int na=lib->pada+8;
+    if (na>INT_MAX/sizeof(void*)) return 0;
+    void *nv=realloc(lib->padv,sizeof(void*)*na);
+    if (!nv) return 0;
+    lib->padv=nv;
+    lib->pada=na;
+  }
+  struct mj_pad *pad=calloc(1,sizeof(struct mj_pad));
+  if (!pad) return 0;
+  pad->devid=devid;
+  pad->player=player;
+  lib->padv[lib->padc++]=pad;
+  return pad;
+}
+
+/* Backend.
+ * No fd: Write applies each event to the pad, and SYN_REPORT publishes it.
+ * A device record is always one of ours, inside a struct mj_lib.
+ */
+
+static int mj_lib_open(struct mj_output *output,const char *path,int devid,int player,const struct mj_map_profile *profile) {
+  return 0;
+}
+
+static void mj_lib_publish(struct mj_lib *lib,struct mj_pad *pad) {
+  pad->framec++;
+  if (lib->cb) lib->cb(pad,lib->userdata);
+}
+
+static int mj_lib_write(struct mj_output *output,struct mj_output_device *device,const void *src,int srcc) {
+  struct mj_lib *lib=(struct mj_lib*)output;
+  struct mj_pad *pad=device->pad;
+  if (!pad) {
+    if (!(pad=mj_lib_pad_get(lib,device->devid,device->player))) {
+      if (!(pad=mj_lib_pad_add(lib,device->devid,device->player))) return -1;
+    }
+    device->pad=pad;
+    pad->connected=1;
+  }
+  const struct input_event *event=src;
+  int i=srcc/sizeof(struct input_event);
+  for (;i-->0;event++) {
+    switch (event->type) {
+      case EV_KEY: {
+          if (event->code>=KEY_CNT) break;
+          if (event->value) pad->keybits[event->code>>3]|=1<<(event->code&7);
+          else pad->keybits[event->code>>3]&=~(1<<(event->code&7));
+        } break;
+      case EV_ABS: {
+          if (event->code<ABS_CNT) pad->absv[event->code]=event->value;
+        } break;
+      case EV_SYN: mj_lib_publish(lib,pad); break;
+    }
+  }
+  return 0;
+}
+
+/* Like a joystick unplugging: Everything lets go, in one last frame.
+ */
+
+static void mj_lib_close(struct mj_output *output,struct mj_output_device *device) {
+  struct mj_pad *pad=device->pad;
+  if (!pad) return;
+  device->pad=0;
+  memset(pad->keybits,0,sizeof(pad->keybits));
+  memset(pad->absv,0,sizeof(pad->absv));
+  pad->connected=0;
+  mj_lib_publish((struct mj_lib*)output,pad);
+}
+
+static const struct mj_output_backend mj_lib_backend={
+  .prefix="",
+  .open=mj_lib_open,
+  .write=mj_lib_write,
+  .close=mj_lib_close,
+};
+
+/* Delete.
+ */
+
+void mj_lib_del(struct mj_lib *lib) {
+  if (!lib) return;
+  lib->cb=0; // Closing devices publishes their last frame, but nobody's listening anymore.
+  mj_output_cleanup(&lib->output);
+  mj_timer_wheel_cleanup(&lib->timers);
+  if (lib->epfd>0) close(lib->epfd);
+  if (lib->padv) {
+    while (lib->padc-->0) free(lib->padv[lib->padc]);
+    free(lib->padv);
+  }
+  if (lib->sourcev) {
+    while (lib->sourcec-->0) {
+      close(lib->sourcev[lib->sourcec]->fd);
+      free(lib->sourcev[lib->sourcec]);
+    }
+    free(lib->sourcev);
+  }
+  free(lib);
+}
+
+/* New.
+ * The timer wheel's fd is in our epoll with a null pointer; sources have their record.
+ */
+
+struct mj_lib *mj_lib_new(
+  const char *mappath,
+  void (*cb)(const struct mj_pad *pad,void *userdata),
+  void *userdata
+) {
+  struct mj_lib *lib=calloc(1,sizeof(struct mj_lib));
+  if (!lib) return 0;
+  lib->cb=cb;
+  lib->userdata=userdata;
+  lib->timers.fd=-1;
+  lib->output.backend=&mj_lib_backend;
+  if (
+    (mappath&&(mj_output_set_mappath(&lib->output,mappath,-1)<0))||
+    (mj_output_ready(&lib->output)<0)||
+    ((lib->epfd=epoll_create1(EPOLL_CLOEXEC))<0)||
+    (mj_timer_wheel_init(&lib->timers)<0)
+  ) {
+    mj_lib_del(lib);
+    return 0;
+  }
+  struct epoll_event event={.events=EPOLLIN};
+  if (epoll_ctl(lib->epfd,EPOLL_CTL_ADD,lib->timers.fd,&event)<0) {
+    mj_lib_del(lib);
+    return 0;
+  }
+  lib->output.timers=&lib->timers;
+  return lib;
+}
+
+/* Feed.
+ */
+
+int mj_lib_feed(struct mj_lib *lib,int devid,const void *src,int srcc) {
+  if (!lib||(srcc<1)) return 0;
+  struct mj_output_device *device=mj_output_device_by_devid(&lib->output,devid);
+  if (!device&&!(device=mj_output_connect_device(&lib->output,devid))) return -1;
+  return mj_output_events(&lib->output,device,src,srcc,0);
+}
+
+int mj_lib_disconnect(struct mj_lib *lib,int devid) {
+  if (!lib) return 0;
+  return mj_output_disconnect_device(&lib->output,mj_output_device_by_devid(&lib->output,devid));
+}
+
+/* Sources.
+ */
+
+int mj_lib_add_fd(struct mj_lib *lib,int devid,int fd) {
+  if (!lib||(fd<0)) return -1;
+  if (lib->sourcec>=lib->sourcea) {
+    int na=lib->sourcea+8;
+    if (na>INT_MAX/sizeof(void*)) return -1;
+    void *nv=realloc(lib->sourcev,sizeof(void*)*na);
+    if (!nv) return -1;
+    lib->sourcev=nv;
+    lib->sourcea=na;
+  }
+  struct mj_lib_source *source=calloc(1,sizeof(struct mj_lib_source));
+  if (!source) return -1;
+  source->fd=fd;
+  source->devid=devid;
+  struct epoll_event event={.events=EPOLLIN,.data.ptr=source};
+  if (epoll_ctl(lib->epfd,EPOLL_CTL_ADD,fd,&event)<0) {
+    free(source);
+    return -1;
+  }
+  lib->sourcev[lib->sourcec++]=source;
+  return 0;
+}
+
+static int mj_lib_drop_source(struct mj_lib *lib,struct mj_lib_source *source) {
+  int i=lib->sourcec;
+  while (i-->0) {
+    if (lib->sourcev[i]!=source) continue;
+    lib->sourcec--;
+    memmove(lib->sourcev+i,lib->sourcev+i+1,sizeof(void*)*(lib->sourcec-i));
+    break;
+  }
+  epoll_ctl(lib->epfd,EPOLL_CTL_DEL,source->fd,0);
+  close(source->fd);
+  int err=mj_lib_disconnect(lib,source->devid);
+  free(source);
+  return err;
+}
+
+/* Read a source until it's drained, like mj_input does, and deliver it all as one span.
+ */
+
+static int mj_lib_read_source(struct mj_lib *lib,struct mj_lib_source *source) {
+  int rxc=0;
+  while (rxc<MJ_LIB_RXSIZE) {
+    int err=read(source->fd,lib->rxv+rxc,MJ_LIB_RXSIZE-rxc);
+    if (err>0) {
+      rxc+=err;
+      continue;
+    }
+    if ((err<0)&&(errno==EINTR)) continue;
+    if ((err<0)&&(errno==EAGAIN)) break;
+    if (rxc&&(mj_lib_feed(lib,source->devid,lib->rxv,rxc)<0)) return -1;
+    return mj_lib_drop_source(lib,source);
+  }
+  return mj_lib_feed(lib,source->devid,lib->rxv,rxc);
+}
+
+/* Update.
+ */
+
+int mj_lib_update(struct mj_lib *lib,int to_ms) {
+  if (!lib) return -1;
+  struct epoll_event eventv[MJ_LIB_EPOLL_LIMIT];
+  int eventc=epoll_wait(lib->epfd,eventv,MJ_LIB_EPOLL_LIMIT,to_ms);
+  if (eventc<0) {
+    if (errno==EINTR) return 0;
+    return -1;
+  }
+  const struct epoll_event *event=eventv;
+  for (;eventc-->0;event++) {
+    if (!event->data.ptr) {
+      if (mj_timer_wheel_update(&lib->timers)<0) return -1;
+    } else {
+      if (mj_lib_read_source(lib,event->data.ptr)<0) return -1;
+    }
+  }
+  return 0;
+}
+
+/* Trivial accessors.
+ */
+
+int mj_lib_get_fd(const struct mj_lib *lib) {
+  if (!lib) return -1;
+  return lib->epfd;
+}
+
+const struct mj_pad *mj_lib_get_pad(const struct mj_lib *lib,int devid,int player) {
+  if (!lib) return 0;
+  return mj_lib_pad_get(lib,devid,player);
+}
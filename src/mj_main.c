@@ -1,48 +1,297 @@
+#define _GNU_SOURCE
 #include "midjoy.h"
 #include <signal.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <syslog.h>
+#include <sys/stat.h>
+#include <sys/signalfd.h>
 
-static volatile int mj_sigc=0;
+static int mj_sigc=0;
 
-static void mj_rcvsig(int sigid) {
-  switch (sigid) {
-    case SIGINT: if (++mj_sigc>=3) {
-        fprintf(stderr,"Too many unprocessed signals.\n");
-        exit(1);
+/* Signals arrive via signalfd, in the main event loop.
+ */
+
+static int mj_rcvsig(struct mj_input *input,struct mj_input_watch *watch) {
+  struct mj_pipeline *pipeline=watch->userdata;
+  struct signalfd_siginfo info;
+  if (read(watch->fd,&info,sizeof(info))!=sizeof(info)) return -1;
+  switch (info.ssi_signo) {
+    case SIGINT: case SIGTERM: mj_sigc++; break;
+    case SIGHUP: {
+        // Failure is logged already, and the devices that failed are out of the way. Keep running.
+        if (pipeline->workerv) mj_pipeline_reload_map(pipeline);
+        else mj_output_reload_map(pipeline->output);
+      } break;
+    case SIGUSR1: {
+        if (pipeline->workerv) mj_pipeline_dump_latency(pipeline,stderr);
+        else mj_output_dump_latency(pipeline->output,stderr);
       } break;
   }
+  return 0;
+}
+
+/* (pipeline) is always provided, but it is only running if it has workers.
+ */
+static int mj_init_signals(struct mj_input *input,struct mj_pipeline *pipeline) {
+  sigset_t mask;
+  sigemptyset(&mask);
+  sigaddset(&mask,SIGINT);
+  sigaddset(&mask,SIGTERM);
+  sigaddset(&mask,SIGHUP);
+  sigaddset(&mask,SIGUSR1);
+  if (sigprocmask(SIG_BLOCK,&mask,0)<0) return -1;
+  int fd=signalfd(-1,&mask,SFD_CLOEXEC);
+  if (fd<0) return -1;
+  if (mj_input_watch_fd(input,fd,mj_rcvsig,pipeline)<0) {
+    close(fd);
+    return -1;
+  }
+  return fd;
+}
+
+/* Daemonize: Detach from the terminal, and send stderr to syslog.
+ * Everything else logs via fprintf(stderr), so we swap in a stream that forwards whole lines.
+ */
+
+static char mj_logline[256];
+static int mj_loglinec=0;
+static const char *mj_pidpath=0;
+
+static ssize_t mj_syslog_write(void *cookie,const char *src,size_t srcc) {
+  size_t srcp=0;
+  for (;srcp<srcc;srcp++) {
+    if ((src[srcp]==0x0a)||(mj_loglinec>=sizeof(mj_logline)-1)) {
+      if (mj_loglinec) syslog(LOG_NOTICE,"%.*s",mj_loglinec,mj_logline);
+      mj_loglinec=0;
+      if (src[srcp]==0x0a) continue;
+    }
+    mj_logline[mj_loglinec++]=src[srcp];
+  }
+  return srcc;
+}
+
+static void mj_remove_pidfile() {
+  if (mj_pidpath) unlink(mj_pidpath);
+}
+
+/* The original process waits for the daemon's setup to finish, and exits with its result.
+ * The daemon writes "ok" to (mj_readyfd) from mj_ready() when it's about to enter the main loop.
+ * Any failure before that is a plain exit, and the parent sees end of file instead.
+ */
+
+static int mj_readyfd=-1;
+
+static void mj_ready() {
+  if (mj_readyfd<0) return;
+  write(mj_readyfd,"ok",2);
+  close(mj_readyfd);
+  mj_readyfd=-1;
+}
+
+static void mj_daemon_parent(int fd) {
+  char buf[2];
+  int bufc=0,err;
+  while (bufc<sizeof(buf)) {
+    if ((err=read(fd,buf+bufc,sizeof(buf)-bufc))>0) bufc+=err;
+    else if ((err<0)&&(errno==EINTR)) continue;
+    else break;
+  }
+  if ((bufc==2)&&!memcmp(buf,"ok",2)) _exit(0);
+  fprintf(stderr,"midjoy: Daemon failed to start. See syslog for details.\n");
+  _exit(1);
 }
 
-static int mj_daemonize() {
-  //TODO daemonize
+static int mj_daemonize(const char *pidpath) {
+  int fdv[2];
+  if (pipe2(fdv,O_CLOEXEC)<0) return -1;
+  pid_t pid=fork();
+  if (pid<0) return -1;
+  if (pid) {
+    close(fdv[1]);
+    mj_daemon_parent(fdv[0]);
+  }
+  close(fdv[0]);
+  mj_readyfd=fdv[1];
+  if (setsid()<0) return -1;
+  if ((pid=fork())<0) return -1;
+  if (pid) _exit(0);
+  umask(022);
+  if (chdir("/")<0) return -1;
+  
+  int fd=open("/dev/null",O_RDWR);
+  if (fd<0) return -1;
+  dup2(fd,STDIN_FILENO);
+  dup2(fd,STDOUT_FILENO);
+  dup2(fd,STDERR_FILENO);
+  if (fd>STDERR_FILENO) close(fd);
+  
+  openlog("midjoy",LOG_PID,LOG_DAEMON);
+  cookie_io_functions_t fns={.write=mj_syslog_write};
+  FILE *log=fopencookie(0,"w",fns);
+  if (log) {
+    setvbuf(log,0,_IOLBF,0);
+    stderr=log;
+  }
+  
+  if (pidpath) {
+    FILE *f=fopen(pidpath,"w");
+    if (!f) {
+      fprintf(stderr,"%s: Failed to write pidfile.\n",pidpath);
+      return -1;
+    }
+    fprintf(f,"%d\n",(int)getpid());
+    fclose(f);
+    mj_pidpath=pidpath;
+    atexit(mj_remove_pidfile);
+  }
+  return 0;
+}
+
+/* Sysex sink: Assemble complete messages and append each to a file, F0 through F7, in one write.
+ * One message at a time; if a second device starts one in the middle, the first is dropped.
+ */
+
+#define MJ_SYSEX_LIMIT (1<<20)
+
+struct mj_sysex_sink {
+  int fd;
+  int devid;
+  int open,overflow;
+  uint8_t *v;
+  int c;
+};
+
+static int mj_sysex_sink_rcv(int devid,const void *src,int srcc,int final,void *userdata) {
+  struct mj_sysex_sink *sink=userdata;
+  if (sink->open&&(devid!=sink->devid)) {
+    fprintf(stderr,"MIDI %d: Sysex interrupted by device %d, dropping it.\n",sink->devid,devid);
+    sink->open=0;
+  }
+  if (!sink->open) {
+    if (final) return 0; // Nothing to finish, eg the tail of an interrupted one.
+    if (!sink->v&&!(sink->v=malloc(MJ_SYSEX_LIMIT))) return -1;
+    sink->open=1;
+    sink->overflow=0;
+    sink->devid=devid;
+    sink->v[0]=0xf0;
+    sink->c=1;
+  }
+  if (!sink->overflow) {
+    if (srcc>MJ_SYSEX_LIMIT-1-sink->c) {
+      fprintf(stderr,"MIDI %d: Sysex longer than %d bytes, dropping it.\n",devid,MJ_SYSEX_LIMIT);
+      sink->overflow=1;
+    } else {
+      memcpy(sink->v+sink->c,src,srcc);
+      sink->c+=srcc;
+    }
+  }
+  if (final) {
+    if ((final>0)&&!sink->overflow) {
+      sink->v[sink->c++]=0xf7;
+      if (write(sink->fd,sink->v,sink->c)!=sink->c) {
+        fprintf(stderr,"MIDI %d: Failed to write %d-byte sysex.\n",devid,sink->c);
+      }
+    }
+    sink->open=0;
+  }
   return 0;
 }
 
-static int mj_rcvin(int devid,const void *src,int srcc,void *userdata) {
+static int mj_rcvtimer(struct mj_input *input,struct mj_input_watch *watch) {
+  return mj_timer_wheel_update(watch->userdata);
+}
+
+static int mj_rcvin(struct mj_input_device *device,const void *src,int srcc,void *userdata) {
   struct mj_output *output=userdata;
   if (!srcc) {
-    return mj_output_disconnect_device(output,devid);
+    int err=mj_output_disconnect_device(output,device->link);
+    device->link=0;
+    return err;
   } else if ((srcc==2)&&!memcmp(src,"\xf0\xf7",2)) {
-    return mj_output_connect_device(output,devid);
+    if (!(device->link=mj_output_connect_device(output,device->devid))) {
+      // Same as the pipeline: Keep reading, so it doesn't spin readable, but nothing goes out.
+      fprintf(stderr,"MIDI %d: Failed to connect output, ignoring device.\n",device->devid);
+    }
+    return 0;
   } else {
-    return mj_output_events(output,devid,src,srcc);
+    // Failed writes are handled per device already. Anything else costs this read, not the daemon.
+    if (mj_output_events(output,device->link,src,srcc,device->rcvtime)<0) {
+      fprintf(stderr,"MIDI %d: Error processing input, dropped %d bytes.\n",device->devid,srcc);
+    }
+    return 0;
   }
 }
 
 static void mj_print_help(const char *exename) {
   fprintf(stderr,
-    "Usage: %s [--daemonize] [--srcdir=PATH] [--dstdev=PATH]\n",exename
+    "Usage: %s [--daemonize] [--pidfile=PATH] [--control=PATH] [--srcdir=PATH] [--dstdev=PATH] [--map=PATH] [--realtime[=PRIORITY]] [--cpu=N] [--max-devices=N]\n"
+    "  [--threads=N] [--affinity=CPU,...] [--ringsize=N] [--grace=MS] [--prewarm=DEVID,...]\n"
+    "  [--record=PATH] [--record-size=MB] [--replay=PATH] [--replay-fast] [--rxsize=BYTES]\n"
+    "  [--hotplug=auto|netlink|inotify] [--sysex=PATH] [--stats[=PATH]] [--io=poll|uring] [--smf=PATH] [--smf-devid=N]\n",exename
   );
+  fprintf(stderr,"  daemonize: Detach and log to syslog, once setup succeeds; exit status says whether it did. pidfile is only written when daemonized.\n");
+  fprintf(stderr,"  control: Listen for commands on a Unix socket at PATH. Send \"help\" for the list.\n");
   fprintf(stderr,"  srcdir defaults to \"/dev/\", we look here for MIDI devices named \"midiN\"\n");
-  fprintf(stderr,"  dstdir defaults to \"/dev/uinput\"\n");
+  fprintf(stderr,"  dstdev defaults to \"/dev/uinput\". \"file:PATH\" to capture raw input_events instead.\n");
+  fprintf(stderr,"    \"udp:HOST:PORT\" or \"unix:PATH\" to send them to midjoy-netrecv on another machine or in a container.\n");
+  fprintf(stderr,"    \"shm:PATH\" to keep every joystick's state in a shared file instead, for games that poll. See libmidjoy.h.\n");
+  fprintf(stderr,"  map is a text file of note and controller mappings, see src/mj_map.c. SIGHUP to reload it.\n");
+  fprintf(stderr,"  SIGUSR1 prints per-device latency, as does exiting.\n");
+  fprintf(stderr,"  realtime: SCHED_FIFO at PRIORITY (default 50), lock memory, and preallocate max-devices (default 16).\n");
+  fprintf(stderr,"  cpu pins the process to one core.\n");
+  fprintf(stderr,"  threads: Write output from this many worker threads, fed by lock-free rings of ringsize events per device.\n");
+  fprintf(stderr,"  affinity: Comma-separated CPUs for the worker threads.\n");
+  fprintf(stderr,"  grace: Keep the joystick open this long after its MIDI device disconnects (default 2000). Zero to close immediately.\n");
+  fprintf(stderr,"  prewarm: Create joysticks for these MIDI devids at startup, and never close them. They don't count against max-devices.\n");
+  fprintf(stderr,"  hotplug: How to notice new devices. auto is netlink (kernel uevents) for /dev, inotify for anything else.\n");
+  fprintf(stderr,"  rxsize: Receive buffer per MIDI device (default 4096). Each wakeup drains the device into it.\n");
+  fprintf(stderr,"  record: Log all MIDI input with timestamps to a ring file of record-size MB (default 16).\n");
+  fprintf(stderr,"  replay: Play a recording back, with its original timing or as fast as possible. Exits when finished.\n");
+  fprintf(stderr,"    Replayed devids should not collide with live ones; point srcdir at an empty directory to be sure.\n");
+  fprintf(stderr,"  smf: Play a Standard MIDI File as device smf-devid (default %d), tempo and all. Exits when finished.\n",MJ_SMF_DEFAULT_DEVID);
+  fprintf(stderr,"  io: uring to read devices and write output through io_uring, batching each cycle into one syscall.\n");
+  fprintf(stderr,"    Falls back to poll if the kernel doesn't support it. With threads, workers still write for themselves.\n");
+  fprintf(stderr,"  stats: Publish per-device counters in a shared file (default %s). Read it with midjoy-stat.\n",MJ_STATS_DEFAULT_PATH);
+  fprintf(stderr,"  sysex: Append each complete sysex message, F0 through F7, to this file. Otherwise they're skipped.\n");
 }
 
 int main(int argc,char **argv) {
-  int status=0;
+  int status=0,realtime=0,devicea=0,daemonize=0,timeout=-1;
+  const char *pidpath=0,*ctlpath=0;
+  struct mj_rt rt={
+    .priority=0,
+    .cpu=-1,
+    .stacksize=256*1024,
+  };
   struct mj_output output={0};
   struct mj_input input={
     .cb=mj_rcvin,
     .userdata=&output,
   };
+  struct mj_timer_wheel timers={0};
+  struct mj_record record={0};
+  struct mj_replay replay={0};
+  struct mj_smf smf={0};
+  struct mj_sysex_sink sysex={.fd=-1};
+  struct mj_stats stats={0};
+  struct mj_uring uring={0};
+  int useuring=0;
+  const char *recpath=0,*replaypath=0,*sysexpath=0,*statspath=0,*smfpath=0;
+  int recsize=0,replayfast=0,smfdevid=MJ_SMF_DEFAULT_DEVID;
+  struct mj_pipeline pipeline={
+    .output=&output,
+  };
+  struct mj_control control={
+    .input=&input,
+    .output=&output,
+    .pipeline=&pipeline,
+    .timeout=&timeout,
+  };
+  int cpuv[64],cpuc=0;
+  int prewarmv[64],prewarmc=0;
+  output.grace=2000;
   
   int argp=1;
   while (argp<argc) {
@@ -51,28 +300,210 @@ int main(int argc,char **argv) {
       mj_print_help(argv[0]);
       return 0;
     } else if (!strcmp(arg,"--daemonize")||!strcmp(arg,"-d")) {
-      if (mj_daemonize()<0) return -1;
+      daemonize=1;
+    } else if (!memcmp(arg,"--pidfile=",10)) {
+      pidpath=arg+10;
+    } else if (!memcmp(arg,"--control=",10)) {
+      ctlpath=arg+10;
     } else if (!memcmp(arg,"--srcdir=",9)) {
       if (mj_input_set_srcdir(&input,arg+9,-1)<0) return 1;
     } else if (!memcmp(arg,"--dstdev=",9)) {
       if (mj_output_set_dstdev(&output,arg+9,-1)<0) return 1;
+    } else if (!memcmp(arg,"--map=",6)) {
+      if (mj_output_set_mappath(&output,arg+6,-1)<0) return 1;
+    } else if (!strcmp(arg,"--realtime")) {
+      realtime=1;
+      rt.priority=50;
+    } else if (!memcmp(arg,"--realtime=",11)) {
+      realtime=1;
+      rt.priority=atoi(arg+11);
+    } else if (!memcmp(arg,"--cpu=",6)) {
+      rt.cpu=atoi(arg+6);
+    } else if (!memcmp(arg,"--max-devices=",14)) {
+      devicea=atoi(arg+14);
+    } else if (!memcmp(arg,"--threads=",10)) {
+      pipeline.workerc=atoi(arg+10);
+    } else if (!memcmp(arg,"--ringsize=",11)) {
+      pipeline.ringsize=atoi(arg+11);
+    } else if (!strcmp(arg,"--hotplug=auto")) {
+      input.hotplug=MJ_INPUT_HOTPLUG_AUTO;
+    } else if (!strcmp(arg,"--hotplug=netlink")) {
+      input.hotplug=MJ_INPUT_HOTPLUG_NETLINK;
+    } else if (!strcmp(arg,"--hotplug=inotify")) {
+      input.hotplug=MJ_INPUT_HOTPLUG_INOTIFY;
+    } else if (!memcmp(arg,"--rxsize=",9)) {
+      input.rxsize=atoi(arg+9);
+    } else if (!memcmp(arg,"--record=",9)) {
+      recpath=arg+9;
+    } else if (!memcmp(arg,"--record-size=",14)) {
+      recsize=atoi(arg+14)<<20;
+    } else if (!memcmp(arg,"--replay=",9)) {
+      replaypath=arg+9;
+    } else if (!strcmp(arg,"--replay-fast")) {
+      replayfast=1;
+    } else if (!memcmp(arg,"--smf=",6)) {
+      smfpath=arg+6;
+    } else if (!memcmp(arg,"--smf-devid=",12)) {
+      smfdevid=atoi(arg+12);
+    } else if (!strcmp(arg,"--io=poll")) {
+      useuring=0;
+    } else if (!strcmp(arg,"--io=uring")) {
+      useuring=1;
+    } else if (!strcmp(arg,"--stats")) {
+      statspath=MJ_STATS_DEFAULT_PATH;
+    } else if (!memcmp(arg,"--stats=",8)) {
+      statspath=arg+8;
+    } else if (!memcmp(arg,"--sysex=",8)) {
+      sysexpath=arg+8;
+    } else if (!memcmp(arg,"--grace=",8)) {
+      output.grace=atoi(arg+8);
+    } else if (!memcmp(arg,"--prewarm=",10)) {
+      const char *src=arg+10;
+      while (*src&&(prewarmc<64)) {
+        prewarmv[prewarmc++]=atoi(src);
+        while (*src&&(*src!=',')) src++;
+        if (*src==',') src++;
+      }
+    } else if (!memcmp(arg,"--affinity=",11)) {
+      const char *src=arg+11;
+      while (*src&&(cpuc<64)) {
+        cpuv[cpuc++]=atoi(src);
+        while (*src&&(*src!=',')) src++;
+        if (*src==',') src++;
+      }
+      pipeline.cpuv=cpuv;
+      pipeline.cpuc=cpuc;
     } else {
       fprintf(stderr,"%s: Unexpected argument '%s'\n",argv[0],arg);
     }
   }
   
+  // Before anything that opens files or starts threads.
+  if (daemonize) {
+    if (mj_daemonize(pidpath)<0) return 1;
+  }
+  
+  if (useuring) {
+    if (mj_uring_init(&uring)<0) {
+      fprintf(stderr,"%s: io_uring unavailable, using poll.\n",argv[0]);
+    } else {
+      input.uring=&uring;
+      if (pipeline.workerc<1) output.uring=&uring;
+    }
+  }
+  
   if (
     (mj_input_ready(&input)<0)||
     (mj_output_ready(&output)<0)
   ) return 1;
   
-  signal(SIGINT,mj_rcvsig);
+  if (sysexpath) {
+    if ((sysex.fd=open(sysexpath,O_WRONLY|O_CREAT|O_APPEND|O_CLOEXEC,0644))<0) {
+      fprintf(stderr,"%s: Failed to open for sysex.\n",sysexpath);
+      return 1;
+    }
+    output.sysex=mj_sysex_sink_rcv;
+    output.sysexuserdata=&sysex;
+  }
+  
+  if (statspath) {
+    if (mj_stats_open(&stats,statspath,devicea)<0) return 1;
+    input.stats=&stats;
+    output.stats=&stats;
+  }
+  
+  int sigfd=mj_init_signals(&input,&pipeline);
+  if (sigfd<0) return 1;
+  
+  if (
+    (mj_timer_wheel_init(&timers)<0)||
+    (mj_input_watch_fd(&input,timers.fd,mj_rcvtimer,&timers)<0)
+  ) return 1;
+  output.timers=&timers;
+  
+  if (realtime||devicea) {
+    if (!devicea) devicea=16;
+    pipeline.devicea=devicea;
+    if (
+      (mj_input_reserve(&input,devicea)<0)||
+      (mj_output_reserve(&output,devicea+prewarmc)<0) // Prewarmed devices hold their records forever, so they don't count against max-devices.
+    ) return 1;
+  }
+  int i=0;
+  for (;i<prewarmc;i++) {
+    if (mj_output_prewarm(&output,prewarmv[i])<0) {
+      fprintf(stderr,"%s: Failed to prewarm output for devid %d.\n",argv[0],prewarmv[i]);
+      return 1;
+    }
+  }
+  
+  if (realtime||(rt.cpu>=0)) {
+    if (mj_rt_apply(&rt)<0) return 1;
+  }
+  
+  if (pipeline.workerc>0) {
+    if (mj_pipeline_start(&pipeline)<0) {
+      fprintf(stderr,"%s: Failed to start output threads.\n",argv[0]);
+      mj_pipeline_stop(&pipeline);
+      return 1;
+    }
+    input.cb=mj_pipeline_rcvin;
+    input.userdata=&pipeline;
+  }
+  
+  if (recpath) {
+    if (mj_record_open(&record,recpath,recsize)<0) {
+      mj_pipeline_stop(&pipeline);
+      return 1;
+    }
+    record.cb=input.cb;
+    record.userdata=input.userdata;
+    input.cb=mj_record_rcvin;
+    input.userdata=&record;
+  }
+  if (replaypath) {
+    if (mj_replay_start(&replay,&input,replaypath,replayfast)<0) {
+      mj_pipeline_stop(&pipeline);
+      return 1;
+    }
+  }
+  if (smfpath) {
+    if (mj_smf_start(&smf,&input,smfpath,smfdevid)<0) {
+      mj_pipeline_stop(&pipeline);
+      return 1;
+    }
+  }
+  
+  if (ctlpath) {
+    if (mj_control_listen(&control,ctlpath)<0) {
+      fprintf(stderr,"%s: Failed to open control socket.\n",ctlpath);
+      mj_pipeline_stop(&pipeline);
+      return 1;
+    }
+  }
   
-  while (!mj_sigc) {
-    if (mj_input_update(&input,100)<0) { status=1; break; }
+  mj_ready();
+  while (!mj_sigc&&!replay.done&&!smf.done) {
+    int to_ms=mj_pipeline_expire(&pipeline);
+    if ((to_ms<0)||((timeout>=0)&&(timeout<to_ms))) to_ms=timeout;
+    if (mj_input_update(&input,to_ms)<0) { status=1; break; }
   }
   
+  mj_control_cleanup(&control);
+  mj_pipeline_stop(&pipeline);
+  mj_output_dump_latency(&output,stderr);
+  if (replaypath) mj_replay_report(&replay,stderr);
+  if (smfpath) mj_smf_report(&smf,stderr);
+  mj_replay_cleanup(&replay);
+  mj_smf_cleanup(&smf);
+  mj_record_cleanup(&record);
   mj_input_cleanup(&input);
+  close(sigfd);
   mj_output_cleanup(&output);
+  mj_timer_wheel_cleanup(&timers);
+  mj_stats_cleanup(&stats);
+  mj_uring_cleanup(&uring);
+  if (sysex.fd>=0) close(sysex.fd);
+  if (sysex.v) free(sysex.v);
   return status;
 }
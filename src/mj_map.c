@@ -0,0 +1,507 @@
+#include "midjoy.h"
+
+/* Map file format, one statement per line, '#' begins a comment:
+ *
+ *   device DEVID|NAME|*
+ *     Begin a profile. Statements before the first "device" go in an implicit "device *".
+ *   note RANGE [ch=RANGE] CODE [VALUE]
+ *     Map notes. RANGE is "N", "LO-HI", or "LO-HI/STEP". Channels are 0..15, default all.
+ *     CODE is a symbol like BTN_SOUTH or ABS_X, or "key:N"/"abs:N". VALUE is required for axes.
+ *   cc RANGE [ch=RANGE] CODE [VALUE]
+ *     Map controllers. With a button or an axis VALUE, they are switches around 64.
+ *   cc14 RANGE [ch=RANGE] AXIS
+ *     14-bit controller pairs: RANGE is the MSB controller 0..31, and its LSB is 32 above.
+ *   aftertouch RANGE [ch=RANGE] AXIS
+ *   pressure [ch=RANGE] AXIS
+ *   pitch [ch=RANGE] AXIS
+ *     Analog sources. Pitch is 14 bits, centered.
+ *   Switches (buttons, or axes with a VALUE, on notes and cc) may end with timing options:
+ *     turbo=MS: Release and press again every MS while held.
+ *     long=MS:CODE: Hold at least MS to press button CODE instead. A shorter tap presses the normal CODE briefly.
+ *     min=MS: Report presses for at least MS, so a staccato note still lasts a game frame.
+ *   An axis mapped with no VALUE is analog: The MIDI value is scaled onto the axis range.
+ *   For notes, that's the velocity, and release returns the axis to its minimum.
+ *   Analog axes default to 0..127, 0..16383 for cc14, or -8192..8191 for pitch.
+ *   axis CODE MIN MAX
+ *     Declare an axis range. Axes used without this get -1..1.
+ *   player N [RANGE] [ch=RANGE]
+ *     Route to a separate joystick, N in 1..16. Player 1 is the default.
+ *     With a note RANGE, only notes and aftertouch in that range move. Otherwise, everything on those channels does.
+ *     Mappings don't change: "player 2 60-127" plus "note 60 BTN_SOUTH" puts BTN_SOUTH on player 2's joystick.
+ */
+
+static const char mj_map_default[]=
+  "device *\n"
+  "note 0-127/10 ABS_X -1\n"
+  "note 1-127/10 ABS_X 1\n"
+  "note 2-127/10 ABS_Y -1\n"
+  "note 3-127/10 ABS_Y 1\n"
+  "note 4-127/10 BTN_SOUTH\n"
+  "note 5-127/10 BTN_WEST\n"
+  "note 6-127/10 BTN_EAST\n"
+  "note 7-127/10 BTN_NORTH\n"
+  "note 8-127/10 BTN_START\n"
+  "note 9-127/10 BTN_SELECT\n"
+  "pitch ABS_RX\n"
+  "cc 1 ABS_RY\n" // Mod wheel
+  "pressure ABS_Z\n"
+;
+
+static const struct mj_map_profile mj_map_profile_empty={.devid=-1,.playerc=1};
+
+/* Event code symbols.
+ */
+
+static const struct mj_map_symbol {
+  const char *name;
+  uint16_t type,code;
+} mj_map_symbolv[]={
+#define _(tag) {#tag,EV_ABS,tag},
+  _(ABS_X) _(ABS_Y) _(ABS_Z) _(ABS_RX) _(ABS_RY) _(ABS_RZ)
+  _(ABS_THROTTLE) _(ABS_RUDDER) _(ABS_WHEEL) _(ABS_GAS) _(ABS_BRAKE)
+  _(ABS_HAT0X) _(ABS_HAT0Y) _(ABS_HAT1X) _(ABS_HAT1Y) _(ABS_HAT2X) _(ABS_HAT2Y) _(ABS_HAT3X) _(ABS_HAT3Y)
+#undef _
+#define _(tag) {#tag,EV_KEY,tag},
+  _(BTN_SOUTH) _(BTN_EAST) _(BTN_NORTH) _(BTN_WEST) _(BTN_A) _(BTN_B) _(BTN_C) _(BTN_X) _(BTN_Y) _(BTN_Z)
+  _(BTN_TL) _(BTN_TR) _(BTN_TL2) _(BTN_TR2) _(BTN_SELECT) _(BTN_START) _(BTN_MODE) _(BTN_THUMBL) _(BTN_THUMBR)
+  _(BTN_DPAD_UP) _(BTN_DPAD_DOWN) _(BTN_DPAD_LEFT) _(BTN_DPAD_RIGHT)
+  _(BTN_TRIGGER) _(BTN_THUMB) _(BTN_THUMB2) _(BTN_TOP) _(BTN_TOP2) _(BTN_PINKIE)
+  _(BTN_BASE) _(BTN_BASE2) _(BTN_BASE3) _(BTN_BASE4) _(BTN_BASE5) _(BTN_BASE6) _(BTN_DEAD)
+  _(BTN_0) _(BTN_1) _(BTN_2) _(BTN_3) _(BTN_4) _(BTN_5) _(BTN_6) _(BTN_7) _(BTN_8) _(BTN_9)
+  _(BTN_TRIGGER_HAPPY1) _(BTN_TRIGGER_HAPPY2) _(BTN_TRIGGER_HAPPY3) _(BTN_TRIGGER_HAPPY4)
+  _(BTN_TRIGGER_HAPPY5) _(BTN_TRIGGER_HAPPY6) _(BTN_TRIGGER_HAPPY7) _(BTN_TRIGGER_HAPPY8)
+#undef _
+};
+
+/* Cleanup.
+ */
+
+static void mj_map_profile_del(struct mj_map_profile *profile) {
+  if (!profile) return;
+  if (profile->name) free(profile->name);
+  free(profile);
+}
+
+void mj_map_del(struct mj_map *map) {
+  if (!map) return;
+  if (map->profilev) {
+    while (map->profilec-->0) mj_map_profile_del(map->profilev[map->profilec]);
+    free(map->profilev);
+  }
+  free(map);
+}
+
+/* Add profile.
+ */
+
+static struct mj_map_profile *mj_map_add_profile(struct mj_map *map,const char *src,int srcc) {
+  if (map->profilec>=map->profilea) {
+    int na=map->profilea+8;
+    if (na>INT_MAX/sizeof(void*)) return 0;
+    void *nv=realloc(map->profilev,sizeof(void*)*na);
+    if (!nv) return 0;
+    map->profilev=nv;
+    map->profilea=na;
+  }
+  struct mj_map_profile *profile=calloc(1,sizeof(struct mj_map_profile));
+  if (!profile) return 0;
+  profile->devid=-1;
+  profile->playerc=1;
+  if ((srcc!=1)||(src[0]!='*')) {
+    int devid=0,srcp=0;
+    for (;srcp<srcc;srcp++) {
+      if ((src[srcp]<'0')||(src[srcp]>'9')||(devid>1000000)) break;
+      devid=devid*10+src[srcp]-'0';
+    }
+    if (srcp>=srcc) {
+      profile->devid=devid;
+    } else {
+      if (!(profile->name=malloc(srcc+1))) {
+        free(profile);
+        return 0;
+      }
+      memcpy(profile->name,src,srcc);
+      profile->name[srcc]=0;
+    }
+  }
+  map->profilev[map->profilec++]=profile;
+  return profile;
+}
+
+/* Primitive tokens.
+ */
+
+static int mj_map_int(int *dst,const char *src,int srcc) {
+  int srcp=0,positive=1;
+  if ((srcp<srcc)&&(src[srcp]=='-')) { positive=0; srcp++; }
+  if (srcp>=srcc) return -1;
+  *dst=0;
+  for (;srcp<srcc;srcp++) {
+    if ((src[srcp]<'0')||(src[srcp]>'9')) return -1;
+    if (*dst>100000000) return -1;
+    *dst=(*dst)*10+src[srcp]-'0';
+  }
+  if (!positive) *dst=-*dst;
+  return 0;
+}
+
+/* "N", "LO-HI", or "LO-HI/STEP", all within 0..(limit-1).
+ */
+static int mj_map_range(int *lo,int *hi,int *step,const char *src,int srcc,int limit) {
+  int dashp=-1,slashp=-1,i=0;
+  for (;i<srcc;i++) {
+    if ((src[i]=='-')&&(dashp<0)) dashp=i;
+    else if ((src[i]=='/')&&(slashp<0)) slashp=i;
+  }
+  *step=1;
+  if (slashp>=0) {
+    if (mj_map_int(step,src+slashp+1,srcc-slashp-1)<0) return -1;
+    if (*step<1) return -1;
+    srcc=slashp;
+  }
+  if ((dashp>=0)&&(dashp<srcc)) {
+    if (mj_map_int(lo,src,dashp)<0) return -1;
+    if (mj_map_int(hi,src+dashp+1,srcc-dashp-1)<0) return -1;
+  } else {
+    if (mj_map_int(lo,src,srcc)<0) return -1;
+    *hi=*lo;
+  }
+  if ((*lo<0)||(*hi<*lo)||(*hi>=limit)) return -1;
+  return 0;
+}
+
+static int mj_map_code(uint16_t *type,uint16_t *code,const char *src,int srcc) {
+  const struct mj_map_symbol *symbol=mj_map_symbolv;
+  int i=sizeof(mj_map_symbolv)/sizeof(struct mj_map_symbol);
+  for (;i-->0;symbol++) {
+    if (strncmp(symbol->name,src,srcc)||symbol->name[srcc]) continue;
+    *type=symbol->type;
+    *code=symbol->code;
+    return 0;
+  }
+  int n;
+  if ((srcc>4)&&!memcmp(src,"key:",4)) {
+    if (mj_map_int(&n,src+4,srcc-4)<0) return -1;
+    if ((n<0)||(n>=KEY_CNT)) return -1;
+    *type=EV_KEY;
+    *code=n;
+    return 0;
+  }
+  if ((srcc>4)&&!memcmp(src,"abs:",4)) {
+    if (mj_map_int(&n,src+4,srcc-4)<0) return -1;
+    if ((n<0)||(n>=ABS_CNT)) return -1;
+    *type=EV_ABS;
+    *code=n;
+    return 0;
+  }
+  return -1;
+}
+
+/* Split line into words.
+ */
+
+#define MJ_MAP_WORD_LIMIT 8
+
+static int mj_map_words(const char **wordv,int *wordcv,const char *src,int srcc) {
+  int wordc=0,srcp=0;
+  while (srcp<srcc) {
+    if ((unsigned char)src[srcp]<=0x20) { srcp++; continue; }
+    if (src[srcp]=='#') break;
+    if (wordc>=MJ_MAP_WORD_LIMIT) return -1;
+    wordv[wordc]=src+srcp;
+    wordcv[wordc]=0;
+    while ((srcp<srcc)&&((unsigned char)src[srcp]>0x20)) { srcp++; wordcv[wordc]++; }
+    wordc++;
+  }
+  return wordc;
+}
+
+/* Mark an event code as used by this profile.
+ * (lo,hi) is the axis range, if it hasn't been declared yet.
+ */
+
+static void mj_map_declare(struct mj_map_profile *profile,uint16_t type,uint16_t code,int lo,int hi) {
+  switch (type) {
+    case EV_KEY: profile->keybits[code>>3]|=1<<(code&7); break;
+    case EV_ABS: if (!(profile->absbits[code>>3]&(1<<(code&7)))) {
+        profile->absbits[code>>3]|=1<<(code&7);
+        profile->absmin[code]=lo;
+        profile->absmax[code]=hi;
+      } break;
+  }
+}
+
+/* Timing options on a switch: "turbo=MS", "long=MS:CODE", "min=MS".
+ */
+ 
+static int mj_map_option_ms(uint16_t *dst,const char *src,int srcc) {
+  int n;
+  if (mj_map_int(&n,src,srcc)<0) return -1;
+  if ((n<1)||(n>0xffff)) return -1;
+  *dst=n;
+  return 0;
+}
+
+static int mj_map_option(struct mj_map_profile *profile,struct mj_map_entry *entry,const char *src,int srcc) {
+  if ((srcc>6)&&!memcmp(src,"turbo=",6)) {
+    if (entry->flags&MJ_MAP_LONG) return -1;
+    if (mj_map_option_ms(&entry->ms,src+6,srcc-6)<0) return -1;
+    entry->flags|=MJ_MAP_TURBO;
+    return 0;
+  }
+  if ((srcc>4)&&!memcmp(src,"min=",4)) {
+    if (mj_map_option_ms(&entry->minms,src+4,srcc-4)<0) return -1;
+    entry->flags|=MJ_MAP_MIN;
+    return 0;
+  }
+  if ((srcc>5)&&!memcmp(src,"long=",5)) {
+    if (entry->flags&MJ_MAP_TURBO) return -1;
+    src+=5;
+    srcc-=5;
+    int colonp=0;
+    while ((colonp<srcc)&&(src[colonp]!=':')) colonp++;
+    if (colonp>=srcc) return -1;
+    if (mj_map_option_ms(&entry->ms,src,colonp)<0) return -1;
+    uint16_t type,code;
+    if (mj_map_code(&type,&code,src+colonp+1,srcc-colonp-1)<0) return -1;
+    if (type!=EV_KEY) return -1;
+    entry->altcode=code;
+    entry->flags|=MJ_MAP_LONG;
+    mj_map_declare(profile,type,code,0,0);
+    return 0;
+  }
+  return -1;
+}
+
+/* Mapping statements: "note", "cc", "cc14", "aftertouch", "pitch", "pressure".
+ * (tablev) is indexed by [chid*stride+key].
+ * (keyc) is the limit for the key argument, or zero if there isn't one.
+ * An axis with no VALUE is analog, if (srcmax) nonzero: It takes the message's value, scaled from 0..srcmax.
+ */
+
+static int mj_map_assign(
+  struct mj_map_profile *profile,
+  struct mj_map_entry *tablev,int stride,int keyc,
+  int srcmax,uint8_t flags,
+  const char **wordv,const int *wordcv,int wordc
+) {
+  int lo=0,hi=0,step=1,chlo=0,chhi=15,chstep=1,wordp=1;
+  if (keyc) {
+    if (wordp>=wordc) return -1;
+    if (mj_map_range(&lo,&hi,&step,wordv[wordp],wordcv[wordp],keyc)<0) return -1;
+    wordp++;
+  }
+  if ((wordp<wordc)&&(wordcv[wordp]>3)&&!memcmp(wordv[wordp],"ch=",3)) {
+    if (mj_map_range(&chlo,&chhi,&chstep,wordv[wordp]+3,wordcv[wordp]-3,16)<0) return -1;
+    wordp++;
+  }
+  struct mj_map_entry entry={0};
+  if (wordp>=wordc) return -1;
+  if (mj_map_code(&entry.type,&entry.code,wordv[wordp],wordcv[wordp])<0) return -1;
+  wordp++;
+  if (entry.type==EV_ABS) {
+    if ((wordp<wordc)&&!memchr(wordv[wordp],'=',wordcv[wordp])) {
+      int value;
+      if (mj_map_int(&value,wordv[wordp],wordcv[wordp])<0) return -1;
+      entry.value=value;
+      wordp++;
+      mj_map_declare(profile,entry.type,entry.code,-1,1);
+    } else if (srcmax) {
+      entry.flags=MJ_MAP_ANALOG|flags;
+      if (flags&MJ_MAP_CENTERED) mj_map_declare(profile,entry.type,entry.code,-8192,8191);
+      else mj_map_declare(profile,entry.type,entry.code,0,srcmax);
+    } else {
+      return -1;
+    }
+  } else if (keyc==128) {
+    entry.value=1;
+    mj_map_declare(profile,entry.type,entry.code,0,0);
+  } else {
+    return -1; // Switches only make sense for notes and 7-bit controllers.
+  }
+  for (;wordp<wordc;wordp++) {
+    if ((entry.flags&MJ_MAP_ANALOG)||(keyc!=128)) return -1;
+    if (mj_map_option(profile,&entry,wordv[wordp],wordcv[wordp])<0) return -1;
+  }
+  int chid=chlo;
+  for (;chid<=chhi;chid+=chstep) {
+    int i=lo;
+    for (;i<=hi;i+=step) {
+      tablev[chid*stride+i]=entry;
+      if (flags&MJ_MAP_14BIT) tablev[chid*stride+i+32]=entry;
+    }
+  }
+  return 0;
+}
+
+/* "axis" statement.
+ */
+
+static int mj_map_axis(struct mj_map_profile *profile,const char **wordv,const int *wordcv,int wordc) {
+  uint16_t type,code;
+  int lo,hi;
+  if (wordc!=4) return -1;
+  if (mj_map_code(&type,&code,wordv[1],wordcv[1])<0) return -1;
+  if (type!=EV_ABS) return -1;
+  if (mj_map_int(&lo,wordv[2],wordcv[2])<0) return -1;
+  if (mj_map_int(&hi,wordv[3],wordcv[3])<0) return -1;
+  if (lo>=hi) return -1;
+  mj_map_declare(profile,type,code,lo,hi);
+  profile->absmin[code]=lo;
+  profile->absmax[code]=hi;
+  return 0;
+}
+
+/* "player" statement.
+ */
+
+static int mj_map_player(struct mj_map_profile *profile,const char **wordv,const int *wordcv,int wordc) {
+  int player,lo=0,hi=127,step=1,chlo=0,chhi=15,chstep=1,notes=0,wordp=2;
+  if (wordc<2) return -1;
+  if (mj_map_int(&player,wordv[1],wordcv[1])<0) return -1;
+  if ((player<1)||(player>MJ_MAP_PLAYER_LIMIT)) return -1;
+  player--;
+  if ((wordp<wordc)&&((wordcv[wordp]<3)||memcmp(wordv[wordp],"ch=",3))) {
+    if (mj_map_range(&lo,&hi,&step,wordv[wordp],wordcv[wordp],128)<0) return -1;
+    notes=1;
+    wordp++;
+  }
+  if ((wordp<wordc)&&(wordcv[wordp]>3)&&!memcmp(wordv[wordp],"ch=",3)) {
+    if (mj_map_range(&chlo,&chhi,&chstep,wordv[wordp]+3,wordcv[wordp]-3,16)<0) return -1;
+    wordp++;
+  }
+  if (wordp<wordc) return -1;
+  int chid=chlo;
+  for (;chid<=chhi;chid+=chstep) {
+    int i=lo;
+    for (;i<=hi;i+=step) profile->noteplayerv[chid][i]=player;
+    if (!notes) profile->chplayerv[chid]=player;
+  }
+  if (player>=profile->playerc) profile->playerc=player+1;
+  return 0;
+}
+
+/* Compile text.
+ */
+
+static int mj_map_compile(struct mj_map *map,const char *src,int srcc,const char *refname) {
+  struct mj_map_profile *profile=0;
+  int srcp=0,lineno=0;
+  while (srcp<srcc) {
+    const char *line=src+srcp;
+    int linec=0;
+    while ((srcp<srcc)&&(src[srcp]!=0x0a)) { srcp++; linec++; }
+    if (srcp<srcc) srcp++;
+    lineno++;
+
+    const char *wordv[MJ_MAP_WORD_LIMIT];
+    int wordcv[MJ_MAP_WORD_LIMIT];
+    int wordc=mj_map_words(wordv,wordcv,line,linec);
+    if (!wordc) continue;
+    int err=-1;
+
+    if ((wordcv[0]==6)&&!memcmp(wordv[0],"device",6)) {
+      if (wordc<2) err=-1;
+      else {
+        // Name may contain spaces; take everything from the second word to the last.
+        int namec=wordv[wordc-1]+wordcv[wordc-1]-wordv[1];
+        if (!(profile=mj_map_add_profile(map,wordv[1],namec))) return -1;
+        err=0;
+      }
+    } else {
+      if (!profile&&!(profile=mj_map_add_profile(map,"*",1))) return -1;
+      #define KW(kw) ((wordcv[0]==sizeof(kw)-1)&&!memcmp(wordv[0],kw,sizeof(kw)-1))
+      #define ASSIGN(table,stride,keyc,srcmax,flags) \
+        err=mj_map_assign(profile,(struct mj_map_entry*)profile->table,stride,keyc,srcmax,flags,wordv,wordcv,wordc);
+      if (KW("note")) ASSIGN(notev,128,128,127,0)
+      else if (KW("cc")) ASSIGN(ccv,128,128,127,0)
+      else if (KW("cc14")) ASSIGN(ccv,128,32,16383,MJ_MAP_14BIT)
+      else if (KW("aftertouch")) ASSIGN(aftertouchv,128,128,127,0)
+      else if (KW("pitch")) ASSIGN(pitchv,1,0,16383,MJ_MAP_CENTERED)
+      else if (KW("pressure")) ASSIGN(pressurev,1,0,127,0)
+      else if (KW("axis")) {
+        err=mj_map_axis(profile,wordv,wordcv,wordc);
+      } else if (KW("player")) {
+        err=mj_map_player(profile,wordv,wordcv,wordc);
+      }
+      #undef KW
+      #undef ASSIGN
+    }
+
+    if (err<0) {
+      fprintf(stderr,"%s:%d: Malformed map statement '%.*s'\n",refname,lineno,linec,line);
+      return -1;
+    }
+  }
+  return 0;
+}
+
+/* Read file.
+ */
+
+static int mj_map_read_file(char **dst,const char *path) {
+  FILE *f=fopen(path,"rb");
+  if (!f) return -1;
+  char *v=0;
+  int c=0,a=0;
+  while (1) {
+    if (c>=a) {
+      if (a>=0x01000000) { fclose(f); free(v); return -1; }
+      a+=4096;
+      void *nv=realloc(v,a);
+      if (!nv) { fclose(f); free(v); return -1; }
+      v=nv;
+    }
+    int err=fread(v+c,1,a-c,f);
+    if (err<=0) break;
+    c+=err;
+  }
+  fclose(f);
+  *dst=v;
+  return c;
+}
+
+/* Load.
+ */
+
+struct mj_map *mj_map_load(const char *path) {
+  struct mj_map *map=calloc(1,sizeof(struct mj_map));
+  if (!map) return 0;
+  if (path) {
+    char *src=0;
+    int srcc=mj_map_read_file(&src,path);
+    if (srcc<0) {
+      fprintf(stderr,"%s: Failed to read map file.\n",path);
+      mj_map_del(map);
+      return 0;
+    }
+    int err=mj_map_compile(map,src,srcc,path);
+    free(src);
+    if (err<0) {
+      mj_map_del(map);
+      return 0;
+    }
+  } else {
+    if (mj_map_compile(map,mj_map_default,sizeof(mj_map_default)-1,"(default)")<0) {
+      mj_map_del(map);
+      return 0;
+    }
+  }
+  return map;
+}
+
+/* Select profile.
+ */
+
+const struct mj_map_profile *mj_map_select(const struct mj_map *map,int devid,const char *name) {
+  if (map) {
+    int i=0;
+    for (;i<map->profilec;i++) {
+      const struct mj_map_profile *profile=map->profilev[i];
+      if ((profile->devid>=0)&&(profile->devid!=devid)) continue;
+      if (profile->name&&(!name||strcmp(profile->name,name))) continue;
+      return profile;
+    }
+  }
+  return &mj_map_profile_empty;
+}
@@ -0,0 +1,150 @@
+#include "midjoy.h"
+#if defined(__SSE2__)
+  #include <emmintrin.h>
+#endif
+
+/* Byte classes.
+ * One lookup per byte tells the parser what to do with it, and for status bytes, how many data bytes follow.
+ * Sysex and Realtime have no length; they're handled specially.
+ */
+ 
+#define MJ_MIDI_CLASS_DATA     0x00
+#define MJ_MIDI_CLASS_STATUS   0x10 /* Channel Voice or System Common. */
+#define MJ_MIDI_CLASS_SYSEX    0x20
+#define MJ_MIDI_CLASS_EOX      0x30
+#define MJ_MIDI_CLASS_REALTIME 0x40
+#define MJ_MIDI_CLASS_MASK     0xf0
+#define MJ_MIDI_LENGTH_MASK    0x03
+
+static const uint8_t mj_midi_classv[256]={
+  [0x80 ... 0xbf]=MJ_MIDI_CLASS_STATUS|2,
+  [0xc0 ... 0xdf]=MJ_MIDI_CLASS_STATUS|1,
+  [0xe0 ... 0xef]=MJ_MIDI_CLASS_STATUS|2,
+  [0xf0]=MJ_MIDI_CLASS_SYSEX,
+  [0xf1]=MJ_MIDI_CLASS_STATUS|1, // MTC Quarter Frame
+  [0xf2]=MJ_MIDI_CLASS_STATUS|2, // Song Position
+  [0xf3]=MJ_MIDI_CLASS_STATUS|1, // Song Select
+  [0xf4 ... 0xf6]=MJ_MIDI_CLASS_STATUS,
+  [0xf7]=MJ_MIDI_CLASS_EOX,
+  [0xf8 ... 0xff]=MJ_MIDI_CLASS_REALTIME,
+};
+
+#define mj_midi_data_length(status) (mj_midi_classv[status]&MJ_MIDI_LENGTH_MASK)
+
+/* Populate event from the parser's current state.
+ */
+ 
+static void mj_midi_event_complete(struct mj_midi_event *event,struct mj_midi_parser *parser) {
+  if (parser->status>=0xf0) {
+    event->opcode=parser->status;
+    event->chid=0;
+    parser->status=0; // System Common cancels Running Status.
+  } else {
+    event->opcode=parser->status&0xf0;
+    event->chid=parser->status&0x0f;
+  }
+  event->a=parser->buf[0];
+  event->b=parser->buf[1];
+  parser->bufc=0;
+}
+
+/* Length of the leading run of data bytes, ie up to the first byte with its high bit set.
+ * This is the Sysex fast path. Looking for just F7 (memchr) isn't enough:
+ * Any status byte ends Sysex, and Realtime can land in the middle of it.
+ */
+ 
+static int mj_midi_data_run(const uint8_t *src,int srcc) {
+  int p=0;
+  #if defined(__SSE2__)
+    for (;p<=srcc-16;p+=16) {
+      int mask=_mm_movemask_epi8(_mm_loadu_si128((const __m128i*)(src+p)));
+      if (mask) return p+__builtin_ctz(mask);
+    }
+  #elif defined(__BYTE_ORDER__)&&(__BYTE_ORDER__==__ORDER_LITTLE_ENDIAN__)
+    for (;p<=srcc-8;p+=8) {
+      uint64_t word;
+      memcpy(&word,src+p,8);
+      word&=0x8080808080808080ull;
+      if (word) return p+(__builtin_ctzll(word)>>3);
+    }
+  #endif
+  for (;p<srcc;p++) if (src[p]&0x80) return p;
+  return p;
+}
+
+/* Parse.
+ */
+
+int mj_midi_parse(struct mj_midi_event *event,struct mj_midi_parser *parser,const void *src,int srcc) {
+  const uint8_t *SRC=src;
+  int srcp=0;
+  event->opcode=0;
+  while (srcp<srcc) {
+  
+    // In Sysex, skip the payload in one pass, and report it.
+    // A status byte other than Realtime ends it; report that too, and handle the status byte next time.
+    // Realtime falls through to be counted below, and we come back here for the rest of the payload.
+    if (parser->sysex) {
+      int runc=mj_midi_data_run(SRC+srcp,srcc-srcp);
+      if (runc) {
+        event->opcode=MJ_MIDI_SYSEX_DATA;
+        event->chid=event->a=event->b=0;
+        parser->sysexv=SRC+srcp;
+        parser->sysexc=runc;
+        return srcp+runc;
+      }
+      if (SRC[srcp]<0xf8) {
+        parser->sysex=0;
+        event->opcode=MJ_MIDI_SYSEX_END;
+        event->chid=event->b=0;
+        if (SRC[srcp]==0xf7) {
+          event->a=1;
+          parser->status=0;
+          return srcp+1;
+        }
+        event->a=0;
+        parser->errorc++;
+        return srcp;
+      }
+    }
+  
+    uint8_t b=SRC[srcp++];
+    uint8_t class=mj_midi_classv[b]&MJ_MIDI_CLASS_MASK;
+    
+    // Data bytes: Accumulate, and deliver when the message is complete. Without a status, drop them.
+    if (class==MJ_MIDI_CLASS_DATA) {
+      if (!parser->status) {
+        parser->errorc++;
+        continue;
+      }
+      parser->buf[parser->bufc++]=b;
+      if (parser->bufc>=mj_midi_data_length(parser->status)) {
+        mj_midi_event_complete(event,parser);
+        return srcp;
+      }
+      continue;
+    }
+    
+    // Realtime: Count it and move on, without touching anything else.
+    if (class==MJ_MIDI_CLASS_REALTIME) {
+      parser->realtimev[b&7]++;
+      continue;
+    }
+    
+    // Other status bytes: Drop any message in progress and start fresh.
+    if (parser->bufc||(parser->status>=0xf0)||(class==MJ_MIDI_CLASS_EOX)) parser->errorc++;
+    parser->bufc=0;
+    parser->buf[0]=parser->buf[1]=0;
+    parser->sysex=0;
+    switch (class) {
+      case MJ_MIDI_CLASS_SYSEX: parser->sysex=1; parser->status=0; break;
+      case MJ_MIDI_CLASS_EOX: parser->status=0; break; // Stray; Sysex in progress is handled above.
+      default: parser->status=b;
+    }
+    if (parser->status&&!mj_midi_data_length(parser->status)) {
+      mj_midi_event_complete(event,parser);
+      return srcp;
+    }
+  }
+  return srcp;
+}
@@ -0,0 +1,213 @@
+#include "midjoy.h"
+#include <unistd.h>
+#include <errno.h>
+#include <endian.h>
+#include <netdb.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+
+/* Socket.
+ */
+
+static int mj_net_socket_udp(const char *path,int listen) {
+  char host[256];
+  const char *port=0;
+  int hostc=0;
+  if (path[0]=='[') { // [IPV6]:PORT
+    const char *close=strchr(path,']');
+    if (!close||(close[1]!=':')) return -1;
+    hostc=close-path-1;
+    if (hostc>=sizeof(host)) return -1;
+    memcpy(host,path+1,hostc);
+    port=close+2;
+  } else {
+    const char *colon=strrchr(path,':');
+    if (!colon) return -1;
+    hostc=colon-path;
+    if (hostc>=sizeof(host)) return -1;
+    memcpy(host,path,hostc);
+    port=colon+1;
+  }
+  host[hostc]=0;
+  struct addrinfo hints={
+    .ai_family=AF_UNSPEC,
+    .ai_socktype=SOCK_DGRAM,
+    .ai_flags=listen?AI_PASSIVE:0,
+  };
+  struct addrinfo *res=0;
+  if (getaddrinfo(hostc?host:0,port,&hints,&res)||!res) {
+    fprintf(stderr,"%s: Failed to resolve address.\n",path);
+    return -1;
+  }
+  int fd=socket(res->ai_family,SOCK_DGRAM|SOCK_CLOEXEC,0);
+  if (fd>=0) {
+    int err=listen?bind(fd,res->ai_addr,res->ai_addrlen):connect(fd,res->ai_addr,res->ai_addrlen);
+    if (err<0) {
+      fprintf(stderr,"%s: Failed to %s: %m\n",path,listen?"bind":"connect");
+      close(fd);
+      fd=-1;
+    }
+  }
+  freeaddrinfo(res);
+  return fd;
+}
+
+static int mj_net_socket_unix(const char *path,int listen) {
+  struct sockaddr_un addr={.sun_family=AF_UNIX};
+  int pathc=strlen(path);
+  if (pathc>=sizeof(addr.sun_path)) return -1;
+  memcpy(addr.sun_path,path,pathc);
+  int fd=socket(AF_UNIX,SOCK_DGRAM|SOCK_CLOEXEC,0);
+  if (fd<0) return -1;
+  if (listen) {
+    unlink(path);
+    if (bind(fd,(struct sockaddr*)&addr,sizeof(addr))<0) {
+      fprintf(stderr,"%s: Failed to bind: %m\n",path);
+      close(fd);
+      return -1;
+    }
+  } else {
+    // Nobody listening yet is fine. We try again when a send fails.
+    connect(fd,(struct sockaddr*)&addr,sizeof(addr));
+  }
+  return fd;
+}
+
+int mj_net_socket(int kind,const char *path,int listen) {
+  switch (kind) {
+    case MJ_NET_UDP: return mj_net_socket_udp(path,listen);
+    case MJ_NET_UNIX: return mj_net_socket_unix(path,listen);
+  }
+  return -1;
+}
+
+/* Frame header.
+ */
+
+static void mj_net_header_encode(struct mj_net_header *header,int kind,int devid,int player,uint32_t seq,int eventc) {
+  header->magic[0]='M';
+  header->magic[1]='J';
+  header->version=MJ_NET_VERSION;
+  header->kind=kind;
+  header->devid=htole32(devid);
+  header->seq=htole32(seq);
+  header->player=player;
+  header->reserved=0;
+  header->eventc=htole16(eventc);
+}
+
+/* HELLO.
+ */
+
+static void mj_net_hello_encode(struct mj_net_hello *hello,const struct mj_map_profile *profile) {
+  memcpy(hello->keybits,profile->keybits,sizeof(hello->keybits));
+  memcpy(hello->absbits,profile->absbits,sizeof(hello->absbits));
+  int i=0;
+  for (;i<ABS_CNT;i++) {
+    hello->absmin[i]=htole32(profile->absmin[i]);
+    hello->absmax[i]=htole32(profile->absmax[i]);
+  }
+}
+
+void mj_net_hello_decode(struct mj_map_profile *profile,const struct mj_net_hello *hello) {
+  memcpy(profile->keybits,hello->keybits,sizeof(hello->keybits));
+  memcpy(profile->absbits,hello->absbits,sizeof(hello->absbits));
+  int i=0;
+  for (;i<ABS_CNT;i++) {
+    profile->absmin[i]=le32toh(hello->absmin[i]);
+    profile->absmax[i]=le32toh(hello->absmax[i]);
+  }
+}
+
+static int mj_net_send_hello(int fd,int devid,int player,uint32_t seq,const struct mj_map_profile *profile) {
+  struct {
+    struct mj_net_header header;
+    struct mj_net_hello hello;
+  } frame;
+  mj_net_header_encode(&frame.header,MJ_NET_HELLO,devid,player,seq,0);
+  mj_net_hello_encode(&frame.hello,profile);
+  return send(fd,&frame,sizeof(frame),MSG_DONTWAIT|MSG_NOSIGNAL);
+}
+
+/* Open.
+ * A HELLO that doesn't go through isn't fatal, it gets repeated.
+ */
+
+static int mj_net_open(int kind,const char *path,int devid,int player,const struct mj_map_profile *profile) {
+  int fd=mj_net_socket(kind,path,0);
+  if (fd<0) {
+    fprintf(stderr,"%s: Failed to open network output for devid %d.\n",path,devid);
+    return -1;
+  }
+  mj_net_send_hello(fd,devid,player,0,profile);
+  return fd;
+}
+
+int mj_net_open_udp(struct mj_output *output,const char *path,int devid,int player,const struct mj_map_profile *profile) {
+  return mj_net_open(MJ_NET_UDP,path,devid,player,profile);
+}
+
+int mj_net_open_unix(struct mj_output *output,const char *path,int devid,int player,const struct mj_map_profile *profile) {
+  return mj_net_open(MJ_NET_UNIX,path,devid,player,profile);
+}
+
+/* Send one frame.
+ * A Unix receiver that restarted has a new socket at the same path; reconnect and try once more.
+ */
+
+static void mj_net_send(struct mj_output *output,struct mj_output_device *device,const void *src,int srcc) {
+  int err=send(device->fd,src,srcc,MSG_DONTWAIT|MSG_NOSIGNAL);
+  if ((err<0)&&((errno==ECONNREFUSED)||(errno==ENOTCONN)||(errno==EDESTADDRREQ))&&!memcmp(output->dstpath,"unix:",5)) {
+    struct sockaddr_un addr={.sun_family=AF_UNIX};
+    strncpy(addr.sun_path,output->dstpath+5,sizeof(addr.sun_path)-1);
+    if (connect(device->fd,(struct sockaddr*)&addr,sizeof(addr))>=0) {
+      err=send(device->fd,src,srcc,MSG_DONTWAIT|MSG_NOSIGNAL);
+    }
+  }
+  if (err<0) {
+    if (!device->netdropc++) fprintf(stderr,"MIDI %d: Network output is dropping frames: %m\n",device->devid);
+  }
+}
+
+/* Write.
+ * (src) is whole input_events, at most MJ_OUTPUT_EVENT_LIMIT of them.
+ * We drop the timestamps: uinput on the far side stamps them itself.
+ */
+
+int mj_net_write(struct mj_output *output,struct mj_output_device *device,const void *src,int srcc) {
+  struct {
+    struct mj_net_header header;
+    struct mj_net_event eventv[MJ_OUTPUT_EVENT_LIMIT];
+  } frame;
+  int eventc=srcc/sizeof(struct input_event);
+  if (eventc>MJ_OUTPUT_EVENT_LIMIT) return -1;
+
+  int64_t now=mj_now();
+  if (!device->nethello) {
+    device->nethello=now;
+  } else if (now-device->nethello>=MJ_NET_HELLO_INTERVAL_NS) {
+    device->nethello=now;
+    mj_net_send_hello(device->fd,device->devid,device->player,++(device->netseq),device->profile);
+  }
+
+  const struct input_event *event=src;
+  struct mj_net_event *dst=frame.eventv;
+  int i=eventc;
+  for (;i-->0;event++,dst++) {
+    dst->type=htole16(event->type);
+    dst->code=htole16(event->code);
+    dst->value=htole32(event->value);
+  }
+  mj_net_header_encode(&frame.header,MJ_NET_EVENTS,device->devid,device->player,++(device->netseq),eventc);
+  mj_net_send(output,device,&frame,sizeof(struct mj_net_header)+sizeof(struct mj_net_event)*eventc);
+  return 0;
+}
+
+/* Close: Tell the receiver, so it can drop the joystick right away.
+ */
+
+void mj_net_close(struct mj_output *output,struct mj_output_device *device) {
+  struct mj_net_header header;
+  mj_net_header_encode(&header,MJ_NET_BYE,device->devid,device->player,++(device->netseq),0);
+  send(device->fd,&header,sizeof(header),MSG_DONTWAIT|MSG_NOSIGNAL);
+}
@@ -9,16 +9,58 @@
 /* Cleanup.
  */
  
-static void mj_output_device_cleanup(struct mj_output_device *device) {
+static void mj_output_cancel_timers(struct mj_output_device *device);
+
+/* Zero is a valid (fd) for backends that don't use one. Negative means it never opened.
+ */
+static void mj_output_close_fd(struct mj_output *output,struct mj_output_device *device) {
+  if (device->fd<0) return;
+  if (output->backend&&output->backend->close) output->backend->close(output,device);
   if (device->fd>0) close(device->fd);
 }
+ 
+static void mj_output_device_del(struct mj_output *output,struct mj_output_device *device) {
+  if (!device) return;
+  while (device->playerc>1) mj_output_device_del(output,device->playerv[--(device->playerc)]);
+  mj_output_cancel_timers(device);
+  mj_output_close_fd(output,device);
+  free(device);
+}
+
+/* Return a device record to the spare pool, or free it if we're not pooling.
+ */
+ 
+static void mj_output_device_release(struct mj_output *output,struct mj_output_device *device) {
+  if (output->uring) mj_uring_drain_writes(output->uring); // Before the fd closes, or worse, gets reused.
+  if (output->sparea) {
+    while (device->playerc>1) mj_output_device_release(output,device->playerv[--(device->playerc)]);
+    mj_output_cancel_timers(device);
+    mj_output_close_fd(output,device);
+    memset(device,0,sizeof(struct mj_output_device));
+    output->sparev[output->sparec++]=device;
+  } else {
+    mj_output_device_del(output,device);
+  }
+}
 
 void mj_output_cleanup(struct mj_output *output) {
+  if (output->uring) mj_uring_drain_writes(output->uring);
   if (output->dstpath) free(output->dstpath);
+  if (output->mappath) free(output->mappath);
+  mj_map_del(output->map);
   if (output->devicev) {
-    while (output->devicec-->0) mj_output_device_cleanup(output->devicev+output->devicec);
+    while (output->devicec-->0) mj_output_device_del(output,output->devicev[output->devicec]);
     free(output->devicev);
   }
+  if (output->lingerv) {
+    while (output->lingerc-->0) mj_output_device_del(output,output->lingerv[output->lingerc]);
+    free(output->lingerv);
+  }
+  if (output->sparev) {
+    while (output->sparec-->0) free(output->sparev[output->sparec]);
+    free(output->sparev);
+  }
+  mj_padpage_del(output->padpage);
   memset(output,0,sizeof(struct mj_output));
 }
 
@@ -38,323 +80,944 @@ int mj_output_set_dstdev(struct mj_output *output,const char *src,int srcc) {
   return 0;
 }
 
-/* Finish configuration.
- */
- 
-int mj_output_ready(struct mj_output *output) {
-  if (!output->dstpath) {
-    if (mj_output_set_dstdev(output,MJ_OUTPUT_DEFAULT_DSTDEV,-1)<0) return -1;
+int mj_output_set_mappath(struct mj_output *output,const char *src,int srcc) {
+  if (!src) srcc=0; else if (srcc<0) { srcc=0; while (src[srcc]) srcc++; }
+  char *nv=0;
+  if (srcc) {
+    if (!(nv=malloc(srcc+1))) return -1;
+    memcpy(nv,src,srcc);
+    nv[srcc]=0;
   }
+  if (output->mappath) free(output->mappath);
+  output->mappath=nv;
   return 0;
 }
 
 /* Device list.
  */
  
-static struct mj_output_device *mj_output_device_by_devid(const struct mj_output *output,int devid) {
-  struct mj_output_device *device=output->devicev;
+struct mj_output_device *mj_output_device_by_devid(const struct mj_output *output,int devid) {
   int i=output->devicec;
-  for (;i-->0;device++) if (device->devid==devid) return device;
+  while (i-->0) if (output->devicev[i]->devid==devid) return output->devicev[i];
   return 0;
 }
- 
-static int mj_output_fd_by_devid(const struct mj_output *output,int devid) {
-  const struct mj_output_device *device=output->devicev;
-  int i=output->devicec;
-  for (;i-->0;device++) if (device->devid==devid) return device->fd;
-  return -1;
-}
- 
-static int mj_output_devid_by_fd(const struct mj_output *output,int fd) {
-  const struct mj_output_device *device=output->devicev;
-  int i=output->devicec;
-  for (;i-->0;device++) if (device->fd==fd) return device->devid;
-  return -1;
-}
 
-static void mj_output_drop_device_by_devid(struct mj_output *output,int devid) {
-  int i=0;
-  struct mj_output_device *device=output->devicev;
-  for (;i<output->devicec;i++,device++) {
-    if (device->devid==devid) {
-      mj_output_device_cleanup(device);
-      output->devicec--;
-      memmove(device,device+1,sizeof(struct mj_output_device)*(output->devicec-i));
-      return;
-    }
+static void mj_output_drop_device(struct mj_output *output,struct mj_output_device *device) {
+  int i=output->devicec;
+  while (i-->0) {
+    if (output->devicev[i]!=device) continue;
+    mj_output_device_release(output,device);
+    output->devicec--;
+    memmove(output->devicev+i,output->devicev+i+1,sizeof(void*)*(output->devicec-i));
+    return;
   }
 }
 
-static int mj_output_add_device(struct mj_output *output,int fd,int devid) {
+static int mj_output_list_device(struct mj_output *output,struct mj_output_device *device) {
   if (output->devicec>=output->devicea) {
+    if (output->sparea) return -1;
     int na=output->devicea+8;
-    if (na>INT_MAX/sizeof(struct mj_output_device)) return -1;
-    void *nv=realloc(output->devicev,sizeof(struct mj_output_device)*na);
+    if (na>INT_MAX/sizeof(void*)) return -1;
+    void *nv=realloc(output->devicev,sizeof(void*)*na);
     if (!nv) return -1;
     output->devicev=nv;
     output->devicea=na;
   }
-  struct mj_output_device *device=output->devicev+output->devicec++;
-  memset(device,0,sizeof(struct mj_output_device));
+  output->devicev[output->devicec++]=device;
+  return 0;
+}
+
+static int mj_output_evict_lingering(struct mj_output *output);
+
+/* Fresh record, not listed anywhere yet.
+ */
+static struct mj_output_device *mj_output_new_device(struct mj_output *output,int fd,int devid) {
+  struct mj_output_device *device;
+  if (output->sparea) {
+    if (!output->sparec&&(mj_output_evict_lingering(output)<0)) return 0;
+    device=output->sparev[--(output->sparec)];
+  } else {
+    if (!(device=calloc(1,sizeof(struct mj_output_device)))) return 0;
+  }
   device->fd=fd;
   device->devid=devid;
+  device->playerc=1;
+  int i=MJ_MAP_PLAYER_LIMIT;
+  while (i-->0) device->playerv[i]=device;
+  return device;
+}
+
+static struct mj_output_device *mj_output_add_device(struct mj_output *output,int fd,int devid) {
+  struct mj_output_device *device=mj_output_new_device(output,fd,devid);
+  if (!device) return 0;
+  if (mj_output_list_device(output,device)<0) {
+    device->fd=-1;
+    mj_output_device_release(output,device);
+    return 0;
+  }
+  return device;
+}
+
+/* Lingering devices.
+ * A disconnected device with a grace period moves here, still open, with everything released.
+ */
+ 
+static int mj_output_release_all(struct mj_output *output,struct mj_output_device *device);
+
+static int mj_output_linger(struct mj_output *output,struct mj_output_device *device) {
+  if (output->lingerc>=output->lingera) {
+    if (output->sparea) return -1;
+    int na=output->lingera+8;
+    if (na>INT_MAX/sizeof(void*)) return -1;
+    void *nv=realloc(output->lingerv,sizeof(void*)*na);
+    if (!nv) return -1;
+    output->lingerv=nv;
+    output->lingera=na;
+  }
+  if (mj_output_release_all(output,device)<0) return -1;
+  int i=device->playerc;
+  while (i-->0) {
+    struct mj_output_device *player=device->playerv[i];
+    memset(player->abspendv,0,sizeof(player->abspendv));
+    memset(player->ccstatev,0,sizeof(player->ccstatev));
+    player->frameeventc=0;
+  }
+  memset(&device->parser,0,sizeof(device->parser));
+  if (device->persistent) device->expiry=0;
+  else device->expiry=mj_now()+(int64_t)output->grace*1000000;
+  output->lingerv[output->lingerc++]=device;
   return 0;
 }
 
+static struct mj_output_device *mj_output_unlinger(struct mj_output *output,int p) {
+  struct mj_output_device *device=output->lingerv[p];
+  output->lingerc--;
+  memmove(output->lingerv+p,output->lingerv+p+1,sizeof(void*)*(output->lingerc-p));
+  return device;
+}
+
+/* Close the lingering device nearest expiry, to make room in a fixed pool.
+ * Prewarmed devices are never evicted.
+ */
+static int mj_output_evict_lingering(struct mj_output *output) {
+  int i=output->lingerc,best=-1;
+  while (i-->0) {
+    const struct mj_output_device *device=output->lingerv[i];
+    if (device->persistent) continue;
+    if ((best<0)||(device->expiry<output->lingerv[best]->expiry)) best=i;
+  }
+  if (best<0) return -1;
+  mj_output_device_release(output,mj_output_unlinger(output,best));
+  return 0;
+}
+
+int mj_output_expire(struct mj_output *output,int64_t now) {
+  int64_t next=0;
+  int i=output->lingerc;
+  while (i-->0) {
+    const struct mj_output_device *device=output->lingerv[i];
+    if (!device->expiry) continue;
+    if (device->expiry<=now) {
+      mj_output_device_release(output,mj_output_unlinger(output,i));
+    } else if (!next||(device->expiry<next)) {
+      next=device->expiry;
+    }
+  }
+  if (!next) return -1;
+  return (next-now+999999)/1000000;
+}
+
 /* Perform the uinput handshake.
+ * Capabilities are whatever the profile uses.
  */
   
-static int mj_output_handshake(int fd,int devid) {
+static int mj_output_handshake(int fd,int devid,int player,const struct mj_map_profile *profile) {
   struct uinput_user_dev uud={0};
+  int i;
   
-  snprintf(uud.name,sizeof(uud.name),"MIDI %d",devid);
+  if (player) snprintf(uud.name,sizeof(uud.name),"MIDI %d P%d",devid,player+1);
+  else snprintf(uud.name,sizeof(uud.name),"MIDI %d",devid);
   
-  uud.absmin[ABS_X]=uud.absmin[ABS_Y]=-1;
-  uud.absmax[ABS_X]=uud.absmax[ABS_Y]=1;
+  for (i=0;i<ABS_CNT;i++) {
+    if (!(profile->absbits[i>>3]&(1<<(i&7)))) continue;
+    uud.absmin[i]=profile->absmin[i];
+    uud.absmax[i]=profile->absmax[i];
+  }
   
   if (write(fd,&uud,sizeof(uud))<0) return -1;
   
   if (ioctl(fd,UI_SET_EVBIT,EV_ABS)<0) return -1;
   if (ioctl(fd,UI_SET_EVBIT,EV_KEY)<0) return -1;
   
-  if (ioctl(fd,UI_SET_ABSBIT,ABS_X)<0) return -1;
-  if (ioctl(fd,UI_SET_ABSBIT,ABS_Y)<0) return -1;
-  
-  if (ioctl(fd,UI_SET_KEYBIT,BTN_SOUTH)<0) return -1;
-  if (ioctl(fd,UI_SET_KEYBIT,BTN_WEST)<0) return -1;
-  if (ioctl(fd,UI_SET_KEYBIT,BTN_EAST)<0) return -1;
-  if (ioctl(fd,UI_SET_KEYBIT,BTN_NORTH)<0) return -1;
-  if (ioctl(fd,UI_SET_KEYBIT,BTN_START)<0) return -1;
-  if (ioctl(fd,UI_SET_KEYBIT,BTN_SELECT)<0) return -1;
+  for (i=0;i<ABS_CNT;i++) {
+    if (!(profile->absbits[i>>3]&(1<<(i&7)))) continue;
+    if (ioctl(fd,UI_SET_ABSBIT,i)<0) return -1;
+  }
+  for (i=0;i<KEY_CNT;i++) {
+    if (!(profile->keybits[i>>3]&(1<<(i&7)))) continue;
+    if (ioctl(fd,UI_SET_KEYBIT,i)<0) return -1;
+  }
   
   if (ioctl(fd,UI_DEV_CREATE)<0) return -1;
   
   return 0;
 }
 
-/* Connect device.
+/* Name of a MIDI device, for matching map profiles.
+ * We use the sound card's id from sysfs. Empty if we can't find it, that's normal for FIFOs and such.
  */
+ 
+static void mj_output_device_name(char *dst,int dsta,int devid) {
+  dst[0]=0;
+  char path[64];
+  snprintf(path,sizeof(path),"/sys/class/sound/midi%d/device/id",devid);
+  int fd=open(path,O_RDONLY);
+  if (fd<0) return;
+  int dstc=read(fd,dst,dsta-1);
+  close(fd);
+  if (dstc<0) dstc=0;
+  while (dstc&&((unsigned char)dst[dstc-1]<=0x20)) dstc--;
+  dst[dstc]=0;
+}
 
-int mj_output_connect_device(struct mj_output *output,int devid) {
-  
-  int fd=open(output->dstpath,O_RDWR);
+/* Preallocate.
+ */
+ 
+int mj_output_reserve(struct mj_output *output,int devicea) {
+  if (output->sparea||output->devicec) return -1;
+  if ((devicea<1)||(devicea>INT_MAX/sizeof(void*)/MJ_MAP_PLAYER_LIMIT)) return -1;
+  int recorda=devicea*MJ_MAP_PLAYER_LIMIT; // Split devices take one per player, and we can't know how many the map will want.
+  void *nv=realloc(output->devicev,sizeof(void*)*devicea);
+  if (!nv) return -1;
+  output->devicev=nv;
+  output->devicea=devicea;
+  if (!(output->sparev=malloc(sizeof(void*)*recorda))) return -1;
+  if (!(output->lingerv=malloc(sizeof(void*)*devicea))) return -1;
+  output->lingera=devicea;
+  while (output->sparec<recorda) {
+    struct mj_output_device *device=calloc(1,sizeof(struct mj_output_device));
+    if (!device) return -1;
+    output->sparev[output->sparec++]=device;
+  }
+  output->sparea=recorda;
+  return 0;
+}
+
+/* Backends.
+ * Selected by a prefix on dstdev: "file:PATH" appends raw input_events to a file instead of talking to uinput.
+ * Players after the first go to "PATH.pN" in the file backend, since the events themselves don't say whose they are.
+ * Network sinks are in mj_net.c, and shared memory in mj_padpage.c. The in-process one (mj_lib.c) isn't listed; it's installed directly.
+ */
+ 
+static int mj_output_open_uinput(struct mj_output *output,const char *path,int devid,int player,const struct mj_map_profile *profile) {
+  int fd=open(path,O_RDWR);
   if (fd<0) {
-    fprintf(stderr,"%s: Failed to open uinput for devid %d.\n",output->dstpath,devid);
+    fprintf(stderr,"%s: Failed to open uinput for devid %d.\n",path,devid);
     return -1;
   }
-  
-  if (mj_output_handshake(fd,devid)<0) {
+  if (mj_output_handshake(fd,devid,player,profile)<0) {
     close(fd);
     return -1;
   }
-  
-  if (mj_output_add_device(output,fd,devid)<0) {
-    close(fd);
+  return fd;
+}
+ 
+static int mj_output_open_file(struct mj_output *output,const char *path,int devid,int player,const struct mj_map_profile *profile) {
+  char subpath[1024];
+  if (player) {
+    if (snprintf(subpath,sizeof(subpath),"%s.p%d",path,player+1)>=sizeof(subpath)) return -1;
+    path=subpath;
+  }
+  int fd=open(path,O_WRONLY|O_CREAT|O_APPEND,0666);
+  if (fd<0) {
+    fprintf(stderr,"%s: Failed to open output file for devid %d.\n",path,devid);
     return -1;
   }
-  
+  return fd;
+}
+
+static int mj_output_write_fd(struct mj_output *output,struct mj_output_device *device,const void *src,int srcc) {
+  if (write(device->fd,src,srcc)!=srcc) return -1;
   return 0;
 }
 
+static const struct mj_output_backend mj_output_backendv[]={
+  {.prefix="file:",.direct=1,.open=mj_output_open_file,.write=mj_output_write_fd},
+  {.prefix="udp:",.open=mj_net_open_udp,.write=mj_net_write,.close=mj_net_close},
+  {.prefix="unix:",.open=mj_net_open_unix,.write=mj_net_write,.close=mj_net_close},
+  {.prefix="shm:",.open=mj_padpage_open,.write=mj_padpage_write,.close=mj_padpage_close},
+  {.prefix="",.direct=1,.open=mj_output_open_uinput,.write=mj_output_write_fd}, // Must be last.
+};
+
+static const struct mj_output_backend *mj_output_backend_for_path(const char *path) {
+  const struct mj_output_backend *backend=mj_output_backendv;
+  for (;;backend++) {
+    int prefixc=strlen(backend->prefix);
+    if (!memcmp(path,backend->prefix,prefixc)) return backend;
+  }
+}
+
+int mj_output_open_sink(const char *dstpath,int devid,int player,const struct mj_map_profile *profile) {
+  const struct mj_output_backend *backend=mj_output_backend_for_path(dstpath);
+  if (!backend->direct) return -1;
+  return backend->open(0,dstpath+strlen(backend->prefix),devid,player,profile);
+}
+
+/* Finish configuration.
+ */
+ 
+int mj_output_ready(struct mj_output *output) {
+  if (!output->dstpath) {
+    if (mj_output_set_dstdev(output,MJ_OUTPUT_DEFAULT_DSTDEV,-1)<0) return -1;
+  }
+  if (!output->backend) output->backend=mj_output_backend_for_path(output->dstpath);
+  if (!(output->map=mj_map_load(output->mappath))) return -1;
+  return 0;
+}
+
+/* Connect device.
+ */
+
+static void mj_output_find_stats(struct mj_output *output,struct mj_output_device *device) {
+  struct mj_stats_slot *slot=mj_stats_get(output->stats,device->devid,0);
+  int i=device->playerc;
+  while (i-->0) device->playerv[i]->stats=slot;
+}
+
+/* Open players after the first, for a primary that just opened with (device->profile).
+ * On failure, the ones that did open are listed in (playerv) as usual.
+ */
+static int mj_output_open_players(struct mj_output *output,struct mj_output_device *device) {
+  const struct mj_map_profile *profile=device->profile;
+  const char *path=output->dstpath+strlen(output->backend->prefix);
+  for (;device->playerc<profile->playerc;device->playerc++) {
+    struct mj_output_device *player=0;
+    int fd=output->backend->open(output,path,device->devid,device->playerc,profile);
+    if (fd>=0) {
+      if (!(player=mj_output_new_device(output,fd,device->devid))&&(fd>0)) close(fd);
+    }
+    if (!player) return -1;
+    player->profile=profile;
+    player->player=device->playerc;
+    device->playerv[device->playerc]=player;
+  }
+  return 0;
+}
+
+/* Any player failed. Those are never reused: Connecting again builds them fresh.
+ */
+static int mj_output_device_failed(const struct mj_output_device *device) {
+  int i=device->playerc;
+  while (i-->0) if (device->playerv[i]->failed) return 1;
+  return 0;
+}
+
+struct mj_output_device *mj_output_connect_device(struct mj_output *output,int devid) {
+  
+  char name[64];
+  mj_output_device_name(name,sizeof(name),devid);
+  const struct mj_map_profile *profile=mj_map_select(output->map,devid,name);
+  
+  /* If it's lingering, and the same profile, that's a free connection.
+   * Different profile means a different kind of device took this devid; it needs fresh capabilities.
+   */
+  int i=output->lingerc;
+  while (i-->0) {
+    if (output->lingerv[i]->devid!=devid) continue;
+    struct mj_output_device *device=mj_output_unlinger(output,i);
+    if ((device->profile==profile)&&!mj_output_device_failed(device)&&(mj_output_list_device(output,device)>=0)) {
+      mj_output_set_timers(device,output->timers);
+      mj_output_find_stats(output,device);
+      return device;
+    }
+    if (device->persistent) {
+      fprintf(stderr,"MIDI %d: Profile changed, replacing prewarmed device.\n",devid);
+    }
+    mj_output_device_release(output,device);
+    break;
+  }
+  
+  const char *path=output->dstpath+strlen(output->backend->prefix);
+  int fd=output->backend->open(output,path,devid,0,profile);
+  if (fd<0) return 0;
+  
+  struct mj_output_device *device=mj_output_add_device(output,fd,devid);
+  if (!device) {
+    if (fd>0) close(fd);
+    return 0;
+  }
+  device->profile=profile;
+  if (mj_output_open_players(output,device)<0) {
+    mj_output_drop_device(output,device);
+    return 0;
+  }
+  
+  mj_output_set_timers(device,output->timers);
+  mj_output_find_stats(output,device);
+  return device;
+}
+
+void mj_output_set_timers(struct mj_output_device *device,struct mj_timer_wheel *timers) {
+  int i=device->playerc;
+  while (i-->0) device->playerv[i]->timers=timers;
+}
+
 /* Disconnect device.
  */
 
-int mj_output_disconnect_device(struct mj_output *output,int devid) {
-  mj_output_drop_device_by_devid(output,devid);
+int mj_output_disconnect_device(struct mj_output *output,struct mj_output_device *device) {
+  if (!device) return 0;
+  if ((device->persistent||(output->grace>0))&&!mj_output_device_failed(device)) {
+    int i=output->devicec;
+    while (i-->0) {
+      if (output->devicev[i]!=device) continue;
+      output->devicec--;
+      memmove(output->devicev+i,output->devicev+i+1,sizeof(void*)*(output->devicec-i));
+      if (mj_output_linger(output,device)<0) mj_output_device_release(output,device);
+      return 0;
+    }
+    return 0;
+  }
+  mj_output_drop_device(output,device);
   return 0;
 }
 
-/* Map MIDI notes to Linux event codes.
- * (value) is only relevant when (type==EV_ABS).
+/* Prewarm.
  */
+ 
+int mj_output_prewarm(struct mj_output *output,int devid) {
+  if (mj_output_device_by_devid(output,devid)) return 0;
+  int i=output->lingerc;
+  while (i-->0) {
+    if (output->lingerv[i]->devid!=devid) continue;
+    output->lingerv[i]->persistent=1;
+    output->lingerv[i]->expiry=0;
+    return 0;
+  }
+  struct mj_output_device *device=mj_output_connect_device(output,devid);
+  if (!device) return -1;
+  device->persistent=1;
+  return mj_output_disconnect_device(output,device);
+}
 
-static int mj_event_from_note(int *type,int *code,int *value,uint8_t noteid) {
-  *value=0;
-  switch (noteid%10) {
-    case 0: *type=EV_ABS; *code=ABS_X; *value=-1; return 0;
-    case 1: *type=EV_ABS; *code=ABS_X; *value=1; return 0;
-    case 2: *type=EV_ABS; *code=ABS_Y; *value=-1; return 0;
-    case 3: *type=EV_ABS; *code=ABS_Y; *value=1; return 0;
-    case 4: *type=EV_KEY; *code=BTN_SOUTH; return 0;
-    case 5: *type=EV_KEY; *code=BTN_WEST; return 0;
-    case 6: *type=EV_KEY; *code=BTN_EAST; return 0;
-    case 7: *type=EV_KEY; *code=BTN_NORTH; return 0;
-    case 8: *type=EV_KEY; *code=BTN_START; return 0;
-    case 9: *type=EV_KEY; *code=BTN_SELECT; return 0;
+/* Event buffer.
+ * Queueing never writes unless the buffer is full; one slot is always held in reserve for the final SYN_REPORT.
+ * Flushing a frame with nothing in it writes nothing, not even the SYN_REPORT.
+ * A write that fails flags the device and isn't an error: One broken joystick shouldn't take the daemon down.
+ */
+ 
+static int mj_output_write_events(struct mj_output *output,struct mj_output_device *device) {
+  if (device->eventc<1) return 0;
+  if (device->failed) {
+    device->eventc=0;
+    return 0;
   }
-  return -1;
+  int len=sizeof(struct input_event)*device->eventc;
+  device->frameeventc+=device->eventc;
+  device->unsyncedc+=device->eventc;
+  device->writeeventc+=device->eventc;
+  device->writec++;
+  MJ_STATS_ADD(device->stats,eventc,device->eventc);
+  MJ_STATS_ADD(device->stats,writec,1);
+  device->eventc=0;
+  int err;
+  if (output->uring&&output->backend->direct) err=mj_uring_write(output->uring,device->fd,device->eventv,len,&device->failed);
+  else err=output->backend->write(output,device,device->eventv,len);
+  if (err<0) {
+    fprintf(stderr,"MIDI %d: Output failed for player %d. Ignoring it until the device reconnects.\n",device->devid,device->player+1);
+    device->failed=1;
+  }
+  return 0;
+}
+ 
+static int mj_output_queue(struct mj_output *output,struct mj_output_device *device,int type,int code,int value) {
+  if (device->eventc>=MJ_OUTPUT_EVENT_LIMIT-1) {
+    if (mj_output_write_events(output,device)<0) return -1;
+  }
+  struct input_event *event=device->eventv+device->eventc++;
+  memset(event,0,sizeof(struct input_event));
+  event->type=type;
+  event->code=code;
+  event->value=value;
+  return 0;
 }
 
-/* Note Off.
+static int mj_output_flush(struct mj_output *output,struct mj_output_device *device) {
+  while (device->absdirty) {
+    int code=__builtin_ctzll(device->absdirty);
+    device->absdirty&=device->absdirty-1;
+    if (device->abspendv[code]==device->absv[code]) continue;
+    device->absv[code]=device->abspendv[code];
+    if (mj_output_queue(output,device,EV_ABS,code,device->absv[code])<0) return -1;
+  }
+  if (!device->eventc&&!device->unsyncedc) return 0;
+  struct input_event *event=device->eventv+device->eventc++;
+  memset(event,0,sizeof(struct input_event));
+  event->type=EV_SYN;
+  event->code=SYN_REPORT;
+  int err=mj_output_write_events(output,device);
+  device->unsyncedc=0;
+  return err;
+}
+
+/* Button, only if it changes.
+ * Two notes on the same button: The second press is a noop, and the first release lets go.
  */
  
-static int mj_output_note_off(
-  struct mj_output *output,
-  struct mj_output_device *device,
-  uint8_t noteid
-) {
-  int type,code,value;
-  if (mj_event_from_note(&type,&code,&value,noteid)<0) return 0;
-  switch (type) {
-    case EV_ABS: switch (code) {
-        case ABS_X: {
-            if (value==device->x) {
-              device->x=0;
-              struct input_event event={
-                .type=EV_ABS,
-                .code=ABS_X,
-                .value=0,
-              };
-              if (write(device->fd,&event,sizeof(event))<0) return -1;
-            }
-          } break;
-        case ABS_Y: {
-            if (value==device->y) {
-              device->y=0;
-              struct input_event event={
-                .type=EV_ABS,
-                .code=ABS_Y,
-                .value=0,
-              };
-              if (write(device->fd,&event,sizeof(event))<0) return -1;
-            }
-          } break;
+static int mj_output_key(struct mj_output *output,struct mj_output_device *device,int code,int value) {
+  uint8_t *bits=device->keyv+(code>>3);
+  uint8_t mask=1<<(code&7);
+  if (value) {
+    if (*bits&mask) return 0;
+    *bits|=mask;
+  } else {
+    if (!(*bits&mask)) return 0;
+    *bits&=~mask;
+  }
+  return mj_output_queue(output,device,EV_KEY,code,value);
+}
+
+/* Release and press, per map entry.
+ * Digital axes go out immediately, and override any analog value pending for the same axis.
+ */
+ 
+static int mj_output_release(struct mj_output *output,struct mj_output_device *device,const struct mj_map_entry *entry) {
+  switch (entry->type) {
+    case EV_ABS: {
+        if (device->absv[entry->code]!=entry->value) return 0;
+        device->absv[entry->code]=0;
+        device->absdirty&=~(1ull<<entry->code);
+        return mj_output_queue(output,device,EV_ABS,entry->code,0);
+      }
+    case EV_KEY: return mj_output_key(output,device,entry->code,0);
+  }
+  return 0;
+}
+ 
+static int mj_output_press(struct mj_output *output,struct mj_output_device *device,const struct mj_map_entry *entry) {
+  switch (entry->type) {
+    case EV_ABS: {
+        device->absdirty&=~(1ull<<entry->code);
+        if (device->absv[entry->code]==entry->value) return 0;
+        device->absv[entry->code]=entry->value;
       } break;
-    case EV_KEY: {
-        struct input_event event={
-          .type=EV_KEY,
-          .code=code,
-          .value=0,
-        };
-        if (write(device->fd,&event,sizeof(event))<0) return -1;
+    case EV_KEY: return mj_output_key(output,device,entry->code,entry->value);
+    case 0: return 0;
+  }
+  return mj_output_queue(output,device,entry->type,entry->code,entry->value);
+}
+
+/* Analog axis update, (v) in 0..srcmax.
+ * We only record it here. Each dirty axis is written once at flush, with its final value.
+ */
+ 
+static int mj_output_analog(struct mj_output_device *device,const struct mj_map_entry *entry,int v,int srcmax) {
+  if (entry->type!=EV_ABS) return 0;
+  int lo=device->profile->absmin[entry->code];
+  int hi=device->profile->absmax[entry->code];
+  device->abspendv[entry->code]=lo+(int)(((int64_t)v*(hi-lo))/srcmax);
+  device->absdirty|=1ull<<entry->code;
+  return 0;
+}
+
+/* Timed switches.
+ * Each active press of an MJ_MAP_TIMED entry holds a slot in (device->timerv).
+ * Everything that happens on a timer is written as its own frame.
+ */
+ 
+#define MJ_OUTPUT_TIMER_HELD      1 /* Pressed, nothing scheduled. Only (minms) to enforce at release. */
+#define MJ_OUTPUT_TIMER_TURBO_ON  2
+#define MJ_OUTPUT_TIMER_TURBO_OFF 3
+#define MJ_OUTPUT_TIMER_LONG_WAIT 4 /* Held, nothing pressed yet. */
+#define MJ_OUTPUT_TIMER_LONG      5 /* (altcode) pressed. */
+#define MJ_OUTPUT_TIMER_RELEASING 6 /* Note is off, but (code) stays pressed until the timer. */
+
+static struct mj_output_timer *mj_output_timer_find(struct mj_output_device *device,const struct mj_map_entry *entry) {
+  if (!device->timerc) return 0;
+  struct mj_output_timer *timer=device->timerv;
+  int i=MJ_OUTPUT_TIMER_LIMIT;
+  for (;i-->0;timer++) if (timer->entry==entry) return timer;
+  return 0;
+}
+
+static void mj_output_timer_free(struct mj_output_device *device,struct mj_output_timer *timer) {
+  mj_timer_cancel(&timer->timer);
+  timer->entry=0;
+  device->timerc--;
+}
+
+static void mj_output_cancel_timers(struct mj_output_device *device) {
+  struct mj_output_timer *timer=device->timerv;
+  int i=MJ_OUTPUT_TIMER_LIMIT;
+  for (;i-->0;timer++) if (timer->entry) mj_output_timer_free(device,timer);
+}
+
+static int mj_output_press_alt(struct mj_output *output,struct mj_output_device *device,const struct mj_map_entry *entry,int value) {
+  return mj_output_key(output,device,entry->altcode,value);
+}
+
+/* A timer's frame is written on its own, and no MIDI caused it: It stays out of (frameeventc) and the latency samples.
+ * Anything MIDI had queued goes out with it, but still counts for the commit it belongs to.
+ */
+static void mj_output_timer_cb(struct mj_timer *ttimer) {
+  struct mj_output_timer *timer=(struct mj_output_timer*)ttimer;
+  struct mj_output *output=timer->output;
+  struct mj_output_device *device=timer->device;
+  const struct mj_map_entry *entry=timer->entry;
+  int64_t now=mj_now();
+  int frameeventc=device->frameeventc+device->eventc;
+  switch (timer->state) {
+    case MJ_OUTPUT_TIMER_TURBO_ON: {
+        mj_output_release(output,device,entry);
+        timer->state=MJ_OUTPUT_TIMER_TURBO_OFF;
+        mj_timer_set(device->timers,&timer->timer,now+entry->ms*1000000ll);
+      } break;
+    case MJ_OUTPUT_TIMER_TURBO_OFF: {
+        mj_output_press(output,device,entry);
+        timer->state=MJ_OUTPUT_TIMER_TURBO_ON;
+        mj_timer_set(device->timers,&timer->timer,now+entry->ms*1000000ll);
+      } break;
+    case MJ_OUTPUT_TIMER_LONG_WAIT: {
+        mj_output_press_alt(output,device,entry,1);
+        timer->state=MJ_OUTPUT_TIMER_LONG;
       } break;
+    case MJ_OUTPUT_TIMER_RELEASING: {
+        mj_output_release(output,device,entry);
+        mj_output_timer_free(device,timer);
+      } break;
+  }
+  mj_output_flush(output,device);
+  device->frameeventc=frameeventc;
+}
+
+static int mj_output_timed_press(struct mj_output *output,struct mj_output_device *device,const struct mj_map_entry *entry) {
+  int64_t now=mj_now();
+  struct mj_output_timer *timer=mj_output_timer_find(device,entry);
+  if (timer) {
+    // Note again while a plain min-duration release is pending: It's still pressed, just keep it.
+    if ((timer->state==MJ_OUTPUT_TIMER_RELEASING)&&!(entry->flags&(MJ_MAP_TURBO|MJ_MAP_LONG))) {
+      mj_timer_cancel(&timer->timer);
+      timer->state=MJ_OUTPUT_TIMER_HELD;
+      timer->presstime=now;
+      return 0;
+    }
+    // Anything else, finish the old press and start over.
+    if (timer->state==MJ_OUTPUT_TIMER_LONG) mj_output_press_alt(output,device,entry,0);
+    else if (timer->state!=MJ_OUTPUT_TIMER_LONG_WAIT) mj_output_release(output,device,entry);
+    mj_output_timer_free(device,timer);
+  }
+  if (device->timerc>=MJ_OUTPUT_TIMER_LIMIT) return mj_output_press(output,device,entry);
+  for (timer=device->timerv;timer->entry;timer++) ;
+  timer->timer.cb=mj_output_timer_cb;
+  timer->output=output;
+  timer->device=device;
+  timer->entry=entry;
+  timer->presstime=now;
+  device->timerc++;
+  if (entry->flags&MJ_MAP_LONG) {
+    timer->state=MJ_OUTPUT_TIMER_LONG_WAIT;
+    return mj_timer_set(device->timers,&timer->timer,now+entry->ms*1000000ll);
+  }
+  if (entry->flags&MJ_MAP_TURBO) {
+    timer->state=MJ_OUTPUT_TIMER_TURBO_ON;
+    if (mj_timer_set(device->timers,&timer->timer,now+entry->ms*1000000ll)<0) return -1;
+  } else {
+    timer->state=MJ_OUTPUT_TIMER_HELD;
+  }
+  return mj_output_press(output,device,entry);
+}
+
+static int mj_output_timed_release(struct mj_output *output,struct mj_output_device *device,const struct mj_map_entry *entry) {
+  struct mj_output_timer *timer=mj_output_timer_find(device,entry);
+  if (!timer) return mj_output_release(output,device,entry);
+  int64_t now=mj_now();
+  int64_t minns=(entry->flags&MJ_MAP_MIN)?(entry->minms*1000000ll):0;
+  switch (timer->state) {
+    case MJ_OUTPUT_TIMER_LONG_WAIT: {
+        if (!minns) minns=MJ_OUTPUT_TAP_MS*1000000ll;
+        timer->state=MJ_OUTPUT_TIMER_RELEASING;
+        if (mj_timer_set(device->timers,&timer->timer,now+minns)<0) return -1;
+        return mj_output_press(output,device,entry);
+      }
+    case MJ_OUTPUT_TIMER_LONG: {
+        mj_output_timer_free(device,timer);
+        return mj_output_press_alt(output,device,entry,0);
+      }
+    case MJ_OUTPUT_TIMER_TURBO_ON:
+    case MJ_OUTPUT_TIMER_HELD: {
+        if (now-timer->presstime<minns) {
+          timer->state=MJ_OUTPUT_TIMER_RELEASING;
+          return mj_timer_set(device->timers,&timer->timer,timer->presstime+minns);
+        }
+        mj_output_timer_free(device,timer);
+        return mj_output_release(output,device,entry);
+      }
+    case MJ_OUTPUT_TIMER_TURBO_OFF: {
+        mj_output_timer_free(device,timer);
+        return 0;
+      }
   }
   return 0;
 }
 
-/* Note On.
+/* Switch on or off, with timing if the entry asks for it and we have a wheel.
+ */
+ 
+static int mj_output_switch_on(struct mj_output *output,struct mj_output_device *device,const struct mj_map_entry *entry) {
+  if ((entry->flags&MJ_MAP_TIMED)&&device->timers) return mj_output_timed_press(output,device,entry);
+  return mj_output_press(output,device,entry);
+}
+
+static int mj_output_switch_off(struct mj_output *output,struct mj_output_device *device,const struct mj_map_entry *entry) {
+  if ((entry->flags&MJ_MAP_TIMED)&&device->timers) return mj_output_timed_release(output,device,entry);
+  return mj_output_release(output,device,entry);
+}
+
+/* Control Change.
  */
  
-static int mj_output_note_on(
+static int mj_output_control(
   struct mj_output *output,
   struct mj_output_device *device,
-  uint8_t noteid
+  const struct mj_midi_event *event
 ) {
-  int type,code,value;
-  if (mj_event_from_note(&type,&code,&value,noteid)<0) return 0;
-  switch (type) {
-    case EV_ABS: switch (code) {
-        case ABS_X: {
-            device->x=value;
-            struct input_event event={
-              .type=EV_ABS,
-              .code=ABS_X,
-              .value=value,
-            };
-            if (write(device->fd,&event,sizeof(event))<0) return -1;
-          } break;
-        case ABS_Y: {
-            device->y=value;
-            struct input_event event={
-              .type=EV_ABS,
-              .code=ABS_Y,
-              .value=value,
-            };
-            if (write(device->fd,&event,sizeof(event))<0) return -1;
-          } break;
-      } break;
-    case EV_KEY: {
-        struct input_event event={
-          .type=EV_KEY,
-          .code=code,
-          .value=1,
-        };
-        if (write(device->fd,&event,sizeof(event))<0) return -1;
-      } break;
+  const struct mj_map_entry *entry=&device->profile->ccv[event->chid][event->a];
+  if (entry->flags&MJ_MAP_14BIT) {
+    uint8_t *statev=device->ccstatev[event->chid];
+    int msbp=event->a&0x1f;
+    statev[event->a&0x3f]=event->b;
+    return mj_output_analog(device,entry,(statev[msbp]<<7)|statev[msbp+32],0x3fff);
   }
-  return 0;
+  if (entry->flags&MJ_MAP_ANALOG) return mj_output_analog(device,entry,event->b,0x7f);
+  if (event->b>=0x40) return mj_output_switch_on(output,device,entry);
+  return mj_output_switch_off(output,device,entry);
 }
 
-/* Read, translate, and send one event.
- * TODO Do we need to worry about Running Status?
+/* Translate and queue one event.
+ * First pick the player. Unsplit devices point all their players at themselves, so it costs the same either way.
  */
  
-static int mj_process_event(
+int mj_output_event(
   struct mj_output *output,
   struct mj_output_device *device,
-  const uint8_t *src,int srcc
+  const struct mj_midi_event *event
 ) {
-  int srcp=0;
-  
-  if (srcp>=srcc) return -1;
-  uint8_t lead=src[srcp++];
-  uint8_t opcode=lead&0xf0;
-  uint8_t chid=lead&0x0f;
-  
-  switch (opcode) {
-  
-    case 0x80: { // Note Off
-        if (srcp>srcc-2) return -1;
-        uint8_t noteid=src[srcp];
-        srcp+=2;
-        if (mj_output_note_off(output,device,noteid)<0) return -1;
-      } break;
-      
-    case 0x90: { // Note On
-        if (srcp>srcc-2) return -1;
-        uint8_t noteid=src[srcp];
-        srcp+=2;
-        if (mj_output_note_on(output,device,noteid)<0) return -1;
-      } break;
-      
-    case 0xa0: { // Note Adjust
-        srcp+=2;
-      } break;
-      
-    case 0xb0: { // Control Change
-        //TODO maybe use mod wheel or expression pedal?
-        srcp+=2;
-      } break;
-      
-    case 0xc0: { // Program Change
-        srcp+=1;
-      } break;
-      
-    case 0xd0: { // Channel Pressure
-        srcp+=1;
-      } break;
-      
-    case 0xe0: { // Pitch Wheel
-        //TODO pitch wheel would make a pretty good axis controller
-        srcp+=2;
-      } break;
-      
-    case 0xf0: switch (lead) {
-        case 0xf0: { // Sysex
-            while (srcp<srcc) {
-              if (src[srcp++]==0xf7) break;
-            }
-          } break;
-        default: break; // System and Realtime. Assume single byte, tho that isn't always the case.
-      } break;
+  const struct mj_map_profile *profile=device->profile;
+  MJ_STATS_ADD(device->stats,voicev[MJ_STATS_VOICE_INDEX(event->opcode)],1);
+  if (event->opcode<0xb0) device=device->playerv[profile->noteplayerv[event->chid][event->a&0x7f]];
+  else device=device->playerv[profile->chplayerv[event->chid&0x0f]];
+  switch (event->opcode) {
+    case 0x80: {
+        const struct mj_map_entry *entry=&profile->notev[event->chid][event->a];
+        if (entry->flags&MJ_MAP_ANALOG) return mj_output_analog(device,entry,0,0x7f);
+        return mj_output_switch_off(output,device,entry);
+      }
+    case 0x90: {
+        const struct mj_map_entry *entry=&profile->notev[event->chid][event->a];
+        if (entry->flags&MJ_MAP_ANALOG) return mj_output_analog(device,entry,event->b,0x7f);
+        if (!event->b) return mj_output_switch_off(output,device,entry);
+        return mj_output_switch_on(output,device,entry);
+      }
+    case 0xa0: return mj_output_analog(device,&profile->aftertouchv[event->chid][event->a],event->b,0x7f);
+    case 0xb0: return mj_output_control(output,device,event);
+    case 0xc0: break; // Program Change
+    case 0xd0: return mj_output_analog(device,&profile->pressurev[event->chid],event->a,0x7f);
+    case 0xe0: return mj_output_analog(device,&profile->pitchv[event->chid],(event->b<<7)|event->a,0x3fff);
+  }
+  return 0;
+}
+
+/* Sysex.
+ */
+ 
+int mj_output_sysex(struct mj_output *output,int devid,const struct mj_midi_parser *parser,const struct mj_midi_event *event) {
+  if (!output->sysex) return 0;
+  if (event->opcode==MJ_MIDI_SYSEX_DATA) {
+    return output->sysex(devid,parser->sysexv,parser->sysexc,0,output->sysexuserdata);
   }
-  return srcp;
+  return output->sysex(devid,0,0,event->a?1:-1,output->sysexuserdata);
 }
 
 /* Receive events.
  */
  
-int mj_output_events(struct mj_output *output,int devid,const void *src,int srcc) {
-  struct mj_output_device *device=mj_output_device_by_devid(output,devid);
+int mj_output_events(struct mj_output *output,struct mj_output_device *device,const void *src,int srcc,int64_t rcvtime) {
   if (!device) return 0;
   const uint8_t *SRC=src;
   int srcp=0;
+  uint32_t errorc=device->parser.errorc;
   while (srcp<srcc) {
-    int err=mj_process_event(output,device,SRC+srcp,srcc-srcp);
-    if (err<=0) return -1;
-    srcp+=err;
+    struct mj_midi_event event;
+    srcp+=mj_midi_parse(&event,&device->parser,SRC+srcp,srcc-srcp);
+    if (!event.opcode) continue;
+    if ((event.opcode==MJ_MIDI_SYSEX_DATA)||(event.opcode==MJ_MIDI_SYSEX_END)) {
+      if (event.opcode==MJ_MIDI_SYSEX_END) MJ_STATS_ADD(device->stats,systemv[MJ_STATS_SYSTEM_INDEX(0xf0)],1);
+      if (mj_output_sysex(output,device->devid,&device->parser,&event)<0) return -1;
+      continue;
+    }
+    if (mj_output_event(output,device,&event)<0) return -1;
   }
-  struct input_event event={.type=EV_SYN,.code=SYN_REPORT};
-  if (write(device->fd,&event,sizeof(event))<0) return -1;
+  MJ_STATS_ADD(device->stats,errorc,device->parser.errorc-errorc);
+  mj_stats_add_realtime(device->stats,&device->parser);
+  return mj_output_commit(output,device,rcvtime);
+}
+
+/* Write the frame.
+ * Reads that changed nothing (Realtime, or presses of buttons already down) write nothing, and don't count for latency.
+ */
+ 
+int mj_output_commit(struct mj_output *output,struct mj_output_device *device,int64_t rcvtime) {
+  int i=device->playerc;
+  while (i-->1) {
+    struct mj_output_device *player=device->playerv[i];
+    if (!player->eventc&&!player->absdirty) continue;
+    if (mj_output_flush(output,player)<0) return -1;
+    device->frameeventc+=player->frameeventc;
+    player->frameeventc=0;
+  }
+  if (mj_output_flush(output,device)<0) return -1;
+  if (rcvtime&&device->frameeventc) {
+    // Staged writes haven't happened yet. The ring samples them when they complete.
+    if (output->uring&&output->backend->direct) mj_uring_stamp(output->uring,&device->latency,rcvtime,device->frameeventc);
+    else mj_latency_add(&device->latency,rcvtime,mj_now(),device->frameeventc);
+    MJ_STATS_SET(device->stats,lastevent,rcvtime);
+  }
+  device->frameeventc=0;
   return 0;
 }
+
+/* Dump latency.
+ */
+ 
+void mj_output_dump_latency(const struct mj_output *output,FILE *dst) {
+  int i=0;
+  for (;i<output->devicec;i++) {
+    const struct mj_output_device *device=output->devicev[i];
+    char label[32];
+    snprintf(label,sizeof(label),"MIDI %d",device->devid);
+    mj_latency_dump(&device->latency,dst,label);
+  }
+}
+
+/* Reload map.
+ */
+ 
+static int mj_output_release_player(struct mj_output *output,struct mj_output_device *device) {
+  int i;
+  mj_output_cancel_timers(device);
+  for (i=0;i<KEY_CNT;i++) {
+    if (!(device->keyv[i>>3]&(1<<(i&7)))) continue;
+    if (mj_output_key(output,device,i,0)<0) return -1;
+  }
+  device->absdirty=0;
+  for (i=0;i<ABS_CNT;i++) {
+    if (!device->absv[i]) continue;
+    device->absv[i]=0;
+    if (mj_output_queue(output,device,EV_ABS,i,0)<0) return -1;
+  }
+  return mj_output_flush(output,device);
+}
+
+static int mj_output_release_all(struct mj_output *output,struct mj_output_device *device) {
+  int i=device->playerc;
+  while (i-->0) {
+    if (mj_output_release_player(output,device->playerv[i])<0) return -1;
+  }
+  return 0;
+}
+
+/* Same capabilities, so an open device can take the new profile as is.
+ */
+static int mj_output_profile_compatible(const struct mj_map_profile *a,const struct mj_map_profile *b) {
+  if (a->playerc!=b->playerc) return 0;
+  if (memcmp(a->keybits,b->keybits,sizeof(a->keybits))) return 0;
+  if (memcmp(a->absbits,b->absbits,sizeof(a->absbits))) return 0;
+  if (memcmp(a->absmin,b->absmin,sizeof(a->absmin))) return 0;
+  if (memcmp(a->absmax,b->absmax,sizeof(a->absmax))) return 0;
+  return 1;
+}
+
+/* Close and reopen every player with (profile)'s capabilities, in the same record, so links to it stay good.
+ * Everything must be released already.
+ * On failure, every player that did open is marked (failed): Writes vanish, and it won't linger or be reused.
+ */
+static int mj_output_recreate(struct mj_output *output,struct mj_output_device *device,const struct mj_map_profile *profile) {
+  if (output->uring) mj_uring_drain_writes(output->uring);
+  while (device->playerc>1) {
+    mj_output_device_release(output,device->playerv[--(device->playerc)]);
+    device->playerv[device->playerc]=device;
+  }
+  mj_output_close_fd(output,device);
+  device->fd=-1;
+  device->failed=0;
+  device->netseq=0; // Backend state, as a fresh record would have it.
+  device->nethello=0;
+  device->pad=0;
+  device->profile=profile;
+  const char *path=output->dstpath+strlen(output->backend->prefix);
+  int err=-1;
+  if ((device->fd=output->backend->open(output,path,device->devid,0,profile))>=0) {
+    err=mj_output_open_players(output,device);
+  }
+  mj_output_set_timers(device,device->timers);
+  mj_output_find_stats(output,device);
+  if (err<0) {
+    int i=device->playerc;
+    while (i-->0) device->playerv[i]->failed=1;
+  }
+  return err;
+}
+
+static void mj_output_set_profile(struct mj_output_device *device,const struct mj_map_profile *profile) {
+  int i=device->playerc;
+  while (i-->0) device->playerv[i]->profile=profile;
+}
+
+/* Devices whose capabilities changed get recreated, since uinput only takes them at creation.
+ * Lingering ones too if prewarmed; otherwise they just close, and reconnecting builds them fresh.
+ * Nothing may keep a profile from the old map, which we delete.
+ * A live device that fails to recreate stays listed but (failed), and we return <0 after switching maps anyway.
+ * Failed devices try again at the next reload.
+ */
+ 
+int mj_output_reload_map(struct mj_output *output) {
+  struct mj_map *map=mj_map_load(output->mappath);
+  if (!map) {
+    fprintf(stderr,"%s: Keeping the old map.\n",output->mappath?output->mappath:"(default)");
+    return 0;
+  }
+  int i=output->devicec;
+  while (i-->0) {
+    if (mj_output_release_all(output,output->devicev[i])<0) {
+      mj_map_del(map);
+      return -1;
+    }
+  }
+  int err=0;
+  for (i=output->devicec;i-->0;) {
+    struct mj_output_device *device=output->devicev[i];
+    char name[64];
+    mj_output_device_name(name,sizeof(name),device->devid);
+    const struct mj_map_profile *profile=mj_map_select(map,device->devid,name);
+    if (!mj_output_device_failed(device)&&mj_output_profile_compatible(device->profile,profile)) {
+      mj_output_set_profile(device,profile);
+    } else if (mj_output_recreate(output,device,profile)<0) {
+      fprintf(stderr,"MIDI %d: Failed to recreate device for the new map. Ignoring it until it reconnects or the map reloads.\n",device->devid);
+      err=-1;
+    }
+  }
+  for (i=output->lingerc;i-->0;) {
+    struct mj_output_device *device=output->lingerv[i];
+    char name[64];
+    mj_output_device_name(name,sizeof(name),device->devid);
+    const struct mj_map_profile *profile=mj_map_select(map,device->devid,name);
+    if (mj_output_profile_compatible(device->profile,profile)) {
+      mj_output_set_profile(device,profile);
+    } else if (!device->persistent||(mj_output_recreate(output,device,profile)<0)) {
+      mj_output_device_release(output,mj_output_unlinger(output,i));
+    }
+  }
+  mj_map_del(output->map);
+  output->map=map;
+  return err;
+}
@@ -0,0 +1,156 @@
+#include "midjoy.h"
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+
+_Static_assert(sizeof(struct mj_padpage_header)==64,"Pad page slots must start on a cache line.");
+
+/* Delete.
+ */
+
+void mj_padpage_del(struct mj_padpage *page) {
+  if (!page) return;
+  if (page->map) {
+    __atomic_store_n(&page->header->pid,0,__ATOMIC_RELEASE);
+    munmap(page->map,page->mapsize);
+  }
+  if (page->fd>0) close(page->fd);
+  free(page);
+}
+
+/* New.
+ * Replace rather than truncate in place, same as the stats page: A reader with the old file mapped keeps its pages.
+ */
+
+static struct mj_padpage *mj_padpage_new(const char *path,int slotc) {
+  struct mj_padpage *page=calloc(1,sizeof(struct mj_padpage));
+  if (!page) return 0;
+  unlink(path);
+  if ((page->fd=open(path,O_RDWR|O_CREAT|O_EXCL|O_CLOEXEC,0644))<0) {
+    fprintf(stderr,"%s: Failed to open pad page.\n",path);
+    mj_padpage_del(page);
+    return 0;
+  }
+  page->mapsize=sizeof(struct mj_padpage_header)+sizeof(struct mj_padpage_slot)*slotc;
+  if (ftruncate(page->fd,page->mapsize)<0) {
+    mj_padpage_del(page);
+    return 0;
+  }
+  page->map=mmap(0,page->mapsize,PROT_READ|PROT_WRITE,MAP_SHARED,page->fd,0);
+  if (page->map==MAP_FAILED) {
+    page->map=0;
+    mj_padpage_del(page);
+    return 0;
+  }
+  page->header=page->map;
+  page->slotv=(struct mj_padpage_slot*)((char*)page->map+sizeof(struct mj_padpage_header));
+  page->slotc=slotc;
+  int i=0;
+  for (;i<slotc;i++) page->slotv[i].pad.devid=-1;
+  page->header->slotsize=sizeof(struct mj_padpage_slot);
+  page->header->slotc=slotc;
+  page->header->pid=getpid();
+  page->header->starttime=mj_now();
+  __atomic_thread_fence(__ATOMIC_RELEASE);
+  memcpy(page->header->magic,MJ_PADPAGE_MAGIC,8);
+  return page;
+}
+
+/* Seqlock writer. Odd while we're in there; readers that saw the even value before it will retry.
+ */
+
+static struct mj_padpage_slot *mj_padpage_slot_for_pad(struct mj_pad *pad) {
+  return (struct mj_padpage_slot*)((char*)pad-__builtin_offsetof(struct mj_padpage_slot,pad));
+}
+
+static inline void mj_padpage_begin(struct mj_padpage_slot *slot) {
+  __atomic_store_n(&slot->seq,slot->seq+1,__ATOMIC_RELAXED);
+  __atomic_thread_fence(__ATOMIC_RELEASE);
+}
+
+static inline void mj_padpage_end(struct mj_padpage_slot *slot) {
+  __atomic_store_n(&slot->seq,slot->seq+1,__ATOMIC_RELEASE);
+}
+
+/* Get slot.
+ * Slots fill in order and are never released, so the first free one ends the search.
+ * Only opens claim, and those are serialized, so nobody else writes (devid) or (player) while we look.
+ */
+
+static struct mj_padpage_slot *mj_padpage_get(struct mj_padpage *page,int devid,int player,int create) {
+  if (!page) return 0;
+  struct mj_padpage_slot *slot=page->slotv;
+  int i=page->slotc;
+  for (;i-->0;slot++) {
+    if (slot->pad.devid<0) {
+      if (!create) return 0;
+      mj_padpage_begin(slot);
+      slot->pad.devid=devid;
+      slot->pad.player=player;
+      mj_padpage_end(slot);
+      return slot;
+    }
+    if ((slot->pad.devid==devid)&&(slot->pad.player==player)) return slot;
+  }
+  return 0;
+}
+
+/* Open: Claim a slot, or reclaim the one from last time, and show it connected and idle.
+ */
+
+int mj_padpage_open(struct mj_output *output,const char *path,int devid,int player,const struct mj_map_profile *profile) {
+  if (!output) return -1;
+  if (!output->padpage) {
+    if (!(output->padpage=mj_padpage_new(path,MJ_PADPAGE_DEFAULT_SLOTC))) return -1;
+  }
+  struct mj_padpage_slot *slot=mj_padpage_get(output->padpage,devid,player,1);
+  if (!slot) {
+    fprintf(stderr,"%s: No room for devid %d player %d.\n",path,devid,player+1);
+    return -1;
+  }
+  mj_padpage_begin(slot);
+  memset(slot->pad.keybits,0,sizeof(slot->pad.keybits));
+  memset(slot->pad.absv,0,sizeof(slot->pad.absv));
+  slot->pad.connected=1;
+  slot->pad.framec++;
+  mj_padpage_end(slot);
+  return 0;
+}
+
+/* Write: Nothing to decode. The device record already holds the state these events lead to.
+ * Publish only at SYN_REPORT, so a frame split across writes never shows half done.
+ */
+
+int mj_padpage_write(struct mj_output *output,struct mj_output_device *device,const void *src,int srcc) {
+  if (srcc<sizeof(struct input_event)) return 0;
+  const struct input_event *last=(const struct input_event*)((const char*)src+srcc)-1;
+  if (last->type!=EV_SYN) return 0;
+  if (!device->pad) {
+    struct mj_padpage_slot *slot=mj_padpage_get(output->padpage,device->devid,device->player,0);
+    if (!slot) return -1;
+    device->pad=&slot->pad;
+  }
+  struct mj_padpage_slot *slot=mj_padpage_slot_for_pad(device->pad);
+  mj_padpage_begin(slot);
+  memcpy(slot->pad.keybits,device->keyv,sizeof(slot->pad.keybits));
+  memcpy(slot->pad.absv,device->absv,sizeof(slot->pad.absv));
+  slot->pad.framec++;
+  mj_padpage_end(slot);
+  return 0;
+}
+
+/* Close: Everything lets go, and (connected) drops, in one last frame.
+ */
+
+void mj_padpage_close(struct mj_output *output,struct mj_output_device *device) {
+  struct mj_padpage_slot *slot;
+  if (device->pad) slot=mj_padpage_slot_for_pad(device->pad);
+  else if (!(slot=mj_padpage_get(output->padpage,device->devid,device->player,0))) return;
+  device->pad=0;
+  mj_padpage_begin(slot);
+  memset(slot->pad.keybits,0,sizeof(slot->pad.keybits));
+  memset(slot->pad.absv,0,sizeof(slot->pad.absv));
+  slot->pad.connected=0;
+  slot->pad.framec++;
+  mj_padpage_end(slot);
+}
@@ -0,0 +1,465 @@
+#define _GNU_SOURCE
+#include "midjoy.h"
+#include <unistd.h>
+#include <errno.h>
+#include <sched.h>
+#include <poll.h>
+#include <sys/eventfd.h>
+
+#define MJ_PIPELINE_DEFAULT_RINGSIZE 4096
+#define MJ_PIPELINE_WORKER_DEVICE_LIMIT 64
+
+#define MJ_PIPE_MIDI       1
+#define MJ_PIPE_COMMIT     2 /* End of one read; write the frame. */
+#define MJ_PIPE_CONNECT    3
+#define MJ_PIPE_DISCONNECT 4
+
+struct mj_pipe_msg {
+  uint8_t kind;
+  struct mj_midi_event event;
+  int64_t rcvtime;
+};
+
+/* One per MIDI device, the input device's (link).
+ * The first few fields are set before the worker sees it, and only read after. Then one block per writer, each on its own lines.
+ * The worker frees it after DISCONNECT, or returns it to the pool if (pipeline->devicea).
+ */
+struct mj_pipe_device {
+  int devid;
+  struct mj_pipeline_worker *worker;
+  struct mj_pipe_msg *ringv;
+  uint32_t mask;
+  // Main thread.
+  uint32_t head __attribute__((aligned(64))); // Next write.
+  uint64_t dropc;
+  struct mj_midi_parser parser;
+  // Worker.
+  uint32_t tail __attribute__((aligned(64))); // Next read.
+  struct mj_output_device *output;
+  int failed;
+};
+
+struct mj_pipeline_worker {
+  struct mj_pipeline *pipeline;
+  pthread_t thread;
+  int running;
+  pthread_mutex_t lock; // Held while draining. Control operations take all of them.
+  int wakefd; // eventfd
+  int sleeping; // Set by worker before blocking; producers write (wakefd) only then.
+  struct mj_pipe_device *devicev[MJ_PIPELINE_WORKER_DEVICE_LIMIT]; // Slots written by main, cleared by worker.
+  int devicec; // Main thread's count, for load balancing.
+  struct mj_timer_wheel timers; // For this worker's output devices. Only touched under (lock).
+};
+
+/* Ring.
+ */
+
+/* Data messages leave the last slot free, so control always has room and never waits on the worker.
+ * That's enough: CONNECT goes into an empty ring, and DISCONNECT is the last thing we ever push.
+ */
+
+static inline int mj_pipe_push_limit(struct mj_pipe_device *device,const struct mj_pipe_msg *msg,uint32_t limit) {
+  uint32_t head=device->head;
+  uint32_t tail=__atomic_load_n(&device->tail,__ATOMIC_ACQUIRE);
+  if (head-tail>=limit) return -1;
+  device->ringv[head&device->mask]=*msg;
+  __atomic_store_n(&device->head,head+1,__ATOMIC_RELEASE);
+  return 0;
+}
+
+static int mj_pipe_push(struct mj_pipe_device *device,const struct mj_pipe_msg *msg) {
+  return mj_pipe_push_limit(device,msg,device->mask);
+}
+
+static void mj_pipe_push_control(struct mj_pipe_device *device,const struct mj_pipe_msg *msg) {
+  mj_pipe_push_limit(device,msg,device->mask+1);
+}
+
+static void mj_pipe_wake(struct mj_pipeline_worker *worker) {
+  __atomic_thread_fence(__ATOMIC_SEQ_CST);
+  if (__atomic_load_n(&worker->sleeping,__ATOMIC_SEQ_CST)) {
+    uint64_t one=1;
+    write(worker->wakefd,&one,sizeof(one));
+  }
+}
+
+/* Worker: handle one message.
+ */
+
+static void mj_pipe_handle(struct mj_pipeline *pipeline,struct mj_pipe_device *device,const struct mj_pipe_msg *msg) {
+  struct mj_output *output=pipeline->output;
+  switch (msg->kind) {
+    case MJ_PIPE_MIDI: {
+        if (!device->output||device->failed) return;
+        MJ_HOTPATH_BEGIN
+        if (mj_output_event(output,device->output,&msg->event)<0) device->failed=1;
+        MJ_HOTPATH_END
+      } break;
+    case MJ_PIPE_COMMIT: {
+        if (!device->output||device->failed) return;
+        MJ_HOTPATH_BEGIN
+        int err=mj_output_commit(output,device->output,msg->rcvtime);
+        MJ_HOTPATH_END
+        if (err<0) {
+          fprintf(stderr,"MIDI %d: Output failed. Ignoring this device until it reconnects.\n",device->devid);
+          device->failed=1;
+        }
+      } break;
+    case MJ_PIPE_CONNECT: {
+        pthread_mutex_lock(&pipeline->listlock);
+        device->output=mj_output_connect_device(output,device->devid);
+        pthread_mutex_unlock(&pipeline->listlock);
+        if (device->output) mj_output_set_timers(device->output,&device->worker->timers);
+        else fprintf(stderr,"MIDI %d: Failed to connect output.\n",device->devid);
+      } break;
+    case MJ_PIPE_DISCONNECT: {
+        pthread_mutex_lock(&pipeline->listlock);
+        mj_output_disconnect_device(output,device->output);
+        pthread_mutex_unlock(&pipeline->listlock);
+        device->output=0;
+      } break;
+  }
+}
+
+/* Worker: drain one device.
+ * Returns count of messages handled, or <0 if the device is finished.
+ */
+
+static int mj_pipe_drain(struct mj_pipeline *pipeline,struct mj_pipe_device *device) {
+  uint32_t tail=device->tail;
+  uint32_t head=__atomic_load_n(&device->head,__ATOMIC_ACQUIRE);
+  int c=0;
+  while (tail!=head) {
+    const struct mj_pipe_msg *msg=device->ringv+(tail&device->mask);
+    mj_pipe_handle(pipeline,device,msg);
+    tail++;
+    c++;
+    if (msg->kind==MJ_PIPE_DISCONNECT) {
+      __atomic_store_n(&device->tail,tail,__ATOMIC_RELEASE);
+      return -1;
+    }
+  }
+  __atomic_store_n(&device->tail,tail,__ATOMIC_RELEASE);
+  return c;
+}
+
+static void mj_pipe_device_del(struct mj_pipe_device *device) {
+  if (!device) return;
+  if (device->ringv) free(device->ringv);
+  free(device);
+}
+
+/* Aligned for (head) and (tail), which calloc wouldn't promise.
+ */
+static struct mj_pipe_device *mj_pipe_device_new(struct mj_pipeline *pipeline) {
+  struct mj_pipe_device *device=0;
+  if (posix_memalign((void**)&device,64,sizeof(struct mj_pipe_device))) return 0;
+  memset(device,0,sizeof(struct mj_pipe_device));
+  if (!(device->ringv=malloc(sizeof(struct mj_pipe_msg)*pipeline->ringsize))) {
+    free(device);
+    return 0;
+  }
+  device->mask=pipeline->ringsize-1;
+  return device;
+}
+
+/* Main thread: Take a record from the pool, or make one if we're not pooling.
+ */
+static struct mj_pipe_device *mj_pipe_device_get(struct mj_pipeline *pipeline) {
+  if (!pipeline->devicea) return mj_pipe_device_new(pipeline);
+  struct mj_pipe_device *device=0;
+  pthread_mutex_lock(&pipeline->listlock);
+  if (pipeline->sparec) device=pipeline->sparev[--(pipeline->sparec)];
+  pthread_mutex_unlock(&pipeline->listlock);
+  return device;
+}
+
+/* Worker: Done with a record after DISCONNECT. Its ring is empty, so it comes back as good as new.
+ */
+static void mj_pipe_device_release(struct mj_pipeline *pipeline,struct mj_pipe_device *device) {
+  if (!pipeline->devicea) {
+    mj_pipe_device_del(device);
+    return;
+  }
+  struct mj_pipe_msg *ringv=device->ringv;
+  memset(device,0,sizeof(struct mj_pipe_device));
+  device->ringv=ringv;
+  device->mask=pipeline->ringsize-1;
+  pthread_mutex_lock(&pipeline->listlock);
+  pipeline->sparev[pipeline->sparec++]=device;
+  pthread_mutex_unlock(&pipeline->listlock);
+}
+
+/* Worker: one pass over all devices.
+ */
+
+static int mj_pipeline_worker_pass(struct mj_pipeline_worker *worker) {
+  int total=0,i=0;
+  pthread_mutex_lock(&worker->lock);
+  for (;i<MJ_PIPELINE_WORKER_DEVICE_LIMIT;i++) {
+    struct mj_pipe_device *device=__atomic_load_n(worker->devicev+i,__ATOMIC_ACQUIRE);
+    if (!device) continue;
+    int c=mj_pipe_drain(worker->pipeline,device);
+    if (c<0) {
+      __atomic_store_n(worker->devicev+i,0,__ATOMIC_RELEASE);
+      mj_pipe_device_release(worker->pipeline,device);
+      total++;
+    } else {
+      total+=c;
+    }
+  }
+  pthread_mutex_unlock(&worker->lock);
+  return total;
+}
+
+static int mj_pipeline_worker_pending(const struct mj_pipeline_worker *worker) {
+  int i=0;
+  for (;i<MJ_PIPELINE_WORKER_DEVICE_LIMIT;i++) {
+    struct mj_pipe_device *device=__atomic_load_n(worker->devicev+i,__ATOMIC_ACQUIRE);
+    if (!device) continue;
+    if (__atomic_load_n(&device->head,__ATOMIC_ACQUIRE)!=device->tail) return 1;
+  }
+  return 0;
+}
+
+/* Worker thread.
+ */
+
+static void *mj_pipeline_worker_main(void *arg) {
+  struct mj_pipeline_worker *worker=arg;
+  struct mj_pipeline *pipeline=worker->pipeline;
+  while (1) {
+    if (mj_pipeline_worker_pass(worker)) continue;
+    __atomic_store_n(&worker->sleeping,1,__ATOMIC_SEQ_CST);
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+    if (mj_pipeline_worker_pending(worker)) {
+      __atomic_store_n(&worker->sleeping,0,__ATOMIC_SEQ_CST);
+      continue;
+    }
+    if (__atomic_load_n(&pipeline->stop,__ATOMIC_SEQ_CST)) break;
+    struct pollfd pollfdv[2]={
+      {.fd=worker->wakefd,.events=POLLIN},
+      {.fd=worker->timers.fd,.events=POLLIN},
+    };
+    if (poll(pollfdv,2,-1)>0) {
+      if (pollfdv[0].revents) {
+        uint64_t v;
+        read(worker->wakefd,&v,sizeof(v));
+      }
+      if (pollfdv[1].revents) {
+        pthread_mutex_lock(&worker->lock);
+        mj_timer_wheel_update(&worker->timers);
+        pthread_mutex_unlock(&worker->lock);
+      }
+    }
+    __atomic_store_n(&worker->sleeping,0,__ATOMIC_SEQ_CST);
+  }
+  return 0;
+}
+
+/* Start.
+ */
+
+int mj_pipeline_start(struct mj_pipeline *pipeline) {
+  if (!pipeline->output||(pipeline->workerc<1)) return -1;
+  if (pipeline->ringsize<1) pipeline->ringsize=MJ_PIPELINE_DEFAULT_RINGSIZE;
+  int ringsize=2; // One slot is for control only.
+  while (ringsize<pipeline->ringsize) {
+    if (ringsize>=0x01000000) return -1;
+    ringsize<<=1;
+  }
+  pipeline->ringsize=ringsize;
+  if (pthread_mutex_init(&pipeline->listlock,0)) return -1;
+  if (!(pipeline->workerv=calloc(pipeline->workerc,sizeof(void*)))) return -1;
+  if (pipeline->devicea>0) {
+    if (!(pipeline->sparev=malloc(sizeof(void*)*pipeline->devicea))) return -1;
+    while (pipeline->sparec<pipeline->devicea) {
+      struct mj_pipe_device *device=mj_pipe_device_new(pipeline);
+      if (!device) return -1;
+      pipeline->sparev[pipeline->sparec++]=device;
+    }
+  }
+  int i=0;
+  for (;i<pipeline->workerc;i++) {
+    struct mj_pipeline_worker *worker=calloc(1,sizeof(struct mj_pipeline_worker));
+    if (!worker) return -1;
+    pipeline->workerv[i]=worker;
+    worker->pipeline=pipeline;
+    if ((worker->wakefd=eventfd(0,EFD_CLOEXEC))<0) return -1;
+    if (mj_timer_wheel_init(&worker->timers)<0) return -1;
+    if (pthread_mutex_init(&worker->lock,0)) return -1;
+    if (pthread_create(&worker->thread,0,mj_pipeline_worker_main,worker)) return -1;
+    worker->running=1;
+    if (pipeline->cpuc>0) {
+      cpu_set_t set;
+      CPU_ZERO(&set);
+      CPU_SET(pipeline->cpuv[i%pipeline->cpuc],&set);
+      if (pthread_setaffinity_np(worker->thread,sizeof(set),&set)) {
+        fprintf(stderr,"Failed to pin pipeline worker %d to CPU %d.\n",i,pipeline->cpuv[i%pipeline->cpuc]);
+        return -1;
+      }
+    }
+  }
+  return 0;
+}
+
+/* Stop.
+ */
+
+void mj_pipeline_stop(struct mj_pipeline *pipeline) {
+  if (!pipeline->workerv) return;
+  __atomic_store_n(&pipeline->stop,1,__ATOMIC_SEQ_CST);
+  int i=pipeline->workerc;
+  while (i-->0) {
+    struct mj_pipeline_worker *worker=pipeline->workerv[i];
+    if (!worker) continue;
+    if (worker->running) {
+      uint64_t one=1;
+      write(worker->wakefd,&one,sizeof(one));
+      pthread_join(worker->thread,0);
+    }
+    int j=MJ_PIPELINE_WORKER_DEVICE_LIMIT;
+    while (j-->0) mj_pipe_device_del(worker->devicev[j]);
+    if (worker->wakefd>0) close(worker->wakefd);
+    mj_timer_wheel_cleanup(&worker->timers);
+    pthread_mutex_destroy(&worker->lock);
+    free(worker);
+  }
+  free(pipeline->workerv);
+  pipeline->workerv=0;
+  if (pipeline->sparev) {
+    while (pipeline->sparec-->0) mj_pipe_device_del(pipeline->sparev[pipeline->sparec]);
+    free(pipeline->sparev);
+    pipeline->sparev=0;
+  }
+  pthread_mutex_destroy(&pipeline->listlock);
+}
+
+/* New device. Assign to the least busy worker.
+ */
+
+static struct mj_pipe_device *mj_pipeline_add_device(struct mj_pipeline *pipeline,int devid) {
+  struct mj_pipeline_worker *worker=0;
+  int i=pipeline->workerc;
+  while (i-->0) {
+    struct mj_pipeline_worker *q=pipeline->workerv[i];
+    if (!worker||(q->devicec<worker->devicec)) worker=q;
+  }
+  int slotp=-1;
+  for (i=0;i<MJ_PIPELINE_WORKER_DEVICE_LIMIT;i++) {
+    if (!__atomic_load_n(worker->devicev+i,__ATOMIC_ACQUIRE)) { slotp=i; break; }
+  }
+  if (slotp<0) return 0;
+  struct mj_pipe_device *device=mj_pipe_device_get(pipeline);
+  if (!device) return 0;
+  device->devid=devid;
+  device->worker=worker;
+  __atomic_store_n(worker->devicev+slotp,device,__ATOMIC_RELEASE);
+  worker->devicec++;
+  return device;
+}
+
+/* Receive from mj_input. Main thread.
+ */
+
+int mj_pipeline_rcvin(struct mj_input_device *indev,const void *src,int srcc,void *userdata) {
+  struct mj_pipeline *pipeline=userdata;
+  struct mj_pipe_device *device=indev->link;
+  struct mj_pipe_msg msg={0};
+
+  if (!srcc) {
+    if (!device) return 0;
+    // The worker may release (device) as soon as it sees DISCONNECT. Don't touch it after the push.
+    struct mj_pipeline_worker *worker=device->worker;
+    indev->link=0;
+    msg.kind=MJ_PIPE_DISCONNECT;
+    mj_pipe_push_control(device,&msg);
+    worker->devicec--;
+    mj_pipe_wake(worker);
+    return 0;
+  }
+
+  if ((srcc==2)&&!memcmp(src,"\xf0\xf7",2)) {
+    if (!(device=mj_pipeline_add_device(pipeline,indev->devid))) {
+      fprintf(stderr,"MIDI %d: Pipeline full, ignoring device.\n",indev->devid);
+      return 0;
+    }
+    indev->link=device;
+    msg.kind=MJ_PIPE_CONNECT;
+    mj_pipe_push_control(device,&msg);
+    mj_pipe_wake(device->worker);
+    return 0;
+  }
+
+  if (!device) return 0;
+  const uint8_t *SRC=src;
+  int srcp=0,pushc=0;
+  uint32_t errorc=device->parser.errorc;
+  msg.kind=MJ_PIPE_MIDI;
+  while (srcp<srcc) {
+    srcp+=mj_midi_parse(&msg.event,&device->parser,SRC+srcp,srcc-srcp);
+    if (!msg.event.opcode) continue;
+    if ((msg.event.opcode==MJ_MIDI_SYSEX_DATA)||(msg.event.opcode==MJ_MIDI_SYSEX_END)) {
+      // Sysex counts here, on the main thread. It's the only opcode the worker never sees.
+      if (msg.event.opcode==MJ_MIDI_SYSEX_END) MJ_STATS_ADD(indev->stats,systemv[MJ_STATS_SYSTEM_INDEX(0xf0)],1);
+      mj_output_sysex(pipeline->output,device->devid,&device->parser,&msg.event);
+      continue;
+    }
+    if (mj_pipe_push(device,&msg)<0) {
+      if (!device->dropc++) fprintf(stderr,"MIDI %d: Output is falling behind, dropping events.\n",device->devid);
+    } else {
+      pushc++;
+    }
+  }
+  MJ_STATS_ADD(indev->stats,errorc,device->parser.errorc-errorc);
+  mj_stats_add_realtime(indev->stats,&device->parser);
+  if (!pushc) return 0; // Nothing for the worker, eg only Realtime. Don't wake it.
+  msg.kind=MJ_PIPE_COMMIT;
+  msg.rcvtime=indev->rcvtime;
+  if (mj_pipe_push(device,&msg)<0) {
+    // The events went in, so they'll be written with the next frame.
+    if (!device->dropc++) fprintf(stderr,"MIDI %d: Output is falling behind, dropping events.\n",device->devid);
+  }
+  mj_pipe_wake(device->worker);
+  return 0;
+}
+
+/* Control operations, with all workers paused.
+ */
+
+void mj_pipeline_pause(struct mj_pipeline *pipeline) {
+  if (!pipeline->workerv) return;
+  int i=0;
+  for (;i<pipeline->workerc;i++) pthread_mutex_lock(&pipeline->workerv[i]->lock);
+}
+
+void mj_pipeline_resume(struct mj_pipeline *pipeline) {
+  if (!pipeline->workerv) return;
+  int i=pipeline->workerc;
+  while (i-->0) pthread_mutex_unlock(&pipeline->workerv[i]->lock);
+}
+
+int mj_pipeline_reload_map(struct mj_pipeline *pipeline) {
+  mj_pipeline_pause(pipeline);
+  int err=mj_output_reload_map(pipeline->output);
+  mj_pipeline_resume(pipeline);
+  return err;
+}
+
+void mj_pipeline_dump_latency(struct mj_pipeline *pipeline,FILE *dst) {
+  mj_pipeline_pause(pipeline);
+  mj_output_dump_latency(pipeline->output,dst);
+  mj_pipeline_resume(pipeline);
+}
+
+/* Expire lingering devices.
+ * Workers only touch the linger list while connecting or disconnecting, under (listlock).
+ */
+
+int mj_pipeline_expire(struct mj_pipeline *pipeline) {
+  if (!pipeline->workerv) return mj_output_expire(pipeline->output,mj_now());
+  pthread_mutex_lock(&pipeline->listlock);
+  int err=mj_output_expire(pipeline->output,mj_now());
+  pthread_mutex_unlock(&pipeline->listlock);
+  return err;
+}
@@ -0,0 +1,309 @@
+#include "midjoy.h"
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/timerfd.h>
+
+/* File format.
+ * Header, then a ring of records. Positions (head,tail) are virtual: They only increase, and the physical offset is modulo (datasize).
+ * Each record is 8-byte aligned: u32 length of payload, s32 devid, s64 time, payload.
+ * A record that wouldn't fit before the end of the ring is preceded by a wrap marker, length 0xffffffff.
+ * Length zero is a farewell. Hellos are the 2-byte "\xf0\xf7" they are at the callback.
+ */
+ 
+#define MJ_RECORD_MAGIC "MIDJOYR\1"
+#define MJ_RECORD_WRAP 0xffffffffu
+#define MJ_RECORD_DEFAULT_SIZE (16<<20)
+#define MJ_REPLAY_FAST_BATCH 256
+
+struct mj_record_header {
+  char magic[8];
+  uint32_t datasize;
+  uint32_t reserved;
+  uint64_t head; // Next write. Stored with release, after the record is complete.
+  uint64_t tail; // Oldest record.
+  uint64_t recordc; // Total ever written, including those overwritten.
+  uint64_t dropc; // Too big for the ring, never written.
+};
+
+struct mj_record_entry {
+  uint32_t len;
+  int32_t devid;
+  int64_t time;
+};
+
+static inline uint32_t mj_record_align(uint32_t n) {
+  return (n+7)&~7u;
+}
+
+/* Record: Cleanup.
+ */
+ 
+void mj_record_cleanup(struct mj_record *record) {
+  if (record->map) {
+    msync(record->map,record->mapsize,MS_ASYNC);
+    munmap(record->map,record->mapsize);
+  }
+  if (record->fd>0) close(record->fd);
+  memset(record,0,sizeof(struct mj_record));
+}
+
+/* Record: Open.
+ */
+ 
+int mj_record_open(struct mj_record *record,const char *path,int size) {
+  if (record->map) return -1;
+  if (size<=0) size=MJ_RECORD_DEFAULT_SIZE;
+  size=mj_record_align(size);
+  if (size<1024) size=1024;
+  if ((record->fd=open(path,O_RDWR|O_CREAT|O_TRUNC|O_CLOEXEC,0666))<0) {
+    fprintf(stderr,"%s: Failed to open recording.\n",path);
+    return -1;
+  }
+  record->mapsize=sizeof(struct mj_record_header)+size;
+  if (ftruncate(record->fd,record->mapsize)<0) return -1;
+  record->map=mmap(0,record->mapsize,PROT_READ|PROT_WRITE,MAP_SHARED,record->fd,0);
+  if (record->map==MAP_FAILED) {
+    record->map=0;
+    return -1;
+  }
+  record->header=record->map;
+  record->data=(uint8_t*)record->map+sizeof(struct mj_record_header);
+  memcpy(record->header->magic,MJ_RECORD_MAGIC,8);
+  record->header->datasize=size;
+  return 0;
+}
+
+/* Record: Drop oldest records until (head+need) fits.
+ */
+ 
+static void mj_record_make_room(struct mj_record *record,uint64_t head,uint32_t need) {
+  struct mj_record_header *header=record->header;
+  while (head+need-header->tail>header->datasize) {
+    uint32_t tailp=header->tail%header->datasize;
+    const struct mj_record_entry *entry=(struct mj_record_entry*)(record->data+tailp);
+    if (entry->len==MJ_RECORD_WRAP) header->tail+=header->datasize-tailp;
+    else header->tail+=sizeof(struct mj_record_entry)+mj_record_align(entry->len);
+  }
+}
+
+/* Record: Add one.
+ */
+ 
+static void mj_record_add(struct mj_record *record,int devid,int64_t time,const void *src,int srcc) {
+  struct mj_record_header *header=record->header;
+  uint32_t need=sizeof(struct mj_record_entry)+mj_record_align(srcc);
+  header->recordc++;
+  if (need>header->datasize/2) {
+    header->dropc++;
+    return;
+  }
+  uint64_t head=header->head;
+  uint32_t headp=head%header->datasize;
+  if (headp+need>header->datasize) {
+    uint32_t pad=header->datasize-headp;
+    mj_record_make_room(record,head,pad);
+    ((struct mj_record_entry*)(record->data+headp))->len=MJ_RECORD_WRAP;
+    head+=pad;
+    headp=0;
+  }
+  mj_record_make_room(record,head,need);
+  struct mj_record_entry *entry=(struct mj_record_entry*)(record->data+headp);
+  entry->len=srcc;
+  entry->devid=devid;
+  entry->time=time;
+  memcpy(entry+1,src,srcc);
+  __atomic_store_n(&header->head,head+need,__ATOMIC_RELEASE);
+}
+
+/* Record: Input callback.
+ */
+ 
+int mj_record_rcvin(struct mj_input_device *device,const void *src,int srcc,void *userdata) {
+  struct mj_record *record=userdata;
+  // (rcvtime) is only fresh for data; hellos and farewells don't come from a read.
+  int64_t time=((srcc==2)&&!memcmp(src,"\xf0\xf7",2))||!srcc?mj_now():device->rcvtime;
+  mj_record_add(record,device->devid,time,src,srcc);
+  return record->cb(device,src,srcc,record->userdata);
+}
+
+/* Replay: Cleanup.
+ */
+ 
+void mj_replay_cleanup(struct mj_replay *replay) {
+  if (replay->timerfd>0) {
+    if (replay->input) mj_input_unwatch_fd(replay->input,replay->timerfd);
+    close(replay->timerfd);
+  }
+  if (replay->map) munmap(replay->map,replay->mapsize);
+  if (replay->fd>0) close(replay->fd);
+  memset(replay,0,sizeof(struct mj_replay));
+}
+
+/* Replay: Arm timer, absolute on mj_now()'s clock. Zero for immediately.
+ */
+ 
+static int mj_replay_arm(struct mj_replay *replay,int64_t when) {
+  struct itimerspec spec={0};
+  int flags=0;
+  if (when) {
+    spec.it_value.tv_sec=when/1000000000ll;
+    spec.it_value.tv_nsec=when%1000000000ll;
+    flags=TFD_TIMER_ABSTIME;
+  } else {
+    spec.it_value.tv_nsec=1;
+  }
+  return timerfd_settime(replay->timerfd,flags,&spec,0);
+}
+
+/* Replay: Find or create a device.
+ */
+ 
+static struct mj_input_device *mj_replay_device(struct mj_replay *replay,int devid,int create) {
+  struct mj_input_device *device=replay->devicev,*space=0;
+  int i=replay->devicec;
+  for (;i-->0;device++) {
+    if (device->devid==devid) return device;
+    if (!space&&(device->devid<0)) space=device;
+  }
+  if (!create) return 0;
+  if (!space) {
+    if (replay->devicec>=MJ_REPLAY_DEVICE_LIMIT) return 0;
+    space=replay->devicev+replay->devicec++;
+  }
+  memset(space,0,sizeof(struct mj_input_device));
+  space->watch.fd=-1;
+  space->devid=devid;
+  return space;
+}
+
+/* Replay: Deliver one record.
+ */
+ 
+static int mj_replay_deliver(struct mj_replay *replay,const struct mj_record_entry *entry) {
+  struct mj_input *input=replay->input;
+  const void *src=entry+1;
+  int hello=(entry->len==2)&&!memcmp(src,"\xf0\xf7",2);
+  struct mj_input_device *device=mj_replay_device(replay,entry->devid,0);
+  if (!device) {
+    if (!entry->len) return 0;
+    if (!(device=mj_replay_device(replay,entry->devid,1))) return 0;
+    // The ring overwrote its hello. Connect it now.
+    if (!hello&&(input->cb(device,"\xf0\xf7",2,input->userdata)<0)) return -1;
+  }
+  device->rcvtime=mj_now();
+  replay->recordc++;
+  replay->bytec+=entry->len;
+  int err=input->cb(device,src,entry->len,input->userdata);
+  if (!entry->len) device->devid=-1;
+  return err;
+}
+
+/* Replay: Finish. Farewell to anyone still connected.
+ */
+ 
+static int mj_replay_finish(struct mj_replay *replay) {
+  struct mj_input *input=replay->input;
+  struct mj_input_device *device=replay->devicev;
+  int i=replay->devicec;
+  for (;i-->0;device++) {
+    if (device->devid<0) continue;
+    input->cb(device,0,0,input->userdata);
+    device->devid=-1;
+  }
+  replay->done=1;
+  return 0;
+}
+
+/* Replay: Timer fired.
+ */
+ 
+static int mj_replay_update(struct mj_input *input,struct mj_input_watch *watch) {
+  struct mj_replay *replay=watch->userdata;
+  uint64_t expirations;
+  read(replay->timerfd,&expirations,sizeof(expirations));
+  uint32_t datasize=replay->header->datasize;
+  int batchc=0;
+  while (replay->p<replay->end) {
+    uint32_t pp=replay->p%datasize;
+    const struct mj_record_entry *entry=(struct mj_record_entry*)(replay->data+pp);
+    if (entry->len==MJ_RECORD_WRAP) {
+      replay->p+=datasize-pp;
+      continue;
+    }
+    if (pp+sizeof(struct mj_record_entry)+entry->len>datasize) {
+      fprintf(stderr,"Recording is corrupt after %llu records.\n",(unsigned long long)replay->recordc);
+      break;
+    }
+    if (replay->fast) {
+      if (batchc++>=MJ_REPLAY_FAST_BATCH) return mj_replay_arm(replay,0);
+    } else {
+      int64_t due=replay->starttime+entry->time-replay->basetime;
+      int64_t now=mj_now();
+      if (due>now) return mj_replay_arm(replay,due);
+      mj_latency_add(&replay->lateness,due,now,1);
+    }
+    replay->p+=sizeof(struct mj_record_entry)+mj_record_align(entry->len);
+    if (mj_replay_deliver(replay,entry)<0) return -1;
+  }
+  if (!replay->done) return mj_replay_finish(replay);
+  return 0;
+}
+
+/* Replay: Start.
+ */
+ 
+int mj_replay_start(struct mj_replay *replay,struct mj_input *input,const char *path,int fast) {
+  if (replay->map) return -1;
+  replay->input=input;
+  replay->fast=fast;
+  if ((replay->fd=open(path,O_RDONLY|O_CLOEXEC))<0) {
+    fprintf(stderr,"%s: Failed to open recording.\n",path);
+    return -1;
+  }
+  struct stat st;
+  if (fstat(replay->fd,&st)<0) return -1;
+  if (st.st_size<sizeof(struct mj_record_header)) return -1;
+  replay->mapsize=st.st_size;
+  replay->map=mmap(0,replay->mapsize,PROT_READ,MAP_SHARED,replay->fd,0);
+  if (replay->map==MAP_FAILED) {
+    replay->map=0;
+    return -1;
+  }
+  replay->header=replay->map;
+  replay->data=(const uint8_t*)replay->map+sizeof(struct mj_record_header);
+  if (
+    memcmp(replay->header->magic,MJ_RECORD_MAGIC,8)||
+    (replay->header->datasize>replay->mapsize-sizeof(struct mj_record_header))||
+    (replay->header->datasize&7)
+  ) {
+    fprintf(stderr,"%s: Not a midjoy recording.\n",path);
+    return -1;
+  }
+  // Snapshot the bounds now. A recorder could still be writing, and we'd rather not chase it.
+  replay->end=__atomic_load_n(&replay->header->head,__ATOMIC_ACQUIRE);
+  replay->p=replay->header->tail;
+  if (replay->p<replay->end) {
+    uint32_t pp=replay->p%replay->header->datasize;
+    const struct mj_record_entry *entry=(struct mj_record_entry*)(replay->data+pp);
+    if (entry->len==MJ_RECORD_WRAP) entry=(struct mj_record_entry*)replay->data;
+    replay->basetime=entry->time;
+  }
+  replay->starttime=mj_now();
+  
+  if ((replay->timerfd=timerfd_create(CLOCK_MONOTONIC,TFD_NONBLOCK|TFD_CLOEXEC))<0) return -1;
+  if (mj_input_watch_fd(input,replay->timerfd,mj_replay_update,replay)<0) return -1;
+  return mj_replay_arm(replay,0);
+}
+
+/* Replay: Report.
+ */
+ 
+void mj_replay_report(const struct mj_replay *replay,FILE *dst) {
+  double sec=(mj_now()-replay->starttime)/1e9;
+  fprintf(dst,"replay: %llu records, %llu bytes in %.3f s\n",
+    (unsigned long long)replay->recordc,(unsigned long long)replay->bytec,sec
+  );
+  if (!replay->fast) mj_latency_dump(&replay->lateness,dst,"replay lateness");
+}
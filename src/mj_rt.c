@@ -0,0 +1,59 @@
+#define _GNU_SOURCE
+#include "midjoy.h"
+#include <sched.h>
+#include <unistd.h>
+#include <sys/mman.h>
+
+/* Allocation guard state, debug builds only. The interposers that check it are in mj_rt_alloc.c, outside the library.
+ */
+ 
+#if MJ_DEBUG
+_Thread_local int mj_rt_hotpath=0;
+int mj_rt_enforce=0;
+#endif
+
+/* Touch the stack, so page faults happen now instead of on some deep call later.
+ */
+ 
+static void mj_rt_prefault_stack(int c) {
+  uint8_t *v=alloca(c);
+  volatile uint8_t *vv=v;
+  int i=0;
+  for (;i<c;i+=4096) vv[i]=0;
+}
+
+/* Apply.
+ */
+ 
+int mj_rt_apply(const struct mj_rt *rt) {
+
+  if (rt->priority>0) {
+    struct sched_param param={.sched_priority=rt->priority};
+    if (sched_setscheduler(0,SCHED_FIFO,&param)<0) {
+      fprintf(stderr,"Failed to set SCHED_FIFO priority %d. Need CAP_SYS_NICE or an rtprio limit.\n",rt->priority);
+      return -1;
+    }
+  }
+  
+  if (rt->cpu>=0) {
+    cpu_set_t set;
+    CPU_ZERO(&set);
+    CPU_SET(rt->cpu,&set);
+    if (sched_setaffinity(0,sizeof(set),&set)<0) {
+      fprintf(stderr,"Failed to pin to CPU %d.\n",rt->cpu);
+      return -1;
+    }
+  }
+  
+  if (mlockall(MCL_CURRENT|MCL_FUTURE)<0) {
+    fprintf(stderr,"mlockall failed. Need CAP_IPC_LOCK or a memlock limit.\n");
+    return -1;
+  }
+  
+  if (rt->stacksize>0) mj_rt_prefault_stack(rt->stacksize);
+  
+  #if MJ_DEBUG
+    mj_rt_enforce=1;
+  #endif
+  return 0;
+}
@@ -0,0 +1,38 @@
+/* mj_rt_alloc.c
+ * Allocation guard for the daemon, debug builds only. Not part of libmidjoy: It would replace the host's malloc.
+ * We interpose the allocator and defer to glibc's internal entry points.
+ */
+
+#include "midjoy.h"
+#include <unistd.h>
+
+#if MJ_DEBUG
+
+extern void *__libc_malloc(size_t c);
+extern void *__libc_calloc(size_t n,size_t c);
+extern void *__libc_realloc(void *p,size_t c);
+
+static void mj_rt_check_alloc() {
+  if (mj_rt_enforce&&mj_rt_hotpath) {
+    static const char msg[]="midjoy: Heap allocation in the event path!\n";
+    write(2,msg,sizeof(msg)-1);
+    abort();
+  }
+}
+
+void *malloc(size_t c) {
+  mj_rt_check_alloc();
+  return __libc_malloc(c);
+}
+
+void *calloc(size_t n,size_t c) {
+  mj_rt_check_alloc();
+  return __libc_calloc(n,c);
+}
+
+void *realloc(void *p,size_t c) {
+  mj_rt_check_alloc();
+  return __libc_realloc(p,c);
+}
+
+#endif
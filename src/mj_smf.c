@@ -0,0 +1,395 @@
+#include "midjoy.h"
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/timerfd.h>
+#include <sys/prctl.h>
+
+/* File format.
+ * "MThd" chunk: u16 format, u16 track count, u16 division. Then chunks, of which we only read "MTrk".
+ * All big-endian. Each track is a series of (delta time, event), with Running Status.
+ * Division is ticks per quarter note, or if negative, SMPTE frames per second and ticks per frame.
+ */
+
+#define MJ_SMF_DEFAULT_TEMPO 500000 /* us per quarter note, ie 120 bpm. */
+#define MJ_SMF_SPIN_NS 200000 /* Wake this early and spin the rest, since waking is only good to 100us or so. */
+
+#define MJ_SMF_SKIP    0
+#define MJ_SMF_DELIVER 1
+#define MJ_SMF_TEMPO   2
+
+struct mj_smf_track {
+  const uint8_t *v;
+  int c,p;
+  uint8_t status;
+  int64_t tick; // Of the next event, once (p) is past its delta.
+  int done;
+};
+
+static int mj_smf_rd16(const uint8_t *src) {
+  return (src[0]<<8)|src[1];
+}
+
+static int mj_smf_rd32(const uint8_t *src) {
+  return (src[0]<<24)|(src[1]<<16)|(src[2]<<8)|src[3];
+}
+
+/* Variable-length quantity, up to 4 bytes. Returns length consumed or <0.
+ */
+
+static int mj_smf_vlq(int *dst,const uint8_t *src,int srcc) {
+  *dst=0;
+  int srcp=0;
+  while (srcp<4) {
+    if (srcp>=srcc) return -1;
+    uint8_t b=src[srcp++];
+    *dst=(*dst<<7)|(b&0x7f);
+    if (!(b&0x80)) return srcp;
+  }
+  return -1;
+}
+
+/* Track: Read the delta time ahead of the next event, or mark it done at the end of the chunk.
+ */
+
+static int mj_smf_track_delta(struct mj_smf_track *track) {
+  if (track->p>=track->c) {
+    track->done=1;
+    return 0;
+  }
+  int delta;
+  int err=mj_smf_vlq(&delta,track->v+track->p,track->c-track->p);
+  if (err<0) return -1;
+  track->p+=err;
+  track->tick+=delta;
+  return 0;
+}
+
+/* Track: Decode the next event, then read the following delta.
+ * MJ_SMF_DELIVER with (event) populated except (time), MJ_SMF_TEMPO with (*tempo), MJ_SMF_SKIP, or <0 if malformed.
+ * (base) is the start of the file, for Sysex offsets.
+ */
+
+static int mj_smf_track_next(struct mj_smf_event *event,int *tempo,struct mj_smf_track *track,const uint8_t *base) {
+  const uint8_t *v=track->v;
+  int c=track->c,p=track->p,result=MJ_SMF_SKIP;
+  if (p>=c) return -1;
+  uint8_t status=v[p];
+  if (status&0x80) p++;
+  else if (track->status) status=track->status;
+  else return -1;
+
+  if (status<0xf0) {
+    int len=((status&0xe0)==0xc0)?1:2;
+    if (p>c-len) return -1;
+    if ((v[p]&0x80)||((len==2)&&(v[p+1]&0x80))) return -1;
+    track->status=status;
+    event->v[0]=status;
+    event->v[1]=v[p];
+    event->v[2]=(len==2)?v[p+1]:0;
+    event->vc=1+len;
+    event->p=event->c=0;
+    p+=len;
+    result=MJ_SMF_DELIVER;
+
+  } else if (status==0xff) {
+    track->status=0;
+    if (p>=c) return -1;
+    uint8_t type=v[p++];
+    int len,err=mj_smf_vlq(&len,v+p,c-p);
+    if (err<0) return -1;
+    p+=err;
+    if (len>c-p) return -1;
+    if (type==0x2f) { // End of Track
+      track->p=c;
+      track->done=1;
+      return MJ_SMF_SKIP;
+    }
+    if ((type==0x51)&&(len==3)) {
+      *tempo=(v[p]<<16)|(v[p+1]<<8)|v[p+2];
+      if (*tempo>0) result=MJ_SMF_TEMPO;
+    }
+    p+=len;
+
+  } else if ((status==0xf0)||(status==0xf7)) {
+    track->status=0;
+    int len,err=mj_smf_vlq(&len,v+p,c-p);
+    if (err<0) return -1;
+    p+=err;
+    if (len>c-p) return -1;
+    event->v[0]=status;
+    event->vc=(status==0xf0)?1:0; // F0: Payload follows, usually ending in F7. F7: An escape, payload is sent raw.
+    event->p=(v+p)-base;
+    event->c=len;
+    p+=len;
+    if (event->vc||event->c) result=MJ_SMF_DELIVER;
+
+  } else {
+    return -1;
+  }
+
+  track->p=p;
+  if (!track->done&&(mj_smf_track_delta(track)<0)) return -1;
+  return result;
+}
+
+/* Load: Count tracks and point at them.
+ */
+
+static int mj_smf_find_tracks(struct mj_smf_track **dst,const uint8_t *src,int srcc,int srcp) {
+  int trackc=0,p=srcp,i;
+  while (p<=srcc-8) {
+    int len=mj_smf_rd32(src+p+4);
+    if ((len<0)||(len>srcc-p-8)) break; // Truncated; take what we have.
+    if (!memcmp(src+p,"MTrk",4)) trackc++;
+    p+=8+len;
+  }
+  if (!trackc) return -1;
+  struct mj_smf_track *trackv=calloc(trackc,sizeof(struct mj_smf_track));
+  if (!trackv) return -1;
+  for (p=srcp,i=0;i<trackc;) {
+    int len=mj_smf_rd32(src+p+4);
+    if (!memcmp(src+p,"MTrk",4)) {
+      trackv[i].v=src+p+8;
+      trackv[i].c=len;
+      i++;
+    }
+    p+=8+len;
+  }
+  *dst=trackv;
+  return trackc;
+}
+
+/* Load: Tick to ns, given the last tempo change.
+ * Every time is computed from the last change, not from the previous event, so rounding never adds up.
+ */
+
+struct mj_smf_clock {
+  int division; // Ticks per quarter note. Zero if SMPTE.
+  double smpte; // ns per tick, if SMPTE.
+  int tempo; // us per quarter note.
+  int64_t basetick,basetime;
+};
+
+static int64_t mj_smf_clock_time(const struct mj_smf_clock *clock,int64_t tick) {
+  if (!clock->division) return (int64_t)(tick*clock->smpte);
+  return clock->basetime+((tick-clock->basetick)*clock->tempo*1000)/clock->division;
+}
+
+static void mj_smf_clock_set_tempo(struct mj_smf_clock *clock,int64_t tick,int tempo) {
+  clock->basetime=mj_smf_clock_time(clock,tick);
+  clock->basetick=tick;
+  clock->tempo=tempo;
+}
+
+/* Load.
+ * First pass counts and validates each track alone, so we can allocate the merged array exactly.
+ * Second pass merges: Always take the track with the earliest next event, lowest index first on ties.
+ * Tempo must be applied in merged order, since format 1 keeps it on its own track.
+ */
+
+static int mj_smf_load(struct mj_smf *smf,const char *path) {
+  const uint8_t *src=smf->map;
+  int srcc=smf->mapsize;
+  if ((srcc<14)||memcmp(src,"MThd",4)||(mj_smf_rd32(src+4)<6)||(mj_smf_rd32(src+4)>srcc-8)) {
+    fprintf(stderr,"%s: Not a MIDI file.\n",path);
+    return -1;
+  }
+  int format=mj_smf_rd16(src+8);
+  int division=mj_smf_rd16(src+12);
+  if (format>1) {
+    fprintf(stderr,"%s: MIDI file format %d not supported, only 0 and 1.\n",path,format);
+    return -1;
+  }
+  struct mj_smf_clock clock={.tempo=MJ_SMF_DEFAULT_TEMPO};
+  if (division&0x8000) {
+    int fps=-(int8_t)(division>>8);
+    int tpf=division&0xff;
+    if ((fps<=0)||!tpf) {
+      fprintf(stderr,"%s: Invalid SMPTE division.\n",path);
+      return -1;
+    }
+    clock.smpte=1e9/(((fps==29)?29.97:fps)*tpf);
+  } else if (!(clock.division=division)) {
+    fprintf(stderr,"%s: Invalid division.\n",path);
+    return -1;
+  }
+
+  struct mj_smf_track *trackv=0;
+  int trackc=mj_smf_find_tracks(&trackv,src,srcc,8+mj_smf_rd32(src+4));
+  if (trackc<0) {
+    fprintf(stderr,"%s: No tracks.\n",path);
+    return -1;
+  }
+
+  struct mj_smf_event event;
+  int tempo,i,eventc=0;
+  for (i=0;i<trackc;i++) {
+    struct mj_smf_track track=trackv[i];
+    if (mj_smf_track_delta(&track)<0) goto _malformed_;
+    trackv[i]=track;
+    while (!track.done) {
+      int err=mj_smf_track_next(&event,&tempo,&track,src);
+      if (err<0) goto _malformed_;
+      if (err==MJ_SMF_DELIVER) eventc++;
+    }
+  }
+  if (!(smf->eventv=malloc(sizeof(struct mj_smf_event)*(eventc?eventc:1)))) {
+    free(trackv);
+    return -1;
+  }
+
+  while (smf->eventc<eventc) {
+    struct mj_smf_track *track=0;
+    for (i=0;i<trackc;i++) {
+      if (trackv[i].done) continue;
+      if (!track||(trackv[i].tick<track->tick)) track=trackv+i;
+    }
+    if (!track) break;
+    int64_t tick=track->tick;
+    struct mj_smf_event *dst=smf->eventv+smf->eventc;
+    switch (mj_smf_track_next(dst,&tempo,track,src)) {
+      case MJ_SMF_DELIVER: dst->time=mj_smf_clock_time(&clock,tick); smf->eventc++; break;
+      case MJ_SMF_TEMPO: mj_smf_clock_set_tempo(&clock,tick,tempo); break;
+    }
+  }
+  free(trackv);
+  return 0;
+ _malformed_:
+  fprintf(stderr,"%s: Malformed MIDI file, in track %d.\n",path,i);
+  free(trackv);
+  return -1;
+}
+
+/* Cleanup.
+ */
+
+void mj_smf_cleanup(struct mj_smf *smf) {
+  if (smf->timerfd>0) {
+    if (smf->input) mj_input_unwatch_fd(smf->input,smf->timerfd);
+    close(smf->timerfd);
+  }
+  if (smf->map) munmap(smf->map,smf->mapsize);
+  if (smf->fd>0) close(smf->fd);
+  if (smf->eventv) free(smf->eventv);
+  memset(smf,0,sizeof(struct mj_smf));
+}
+
+/* Arm timer, absolute on mj_now()'s clock.
+ */
+
+static int mj_smf_arm(struct mj_smf *smf,int64_t when) {
+  struct itimerspec spec={0};
+  spec.it_value.tv_sec=when/1000000000ll;
+  spec.it_value.tv_nsec=when%1000000000ll;
+  return timerfd_settime(smf->timerfd,TFD_TIMER_ABSTIME,&spec,0);
+}
+
+/* Span: Collect bytes for one delivery.
+ * A Sysex too big for the span goes out on its own, right after what's pending.
+ */
+
+static int mj_smf_flush(struct mj_smf *smf) {
+  if (!smf->spanc) return 0;
+  struct mj_input *input=smf->input;
+  smf->device.rcvtime=mj_now();
+  int err=input->cb(&smf->device,smf->spanv,smf->spanc,input->userdata);
+  smf->spanc=0;
+  return err;
+}
+
+static int mj_smf_emit(struct mj_smf *smf,const void *src,int srcc) {
+  smf->bytec+=srcc;
+  if (smf->spanc>MJ_SMF_SPAN_LIMIT-srcc) {
+    if (mj_smf_flush(smf)<0) return -1;
+    if (srcc>MJ_SMF_SPAN_LIMIT) {
+      struct mj_input *input=smf->input;
+      smf->device.rcvtime=mj_now();
+      return input->cb(&smf->device,src,srcc,input->userdata);
+    }
+  }
+  memcpy(smf->spanv+smf->spanc,src,srcc);
+  smf->spanc+=srcc;
+  return 0;
+}
+
+/* Timer fired.
+ * Deliver everything that's due, then arm for the next one, a little early.
+ * Anything due within MJ_SMF_SPIN_NS, we wait for right here.
+ */
+
+static int mj_smf_update(struct mj_input *input,struct mj_input_watch *watch) {
+  struct mj_smf *smf=watch->userdata;
+  uint64_t expirations;
+  read(smf->timerfd,&expirations,sizeof(expirations));
+  int64_t now=mj_now();
+  while (smf->eventp<smf->eventc) {
+    const struct mj_smf_event *event=smf->eventv+smf->eventp;
+    int64_t due=smf->starttime+event->time;
+    if ((due>now)&&(due>(now=mj_now()))) {
+      if (mj_smf_flush(smf)<0) return -1;
+      if (due-mj_now()>MJ_SMF_SPIN_NS) return mj_smf_arm(smf,due-MJ_SMF_SPIN_NS);
+      while ((now=mj_now())<due) ;
+    }
+    mj_latency_add(&smf->lateness,due,now,1);
+    smf->latesum+=now-due;
+    if (event->vc&&(mj_smf_emit(smf,event->v,event->vc)<0)) return -1;
+    if (event->c&&(mj_smf_emit(smf,(const uint8_t*)smf->map+event->p,event->c)<0)) return -1;
+    smf->eventp++;
+  }
+  if (mj_smf_flush(smf)<0) return -1;
+  if (!smf->done) {
+    input->cb(&smf->device,0,0,input->userdata);
+    smf->done=1;
+  }
+  return 0;
+}
+
+/* Start.
+ */
+
+int mj_smf_start(struct mj_smf *smf,struct mj_input *input,const char *path,int devid) {
+  if (smf->map) return -1;
+  smf->input=input;
+  if ((smf->fd=open(path,O_RDONLY|O_CLOEXEC))<0) {
+    fprintf(stderr,"%s: Failed to open MIDI file.\n",path);
+    return -1;
+  }
+  struct stat st;
+  if (fstat(smf->fd,&st)<0) return -1;
+  if ((st.st_size<1)||(st.st_size>INT_MAX)) {
+    fprintf(stderr,"%s: Not a MIDI file.\n",path);
+    return -1;
+  }
+  smf->mapsize=st.st_size;
+  smf->map=mmap(0,smf->mapsize,PROT_READ,MAP_SHARED,smf->fd,0);
+  if (smf->map==MAP_FAILED) {
+    smf->map=0;
+    return -1;
+  }
+  if (mj_smf_load(smf,path)<0) return -1;
+
+  // The default timer slack lets every wakeup run 50us late. We're only here for the timing.
+  prctl(PR_SET_TIMERSLACK,1,0,0,0);
+
+  smf->device.watch.fd=-1;
+  smf->device.devid=devid;
+  if (input->cb(&smf->device,"\xf0\xf7",2,input->userdata)<0) return -1;
+  smf->starttime=mj_now();
+  if ((smf->timerfd=timerfd_create(CLOCK_MONOTONIC,TFD_NONBLOCK|TFD_CLOEXEC))<0) return -1;
+  if (mj_input_watch_fd(input,smf->timerfd,mj_smf_update,smf)<0) return -1;
+  return mj_smf_arm(smf,smf->starttime);
+}
+
+/* Report.
+ */
+
+void mj_smf_report(const struct mj_smf *smf,FILE *dst) {
+  double sec=(mj_now()-smf->starttime)/1e9;
+  fprintf(dst,"smf: %d of %d events, %llu bytes in %.3f s, mean lateness %.1f us\n",
+    smf->eventp,smf->eventc,(unsigned long long)smf->bytec,sec,
+    smf->eventp?(smf->latesum/1000.0)/smf->eventp:0.0
+  );
+  mj_latency_dump(&smf->lateness,dst,"smf lateness");
+}
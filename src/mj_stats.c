@@ -0,0 +1,84 @@
+#include "midjoy.h"
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+
+_Static_assert(sizeof(struct mj_stats_header)%64==0,"Stats slots must start on a cache line.");
+
+/* Cleanup.
+ */
+ 
+void mj_stats_cleanup(struct mj_stats *stats) {
+  if (stats->map) {
+    __atomic_store_n(&stats->header->pid,0,__ATOMIC_RELEASE);
+    munmap(stats->map,stats->mapsize);
+  }
+  if (stats->fd>0) close(stats->fd);
+  memset(stats,0,sizeof(struct mj_stats));
+}
+
+/* Open.
+ * Replace rather than truncate in place: A reader with the old file mapped keeps its pages, and can notice the new pid.
+ */
+ 
+int mj_stats_open(struct mj_stats *stats,const char *path,int slotc) {
+  if (stats->map) return -1;
+  if (slotc<1) slotc=MJ_STATS_DEFAULT_SLOTC;
+  unlink(path);
+  if ((stats->fd=open(path,O_RDWR|O_CREAT|O_EXCL|O_CLOEXEC,0644))<0) {
+    fprintf(stderr,"%s: Failed to open stats page.\n",path);
+    return -1;
+  }
+  stats->mapsize=sizeof(struct mj_stats_header)+sizeof(struct mj_stats_slot)*slotc;
+  if (ftruncate(stats->fd,stats->mapsize)<0) return -1;
+  stats->map=mmap(0,stats->mapsize,PROT_READ|PROT_WRITE,MAP_SHARED,stats->fd,0);
+  if (stats->map==MAP_FAILED) {
+    stats->map=0;
+    return -1;
+  }
+  stats->header=stats->map;
+  stats->slotv=(struct mj_stats_slot*)((char*)stats->map+sizeof(struct mj_stats_header));
+  stats->slotc=slotc;
+  int i=0;
+  for (;i<slotc;i++) stats->slotv[i].devid=-1;
+  stats->header->slotsize=sizeof(struct mj_stats_slot);
+  stats->header->slotc=slotc;
+  stats->header->pid=getpid();
+  stats->header->starttime=mj_now();
+  __atomic_thread_fence(__ATOMIC_RELEASE);
+  memcpy(stats->header->magic,MJ_STATS_MAGIC,8);
+  return 0;
+}
+
+/* Get slot.
+ */
+ 
+struct mj_stats_slot *mj_stats_get(struct mj_stats *stats,int devid,int create) {
+  if (!stats||!stats->map) return 0;
+  struct mj_stats_slot *slot=stats->slotv;
+  int i=stats->slotc;
+  for (;i-->0;slot++) {
+    int32_t slotdevid=__atomic_load_n(&slot->devid,__ATOMIC_ACQUIRE);
+    if (slotdevid==devid) return slot;
+    if (slotdevid<0) {
+      // Slots fill in order and are never released, so the first free one ends the search.
+      if (!create) return 0;
+      __atomic_store_n(&slot->devid,devid,__ATOMIC_RELEASE);
+      return slot;
+    }
+  }
+  return 0;
+}
+
+/* Realtime counts from the parser.
+ */
+ 
+void mj_stats_add_realtime(struct mj_stats_slot *slot,struct mj_midi_parser *parser) {
+  if (!slot) return;
+  int i=0;
+  for (;i<8;i++) {
+    if (!parser->realtimev[i]) continue;
+    MJ_STATS_ADD(slot,systemv[MJ_STATS_SYSTEM_INDEX(0xf8+i)],parser->realtimev[i]);
+    parser->realtimev[i]=0;
+  }
+}
@@ -0,0 +1,178 @@
+#include "midjoy.h"
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/timerfd.h>
+
+/* Timer wheel.
+ * Ticks are milliseconds since (base). Level L holds timers due within 64 of its slots,
+ * and each slot at level L spans 64^L ticks. Upper slots cascade down when their period begins.
+ * Setting, cancelling, and firing are all O(1). Finding the next due tick is a rotate-and-ctz per level.
+ */
+ 
+#define MJ_TIMER_NS_PER_TICK 1000000ll
+
+/* Init, cleanup.
+ */
+ 
+int mj_timer_wheel_init(struct mj_timer_wheel *wheel) {
+  memset(wheel,0,sizeof(struct mj_timer_wheel));
+  if ((wheel->fd=timerfd_create(CLOCK_MONOTONIC,TFD_NONBLOCK|TFD_CLOEXEC))<0) return -1;
+  wheel->base=mj_now();
+  wheel->armed=-1;
+  return 0;
+}
+
+void mj_timer_wheel_cleanup(struct mj_timer_wheel *wheel) {
+  int level=0;
+  for (;level<MJ_TIMER_LEVEL_COUNT;level++) {
+    int slot=0;
+    for (;slot<MJ_TIMER_SLOT_COUNT;slot++) {
+      while (wheel->slotv[level][slot]) mj_timer_cancel(wheel->slotv[level][slot]);
+    }
+  }
+  if (wheel->fd>0) close(wheel->fd);
+  memset(wheel,0,sizeof(struct mj_timer_wheel));
+}
+
+/* List primitives.
+ */
+ 
+void mj_timer_cancel(struct mj_timer *timer) {
+  if (!timer->pprev) return;
+  if (timer->next) timer->next->pprev=timer->pprev;
+  *(timer->pprev)=timer->next;
+  timer->next=0;
+  timer->pprev=0;
+}
+
+static void mj_timer_insert(struct mj_timer_wheel *wheel,struct mj_timer *timer) {
+  int64_t expiry=timer->expiry;
+  if (expiry<wheel->tick) expiry=wheel->tick;
+  int level=0;
+  for (;level<MJ_TIMER_LEVEL_COUNT-1;level++) {
+    int shift=level*6;
+    if ((expiry>>shift)-(wheel->tick>>shift)<MJ_TIMER_SLOT_COUNT) break;
+  }
+  // Beyond the top level's reach, park it in the furthest slot. It will cascade back up there until due.
+  int shift=level*6;
+  if ((expiry>>shift)-(wheel->tick>>shift)>=MJ_TIMER_SLOT_COUNT) {
+    expiry=((wheel->tick>>shift)+MJ_TIMER_SLOT_COUNT-1)<<shift;
+  }
+  int slot=(expiry>>shift)&(MJ_TIMER_SLOT_COUNT-1);
+  struct mj_timer **head=wheel->slotv[level]+slot;
+  timer->next=*head;
+  timer->pprev=head;
+  if (*head) (*head)->pprev=&timer->next;
+  *head=timer;
+  wheel->bitv[level]|=1ull<<slot;
+}
+
+/* Next tick at which anything happens, or <0 if the wheel is empty.
+ * Occupancy bits are only cleared lazily, here and at firing.
+ */
+ 
+static int64_t mj_timer_wheel_next(struct mj_timer_wheel *wheel) {
+  int64_t next=-1;
+  int level=0;
+  for (;level<MJ_TIMER_LEVEL_COUNT;level++) {
+    int shift=level*6;
+    int cur=(wheel->tick>>shift)&(MJ_TIMER_SLOT_COUNT-1);
+    while (wheel->bitv[level]) {
+      uint64_t bits=wheel->bitv[level];
+      if (cur) bits=(bits>>cur)|(bits<<(64-cur));
+      int offset=__builtin_ctzll(bits);
+      int slot=(cur+offset)&(MJ_TIMER_SLOT_COUNT-1);
+      if (!wheel->slotv[level][slot]) {
+        wheel->bitv[level]&=~(1ull<<slot);
+        continue;
+      }
+      int64_t tick;
+      if (!offset) tick=wheel->tick;
+      else tick=((wheel->tick>>shift)+offset)<<shift;
+      if ((next<0)||(tick<next)) next=tick;
+      break;
+    }
+  }
+  return next;
+}
+
+/* Process one tick: Cascade upper slots whose period is current, then fire level zero.
+ */
+ 
+static void mj_timer_wheel_tick(struct mj_timer_wheel *wheel) {
+  int level=MJ_TIMER_LEVEL_COUNT;
+  while (level-->1) {
+    int slot=(wheel->tick>>(level*6))&(MJ_TIMER_SLOT_COUNT-1);
+    struct mj_timer *timer;
+    while ((timer=wheel->slotv[level][slot])) {
+      mj_timer_cancel(timer);
+      mj_timer_insert(wheel,timer);
+    }
+  }
+  int slot=wheel->tick&(MJ_TIMER_SLOT_COUNT-1);
+  struct mj_timer *timer;
+  wheel->firing=1;
+  while ((timer=wheel->slotv[0][slot])) {
+    mj_timer_cancel(timer);
+    if (timer->expiry>wheel->tick) mj_timer_insert(wheel,timer);
+    else timer->cb(timer);
+  }
+  wheel->firing=0;
+  wheel->bitv[0]&=~(1ull<<slot);
+}
+
+/* Arm the timerfd for the next due tick, if it changed.
+ */
+ 
+static int mj_timer_wheel_arm(struct mj_timer_wheel *wheel,int64_t tick) {
+  if (tick==wheel->armed) return 0;
+  struct itimerspec spec={0};
+  if (tick>=0) {
+    int64_t ns=wheel->base+tick*MJ_TIMER_NS_PER_TICK;
+    spec.it_value.tv_sec=ns/1000000000ll;
+    spec.it_value.tv_nsec=ns%1000000000ll;
+    if (!spec.it_value.tv_sec&&!spec.it_value.tv_nsec) spec.it_value.tv_nsec=1;
+  }
+  if (timerfd_settime(wheel->fd,TFD_TIMER_ABSTIME,&spec,0)<0) return -1;
+  wheel->armed=tick;
+  return 0;
+}
+
+/* Set timer.
+ */
+ 
+int mj_timer_set(struct mj_timer_wheel *wheel,struct mj_timer *timer,int64_t deadline) {
+  mj_timer_cancel(timer);
+  int64_t rel=deadline-wheel->base;
+  if (rel<0) rel=0;
+  timer->expiry=(rel+MJ_TIMER_NS_PER_TICK-1)/MJ_TIMER_NS_PER_TICK;
+  // From a callback, "now" means next tick. Otherwise a timer that reschedules itself at zero would never let go.
+  if (wheel->firing&&(timer->expiry<=wheel->tick)) timer->expiry=wheel->tick+1;
+  mj_timer_insert(wheel,timer);
+  if (wheel->firing) return 0;
+  int64_t tick=timer->expiry;
+  if (tick<wheel->tick) tick=wheel->tick;
+  if ((wheel->armed>=0)&&(wheel->armed<=tick)) return 0;
+  return mj_timer_wheel_arm(wheel,tick);
+}
+
+/* Update.
+ */
+ 
+int mj_timer_wheel_update(struct mj_timer_wheel *wheel) {
+  uint64_t expirations;
+  read(wheel->fd,&expirations,sizeof(expirations));
+  wheel->armed=-1;
+  int64_t now=(mj_now()-wheel->base)/MJ_TIMER_NS_PER_TICK;
+  MJ_HOTPATH_BEGIN
+  while (1) {
+    int64_t next=mj_timer_wheel_next(wheel);
+    if ((next<0)||(next>now)) break;
+    wheel->tick=next;
+    mj_timer_wheel_tick(wheel);
+    wheel->tick++;
+  }
+  MJ_HOTPATH_END
+  if (wheel->tick<=now) wheel->tick=now+1;
+  return mj_timer_wheel_arm(wheel,mj_timer_wheel_next(wheel));
+}
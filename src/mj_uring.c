@@ -0,0 +1,334 @@
+#include "midjoy.h"
+#include <unistd.h>
+#include <signal.h>
+#include <errno.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+
+/* No liburing, so the two syscalls are ours to wrap.
+ */
+
+static int mj_uring_setup_syscall(unsigned entries,struct io_uring_params *params) {
+  return syscall(__NR_io_uring_setup,entries,params);
+}
+
+static int mj_uring_enter_syscall(int fd,unsigned submitc,unsigned waitc,unsigned flags,const void *arg,size_t argsize) {
+  return syscall(__NR_io_uring_enter,fd,submitc,waitc,flags,arg,argsize);
+}
+
+/* Cleanup.
+ */
+
+void mj_uring_cleanup(struct mj_uring *uring) {
+  if (uring->sqev) munmap(uring->sqev,uring->sqevsize);
+  if (uring->cqmap&&(uring->cqmap!=uring->sqmap)) munmap(uring->cqmap,uring->cqmapsize);
+  if (uring->sqmap) munmap(uring->sqmap,uring->sqmapsize);
+  if (uring->fd>0) close(uring->fd);
+  if (uring->stagev[0].v) free(uring->stagev[0].v);
+  if (uring->stagev[1].v) free(uring->stagev[1].v);
+  if (uring->deferv) free(uring->deferv);
+  memset(uring,0,sizeof(struct mj_uring));
+}
+
+/* Init.
+ */
+
+int mj_uring_init(struct mj_uring *uring) {
+  if (uring->fd>0) return -1;
+  struct io_uring_params params={0};
+  int fd=mj_uring_setup_syscall(MJ_URING_ENTRIES,&params);
+  if (fd<0) return -1;
+  uring->fd=fd;
+
+  // EXT_ARG for timeouts on enter, NODROP so completions can't get lost, RW_CUR_POS for writing at the file position.
+  uint32_t need=IORING_FEAT_EXT_ARG|IORING_FEAT_NODROP|IORING_FEAT_RW_CUR_POS;
+  if ((params.features&need)!=need) {
+    mj_uring_cleanup(uring);
+    return -1;
+  }
+
+  uring->sqmapsize=params.sq_off.array+params.sq_entries*sizeof(uint32_t);
+  uring->cqmapsize=params.cq_off.cqes+params.cq_entries*sizeof(struct io_uring_cqe);
+  if (params.features&IORING_FEAT_SINGLE_MMAP) {
+    if (uring->cqmapsize>uring->sqmapsize) uring->sqmapsize=uring->cqmapsize;
+    uring->cqmapsize=uring->sqmapsize;
+  }
+  uring->sqmap=mmap(0,uring->sqmapsize,PROT_READ|PROT_WRITE,MAP_SHARED|MAP_POPULATE,fd,IORING_OFF_SQ_RING);
+  if (uring->sqmap==MAP_FAILED) {
+    uring->sqmap=0;
+    mj_uring_cleanup(uring);
+    return -1;
+  }
+  if (params.features&IORING_FEAT_SINGLE_MMAP) {
+    uring->cqmap=uring->sqmap;
+  } else {
+    uring->cqmap=mmap(0,uring->cqmapsize,PROT_READ|PROT_WRITE,MAP_SHARED|MAP_POPULATE,fd,IORING_OFF_CQ_RING);
+    if (uring->cqmap==MAP_FAILED) {
+      uring->cqmap=0;
+      mj_uring_cleanup(uring);
+      return -1;
+    }
+  }
+  uring->sqevsize=params.sq_entries*sizeof(struct io_uring_sqe);
+  uring->sqev=mmap(0,uring->sqevsize,PROT_READ|PROT_WRITE,MAP_SHARED|MAP_POPULATE,fd,IORING_OFF_SQES);
+  if (uring->sqev==MAP_FAILED) {
+    uring->sqev=0;
+    mj_uring_cleanup(uring);
+    return -1;
+  }
+
+  uint8_t *sq=uring->sqmap,*cq=uring->cqmap;
+  uring->sqhead=(uint32_t*)(sq+params.sq_off.head);
+  uring->sqtail=(uint32_t*)(sq+params.sq_off.tail);
+  uring->sqarray=(uint32_t*)(sq+params.sq_off.array);
+  uring->sqmask=*(uint32_t*)(sq+params.sq_off.ring_mask);
+  uring->sqentries=params.sq_entries;
+  uring->cqhead=(uint32_t*)(cq+params.cq_off.head);
+  uring->cqtail=(uint32_t*)(cq+params.cq_off.tail);
+  uring->cqmask=*(uint32_t*)(cq+params.cq_off.ring_mask);
+  uring->cqev=(struct io_uring_cqe*)(cq+params.cq_off.cqes);
+
+  // Everything the event path needs, allocated now.
+  if (
+    !(uring->stagev[0].v=malloc(MJ_URING_STAGE_SIZE))||
+    !(uring->stagev[1].v=malloc(MJ_URING_STAGE_SIZE))||
+    !(uring->deferv=malloc(sizeof(struct io_uring_cqe)*params.cq_entries))
+  ) {
+    mj_uring_cleanup(uring);
+    return -1;
+  }
+  uring->defera=params.cq_entries;
+  return 0;
+}
+
+/* Submission.
+ * We don't use SQPOLL, so the kernel only looks at the ring during enter, and the tail can move as we fill.
+ */
+
+static int mj_uring_submit(struct mj_uring *uring) {
+  if (!uring->pendingc) return 0;
+  int err=mj_uring_enter_syscall(uring->fd,uring->pendingc,0,0,0,0);
+  uring->enterc++;
+  if (err<0) {
+    if ((errno==EINTR)||(errno==EAGAIN)||(errno==EBUSY)) return 0;
+    return -1;
+  }
+  uring->pendingc-=err;
+  return 0;
+}
+
+static uint32_t mj_uring_sq_available(const struct mj_uring *uring) {
+  uint32_t head=__atomic_load_n(uring->sqhead,__ATOMIC_ACQUIRE);
+  return uring->sqentries-(*uring->sqtail-head);
+}
+
+struct io_uring_sqe *mj_uring_sqe(struct mj_uring *uring) {
+  if (!mj_uring_sq_available(uring)) {
+    if (mj_uring_submit(uring)<0) return 0;
+    if (!mj_uring_sq_available(uring)) return 0;
+  }
+  uint32_t tail=*uring->sqtail;
+  uint32_t p=tail&uring->sqmask;
+  struct io_uring_sqe *sqe=uring->sqev+p;
+  memset(sqe,0,sizeof(struct io_uring_sqe));
+  uring->sqarray[p]=p;
+  __atomic_store_n(uring->sqtail,tail+1,__ATOMIC_RELEASE);
+  uring->pendingc++;
+  return sqe;
+}
+
+/* Turn the collecting stage into one linked chain of writes, and start collecting in the other.
+ * Only when nothing is in flight: The chain keeps order within a batch, this keeps order between them.
+ * A write's user_data carries its index in the stage, which stays put until the whole chain completes.
+ */
+
+static int mj_uring_start_writes(struct mj_uring *uring) {
+  struct mj_uring_stage *stage=uring->stagev+uring->stage;
+  if (!stage->writec||uring->inflightc) return 0;
+  if (mj_uring_sq_available(uring)<stage->writec) {
+    // A chain can't straddle an early submit.
+    if (mj_uring_submit(uring)<0) return -1;
+    if (mj_uring_sq_available(uring)<stage->writec) return 0;
+  }
+  int i=0;
+  for (;i<stage->writec;i++) {
+    const struct mj_uring_write *write=stage->writev+i;
+    struct io_uring_sqe *sqe=mj_uring_sqe(uring);
+    sqe->opcode=IORING_OP_WRITE;
+    sqe->fd=write->fd;
+    sqe->addr=(uintptr_t)(stage->v+write->p);
+    sqe->len=write->c;
+    sqe->off=(uint64_t)-1; // Current position, like write(2).
+    sqe->user_data=MJ_URING_USER_WRITE|((uint64_t)i<<4);
+    if (i<stage->writec-1) sqe->flags=IOSQE_IO_LINK;
+  }
+  uring->inflightc=stage->writec;
+  uring->batchc++;
+  uring->stage^=1;
+  stage=uring->stagev+uring->stage;
+  stage->c=0;
+  stage->writec=0;
+  return 0;
+}
+
+/* Completions.
+ * Each is consumed before it's delivered, since delivery can land back here via mj_uring_write.
+ * (cb) null to hold everything but writes for later.
+ */
+
+/* A failed write flags its owner, who stops writing, and everything else carries on.
+ * Writes after it in the chain come back ECANCELED. Those frames are lost, but their owners are fine.
+ */
+static void mj_uring_batch_done(struct mj_uring *uring,struct mj_uring_stage *stage) {
+  int64_t now=mj_now();
+  int i=0;
+  for (;i<stage->stampc;i++) {
+    const struct mj_uring_stamp *stamp=stage->stampv+i;
+    mj_latency_add(stamp->latency,stamp->rcvtime,now,stamp->eventc);
+  }
+  stage->stampc=0;
+}
+
+static void mj_uring_write_done(struct mj_uring *uring,const struct io_uring_cqe *cqe) {
+  struct mj_uring_stage *stage=uring->stagev+(uring->stage^1);
+  if (!--(uring->inflightc)) mj_uring_batch_done(uring,stage);
+  const struct mj_uring_write *write=stage->writev+(cqe->user_data>>4);
+  if (cqe->res==write->c) return;
+  if (cqe->res==-ECANCELED) return;
+  if (*write->failed) return;
+  if (cqe->res<0) fprintf(stderr,"io_uring: Output write failed: %s\n",strerror(-cqe->res));
+  else fprintf(stderr,"io_uring: Short output write, %d of %d.\n",cqe->res,write->c);
+  *write->failed=1;
+}
+
+static int mj_uring_reap(
+  struct mj_uring *uring,
+  int (*cb)(struct mj_uring *uring,const struct io_uring_cqe *cqe,void *userdata),
+  void *userdata
+) {
+  while (1) {
+    uint32_t head=*uring->cqhead;
+    if (head==__atomic_load_n(uring->cqtail,__ATOMIC_ACQUIRE)) return 0;
+    struct io_uring_cqe cqe=uring->cqev[head&uring->cqmask];
+    __atomic_store_n(uring->cqhead,head+1,__ATOMIC_RELEASE);
+    if ((cqe.user_data&15)==MJ_URING_USER_WRITE) {
+      mj_uring_write_done(uring,&cqe);
+    } else if (cqe.user_data==MJ_URING_USER_CANCEL) {
+    } else if (cb) {
+      if (cb(uring,&cqe,userdata)<0) return -1;
+    } else {
+      if (uring->deferc>=uring->defera) return -1;
+      uring->deferv[uring->deferc++]=cqe;
+    }
+  }
+}
+
+/* Drain writes.
+ */
+
+int mj_uring_drain_writes(struct mj_uring *uring) {
+  if (!uring->sqev) return 0;
+  while (1) {
+    if (mj_uring_start_writes(uring)<0) return -1;
+    if (!uring->inflightc) break;
+    int err=mj_uring_enter_syscall(uring->fd,uring->pendingc,1,IORING_ENTER_GETEVENTS,0,0);
+    uring->enterc++;
+    if (err<0) {
+      if ((errno!=EINTR)&&(errno!=EAGAIN)&&(errno!=EBUSY)) return -1;
+    } else {
+      uring->pendingc-=err;
+    }
+    if (mj_uring_reap(uring,0,0)<0) return -1;
+  }
+  return 0;
+}
+
+/* Stage a write.
+ */
+
+int mj_uring_write(struct mj_uring *uring,int fd,const void *src,int srcc,int *failed) {
+  if ((srcc<1)||(srcc>MJ_URING_STAGE_SIZE)) return -1;
+  struct mj_uring_stage *stage=uring->stagev+uring->stage;
+  struct mj_uring_write *last=stage->writec?(stage->writev+stage->writec-1):0;
+  int extend=(last&&(last->fd==fd)&&(last->p+last->c==stage->c));
+  if ((stage->c>MJ_URING_STAGE_SIZE-srcc)||(!extend&&(stage->writec>=MJ_URING_WRITE_LIMIT))) {
+    // Full. Rare, and it costs a blocking wait for everything staged so far.
+    if (mj_uring_drain_writes(uring)<0) return -1;
+    stage=uring->stagev+uring->stage;
+    extend=0;
+  }
+  memcpy(stage->v+stage->c,src,srcc);
+  if (extend) {
+    last->c+=srcc;
+  } else {
+    struct mj_uring_write *write=stage->writev+stage->writec++;
+    write->fd=fd;
+    write->p=stage->c;
+    write->c=srcc;
+    write->failed=failed;
+  }
+  stage->c+=srcc;
+  return 0;
+}
+
+/* Stamp a frame.
+ * The chain completes as a whole, so every frame in a batch shares its completion time.
+ */
+ 
+void mj_uring_stamp(struct mj_uring *uring,struct mj_latency *latency,int64_t rcvtime,int eventc) {
+  struct mj_uring_stage *stage=uring->stagev+uring->stage;
+  if (!stage->writec||(stage->stampc>=MJ_URING_STAMP_LIMIT)) {
+    mj_latency_add(latency,rcvtime,mj_now(),eventc);
+    return;
+  }
+  struct mj_uring_stamp *stamp=stage->stampv+stage->stampc++;
+  stamp->latency=latency;
+  stamp->rcvtime=rcvtime;
+  stamp->eventc=eventc;
+}
+
+/* Update.
+ */
+
+int mj_uring_update(
+  struct mj_uring *uring,int to_ms,
+  int (*cb)(struct mj_uring *uring,const struct io_uring_cqe *cqe,void *userdata),
+  void *userdata
+) {
+
+  // Anything held while draining writes goes first, and then we shouldn't wait.
+  if (uring->deferc) {
+    int i=0;
+    for (;i<uring->deferc;i++) {
+      struct io_uring_cqe cqe=uring->deferv[i];
+      if (cb(uring,&cqe,userdata)<0) {
+        uring->deferc=0;
+        return -1;
+      }
+    }
+    uring->deferc=0;
+    to_ms=0;
+  }
+
+  if (mj_uring_start_writes(uring)<0) return -1;
+  struct __kernel_timespec ts={
+    .tv_sec=to_ms/1000,
+    .tv_nsec=(to_ms%1000)*1000000ll,
+  };
+  struct io_uring_getevents_arg arg={
+    .sigmask_sz=_NSIG/8,
+    .ts=(to_ms>0)?(uintptr_t)&ts:0,
+  };
+  int err=mj_uring_enter_syscall(
+    uring->fd,uring->pendingc,to_ms?1:0,
+    IORING_ENTER_GETEVENTS|IORING_ENTER_EXT_ARG,&arg,sizeof(arg)
+  );
+  uring->enterc++;
+  if (err<0) {
+    if ((errno!=EINTR)&&(errno!=ETIME)&&(errno!=EAGAIN)&&(errno!=EBUSY)) return -1;
+  } else {
+    uring->pendingc-=err;
+  }
+  if (mj_uring_reap(uring,cb,userdata)<0) return -1;
+  return 0;
+}
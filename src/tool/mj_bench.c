@@ -0,0 +1,332 @@
+/* mj_bench.c
+ * End-to-end throughput and latency, with no MIDI hardware and no uinput.
+ * We make a temporary srcdir full of FIFOs named "midiN", feed them scripted MIDI from a thread,
+ * and run the real input and output stages against a "file:/dev/null" sink.
+ */
+
+#include "midjoy.h"
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <time.h>
+#include <pthread.h>
+#include <sys/stat.h>
+
+/* Globals.
+ */
+
+static struct mj_bench {
+  int devicec;
+  int msgc; // per device
+  int rate; // messages per second per device, 0 for unlimited
+  int chunk; // messages per write
+  const char *pattern;
+  int rxsize;
+  int sysexsize;
+  int uring; // Read and write through io_uring instead of epoll, read, and write.
+  char dirpath[64];
+  int fdv[64];
+
+  // Results, collected as each device disconnects.
+  int connectc;
+  struct mj_latency latency;
+  uint64_t writec,writeeventc;
+  uint64_t bytec; // Written by the feeder, read after it's joined.
+} mj_bench={
+  .devicec=4,
+  .msgc=100000,
+  .rate=0,
+  .chunk=8,
+  .pattern="notes",
+  .sysexsize=1024,
+};
+
+/* Generate one message.
+ * Patterns:
+ *   notes: Alternating Note On and Note Off, each with its status byte.
+ *   running: Same, but Running Status with velocity-zero Note Off.
+ *   chords: Four-note chords on and off.
+ *   sysex: Alternating a sysex dump of (sysexsize) payload bytes, and a Note On or Off.
+ */
+
+static int mj_bench_message_size() {
+  if (!strcmp(mj_bench.pattern,"sysex")) return 2+mj_bench.sysexsize;
+  return 3;
+}
+
+static int mj_bench_message(uint8_t *dst,int p,uint8_t *status) {
+  if (!strcmp(mj_bench.pattern,"running")) {
+    uint8_t noteid=0x30+(p>>1)%40;
+    int dstc=0;
+    if (*status!=0x90) dst[dstc++]=*status=0x90;
+    dst[dstc++]=noteid;
+    dst[dstc++]=(p&1)?0x00:0x40;
+    return dstc;
+  }
+  if (!strcmp(mj_bench.pattern,"sysex")) {
+    if (p&1) {
+      dst[0]=(p&2)?0x80:0x90;
+      dst[1]=0x3c;
+      dst[2]=0x40;
+      return 3;
+    }
+    dst[0]=0xf0;
+    int i=0;
+    for (;i<mj_bench.sysexsize;i++) dst[1+i]=(p+i)&0x7f;
+    dst[1+mj_bench.sysexsize]=0xf7;
+    return 2+mj_bench.sysexsize;
+  }
+  if (!strcmp(mj_bench.pattern,"chords")) {
+    uint8_t noteid=0x30+(p&3)*4+((p>>3)%10);
+    dst[0]=(p&4)?0x80:0x90;
+    dst[1]=noteid;
+    dst[2]=0x40;
+    return 3;
+  }
+  uint8_t noteid=0x30+(p>>1)%40;
+  dst[0]=(p&1)?0x80:0x90;
+  dst[1]=noteid;
+  dst[2]=0x40;
+  return 3;
+}
+
+/* Feeder thread.
+ * Round-robin across devices, (chunk) messages per write, paced on absolute deadlines if (rate) set.
+ */
+
+static void *mj_bench_feed(void *arg) {
+  uint8_t statusv[64]={0};
+  uint8_t *buf=malloc(mj_bench.chunk*mj_bench_message_size());
+  if (!buf) return 0;
+  int p=0;
+  struct timespec deadline;
+  clock_gettime(CLOCK_MONOTONIC,&deadline);
+  int64_t interval=mj_bench.rate?(1000000000ll*mj_bench.chunk/mj_bench.rate):0;
+  while (p<mj_bench.msgc) {
+    int chunk=mj_bench.chunk;
+    if (chunk>mj_bench.msgc-p) chunk=mj_bench.msgc-p;
+    int i=0;
+    for (;i<mj_bench.devicec;i++) {
+      int bufc=0,j=0;
+      for (;j<chunk;j++) bufc+=mj_bench_message(buf+bufc,p+j,statusv+i);
+      int bufp=0;
+      while (bufp<bufc) {
+        int err=write(mj_bench.fdv[i],buf+bufp,bufc-bufp);
+        if (err<=0) {
+          if (errno==EINTR) continue;
+          free(buf);
+          return 0;
+        }
+        bufp+=err;
+      }
+      mj_bench.bytec+=bufc;
+    }
+    p+=chunk;
+    if (interval) {
+      deadline.tv_nsec+=interval;
+      while (deadline.tv_nsec>=1000000000) { deadline.tv_sec++; deadline.tv_nsec-=1000000000; }
+      clock_nanosleep(CLOCK_MONOTONIC,TIMER_ABSTIME,&deadline,0);
+    }
+  }
+  int i=0;
+  for (;i<mj_bench.devicec;i++) close(mj_bench.fdv[i]);
+  free(buf);
+  return 0;
+}
+
+/* Parser alone: One device's worth of the pattern in memory, split into (rxsize) reads like the input would.
+ * Bytes per second, and how many messages came out.
+ */
+
+static double mj_bench_parser(int *eventc) {
+  int size=mj_bench.msgc*mj_bench_message_size();
+  uint8_t *src=malloc(size);
+  if (!src) return 0.0;
+  uint8_t status=0;
+  int srcc=0,p=0;
+  for (;p<mj_bench.msgc;p++) srcc+=mj_bench_message(src+srcc,p,&status);
+  int readsize=mj_bench.rxsize?mj_bench.rxsize:4096;
+  struct mj_midi_parser parser={0};
+  struct mj_midi_event event;
+  *eventc=0;
+  int64_t starttime=mj_now();
+  int readp=0;
+  for (;readp<srcc;readp+=readsize) {
+    int readc=srcc-readp;
+    if (readc>readsize) readc=readsize;
+    int srcp=0;
+    while (srcp<readc) {
+      srcp+=mj_midi_parse(&event,&parser,src+readp+srcp,readc-srcp);
+      if (event.opcode) (*eventc)++;
+    }
+  }
+  int64_t elapsed=mj_now()-starttime;
+  free(src);
+  if (elapsed<1) elapsed=1;
+  return srcc/(elapsed/1e9);
+}
+
+/* Input callback. Same as the daemon, but harvests stats at disconnect.
+ */
+
+static void mj_bench_harvest(const struct mj_output_device *device) {
+  int i=0;
+  for (;i<MJ_LATENCY_BUCKET_COUNT;i++) mj_bench.latency.bucketv[i]+=device->latency.bucketv[i];
+  mj_bench.latency.count+=device->latency.count;
+  if (device->latency.max>mj_bench.latency.max) mj_bench.latency.max=device->latency.max;
+  mj_bench.writec+=device->writec;
+  mj_bench.writeeventc+=device->writeeventc;
+}
+
+static int mj_bench_rcvin(struct mj_input_device *device,const void *src,int srcc,void *userdata) {
+  struct mj_output *output=userdata;
+  if (!srcc) {
+    if (device->link) mj_bench_harvest(device->link);
+    int err=mj_output_disconnect_device(output,device->link);
+    device->link=0;
+    mj_bench.connectc--;
+    return err;
+  } else if ((srcc==2)&&!memcmp(src,"\xf0\xf7",2)) {
+    if (!(device->link=mj_output_connect_device(output,device->devid))) return -1;
+    mj_bench.connectc++;
+    return 0;
+  } else {
+    return mj_output_events(output,device->link,src,srcc,device->rcvtime);
+  }
+}
+
+/* Make the FIFOs.
+ * We hold each open read-write, so the daemon side's blocking open returns immediately.
+ */
+
+static int mj_bench_make_fifos() {
+  strcpy(mj_bench.dirpath,"/tmp/mj_bench.XXXXXX");
+  if (!mkdtemp(mj_bench.dirpath)) return -1;
+  int i=0;
+  for (;i<mj_bench.devicec;i++) {
+    char path[128];
+    snprintf(path,sizeof(path),"%s/midi%d",mj_bench.dirpath,i);
+    if (mkfifo(path,0600)<0) return -1;
+    if ((mj_bench.fdv[i]=open(path,O_RDWR))<0) return -1;
+  }
+  return 0;
+}
+
+static void mj_bench_remove_fifos() {
+  int i=0;
+  for (;i<mj_bench.devicec;i++) {
+    char path[128];
+    snprintf(path,sizeof(path),"%s/midi%d",mj_bench.dirpath,i);
+    unlink(path);
+  }
+  rmdir(mj_bench.dirpath);
+}
+
+/* Main.
+ */
+
+int main(int argc,char **argv) {
+  int argp=1;
+  for (;argp<argc;argp++) {
+    const char *arg=argv[argp];
+    if (!memcmp(arg,"--devices=",10)) mj_bench.devicec=atoi(arg+10);
+    else if (!memcmp(arg,"--messages=",11)) mj_bench.msgc=atoi(arg+11);
+    else if (!memcmp(arg,"--rate=",7)) mj_bench.rate=atoi(arg+7);
+    else if (!memcmp(arg,"--chunk=",8)) mj_bench.chunk=atoi(arg+8);
+    else if (!memcmp(arg,"--pattern=",10)) mj_bench.pattern=arg+10;
+    else if (!memcmp(arg,"--rxsize=",9)) mj_bench.rxsize=atoi(arg+9);
+    else if (!memcmp(arg,"--sysex-size=",13)) mj_bench.sysexsize=atoi(arg+13);
+    else if (!strcmp(arg,"--io=poll")) mj_bench.uring=0;
+    else if (!strcmp(arg,"--io=uring")) mj_bench.uring=1;
+    else {
+      fprintf(stderr,
+        "Usage: %s [--devices=4] [--messages=100000] [--rate=0] [--chunk=8] [--pattern=notes|running|chords|sysex] [--rxsize=4096]\n"
+        "  [--sysex-size=1024] [--io=poll|uring]\n"
+        "  messages and rate are per device. Rate zero for as fast as possible.\n",
+        argv[0]
+      );
+      return 1;
+    }
+  }
+  if ((mj_bench.devicec<1)||(mj_bench.devicec>64)||(mj_bench.msgc<1)||(mj_bench.chunk<1)||(mj_bench.chunk>64)||(mj_bench.sysexsize<0)||(mj_bench.sysexsize>1<<20)) {
+    fprintf(stderr,"%s: Invalid configuration.\n",argv[0]);
+    return 1;
+  }
+
+  if (mj_bench_make_fifos()<0) {
+    fprintf(stderr,"%s: Failed to create FIFOs.\n",argv[0]);
+    mj_bench_remove_fifos();
+    return 1;
+  }
+
+  int status=0;
+  struct mj_uring uring={0};
+  struct mj_output output={0};
+  struct mj_input input={
+    .cb=mj_bench_rcvin,
+    .userdata=&output,
+    .rxsize=mj_bench.rxsize,
+  };
+  if (mj_bench.uring) {
+    if (mj_uring_init(&uring)<0) {
+      fprintf(stderr,"%s: io_uring unavailable.\n",argv[0]);
+      mj_bench_remove_fifos();
+      return 1;
+    }
+    input.uring=&uring;
+    output.uring=&uring;
+  }
+  if (
+    (mj_input_set_srcdir(&input,mj_bench.dirpath,-1)<0)||
+    (mj_output_set_dstdev(&output,"file:/dev/null",-1)<0)||
+    (mj_input_ready(&input)<0)||
+    (mj_output_ready(&output)<0)||
+    (mj_input_update(&input,0)<0)
+  ) {
+    fprintf(stderr,"%s: Failed to initialize.\n",argv[0]);
+    mj_bench_remove_fifos();
+    return 1;
+  }
+  // Names are in the directory now, and open. Don't need them anymore.
+  mj_bench_remove_fifos();
+
+  int64_t starttime=mj_now();
+  pthread_t thread;
+  if (pthread_create(&thread,0,mj_bench_feed,0)) return 1;
+  while (mj_bench.connectc>0) {
+    if (mj_input_update(&input,-1)<0) { status=1; break; }
+  }
+  int64_t elapsed=mj_now()-starttime;
+  pthread_join(thread,0);
+
+  double sec=elapsed/1e9;
+  uint64_t msgc=(uint64_t)mj_bench.msgc*mj_bench.devicec;
+  uint64_t syscallc=input.waitc+input.readc+mj_bench.writec;
+  if (mj_bench.uring) syscallc=input.waitc+uring.enterc; // Reads and writes happen inside enter.
+  fprintf(stdout,"pattern %s, %d devices, %d messages each, rate %d/s, chunk %d, io %s\n",
+    mj_bench.pattern,mj_bench.devicec,mj_bench.msgc,mj_bench.rate,mj_bench.chunk,mj_bench.uring?"uring":"poll"
+  );
+  fprintf(stdout,"%.3f s, %.0f messages/s, %.0f uinput events/s, %.1f MB/s\n",
+    sec,msgc/sec,mj_bench.writeeventc/sec,mj_bench.bytec/sec/1e6
+  );
+  if (mj_bench.uring) {
+    fprintf(stdout,"syscalls: %llu enter, %llu epoll_wait; %.3f per message. %llu write batches for %llu writes\n",
+      (unsigned long long)uring.enterc,(unsigned long long)input.waitc,(double)syscallc/msgc,
+      (unsigned long long)uring.batchc,(unsigned long long)mj_bench.writec
+    );
+  } else {
+    fprintf(stdout,"syscalls: %llu wait, %llu read, %llu write; %.3f per message\n",
+      (unsigned long long)input.waitc,(unsigned long long)input.readc,(unsigned long long)mj_bench.writec,
+      (double)syscallc/msgc
+    );
+  }
+  mj_latency_dump(&mj_bench.latency,stdout,"latency");
+  int eventc=0;
+  double parserrate=mj_bench_parser(&eventc);
+  fprintf(stdout,"parser alone: %.1f MB/s, %d events from one device's stream\n",parserrate/1e6,eventc);
+
+  mj_input_cleanup(&input);
+  mj_output_cleanup(&output);
+  mj_uring_cleanup(&uring);
+  return status;
+}
@@ -0,0 +1,318 @@
+/* mj_fuzz.c
+ * Fuzz harness for the parser and translation, for libFuzzer or AFL, or to replay a corpus by hand.
+ * An input is one byte of split seed, then MIDI. We run the MIDI whole, in one-byte reads, and in reads sized by the seed,
+ * each through mj_midi_parse alone and through mj_output_events with the default map into a null sink. Then check:
+ *  - mj_midi_parse consumes 1..srcc bytes. Zero only to end Sysex at a status byte, with an event, and never twice running.
+ *  - Sysex payload points inside the read it came from. Every read is its own exact-size heap copy, so ASan sees overreads too.
+ *  - The split doesn't matter: Parsed events, Sysex payload, button events, errors, Realtime counts, and final state all match.
+ * Any violation aborts, which is what fuzzers look for.
+ *
+ * Plain: out/midjoy-fuzz [FILE|DIR...], stdin if none. "--corpus=DIR" writes the seed corpus. "make fuzz" does both.
+ * libFuzzer: "make libfuzzer" (clang), then out/midjoy-libfuzzer DIR.
+ * AFL: Build with afl-gcc as CC and LD, then afl-fuzz -i DIR -o findings -- out/midjoy-fuzz
+ */
+
+#include "midjoy.h"
+#include <unistd.h>
+#include <fcntl.h>
+#include <dirent.h>
+#include <sys/stat.h>
+
+#define MJ_FUZZ_INPUT_LIMIT (1<<20)
+
+/* Result of one run: Digests of everything that should survive any split.
+ */
+
+struct mj_fuzz_result {
+  uint64_t events; // Parser events, Sysex payload bytes in place of the pointer.
+  uint64_t sysex; // mj_output's Sysex callbacks: payload and endings.
+  uint64_t keys; // EV_KEY events written, with the player.
+  uint64_t state; // Every player's (keyv,absv) after the last read.
+  uint32_t errorc;
+  uint32_t realtimev[8];
+};
+
+static struct mj_fuzz {
+  struct mj_output output;
+  int ready;
+  struct mj_fuzz_result *result; // Current run.
+  const uint8_t *readv; // Current read.
+  int readc;
+} mj_fuzz={0};
+
+static void mj_fuzz_fail(const char *msg) {
+  fprintf(stderr,"mj_fuzz: %s\n",msg);
+  abort();
+}
+
+/* FNV-1a.
+ */
+
+static void mj_fuzz_hash(uint64_t *h,const void *src,int srcc) {
+  const uint8_t *SRC=src;
+  uint64_t v=*h;
+  if (!v) v=0xcbf29ce484222325ull;
+  for (;srcc-->0;SRC++) {
+    v^=*SRC;
+    v*=0x100000001b3ull;
+  }
+  *h=v;
+}
+
+/* Null sink that digests button events.
+ * Axes aren't compared as a stream: Values pending in one frame coalesce, so how many go out depends on the split.
+ * The final state covers them.
+ */
+
+static int mj_fuzz_open(struct mj_output *output,const char *path,int devid,int player,const struct mj_map_profile *profile) {
+  return 0;
+}
+
+static int mj_fuzz_write(struct mj_output *output,struct mj_output_device *device,const void *src,int srcc) {
+  const struct input_event *event=src;
+  int i=srcc/sizeof(struct input_event);
+  for (;i-->0;event++) {
+    if (event->type!=EV_KEY) continue;
+    int32_t v[3]={device->player,event->code,event->value};
+    mj_fuzz_hash(&mj_fuzz.result->keys,v,sizeof(v));
+  }
+  return 0;
+}
+
+static const struct mj_output_backend mj_fuzz_backend={
+  .prefix="",
+  .open=mj_fuzz_open,
+  .write=mj_fuzz_write,
+};
+
+static int mj_fuzz_sysex(int devid,const void *src,int srcc,int final,void *userdata) {
+  if (srcc) {
+    if (((const uint8_t*)src<mj_fuzz.readv)||((const uint8_t*)src+srcc>mj_fuzz.readv+mj_fuzz.readc)) {
+      mj_fuzz_fail("Sysex payload outside the read.");
+    }
+    mj_fuzz_hash(&mj_fuzz.result->sysex,src,srcc);
+  }
+  if (final) {
+    uint8_t v[2]={0xf7,final};
+    mj_fuzz_hash(&mj_fuzz.result->sysex,v,2);
+  }
+  return 0;
+}
+
+/* Parser alone, one read.
+ */
+
+static void mj_fuzz_parse(struct mj_fuzz_result *result,struct mj_midi_parser *parser,const uint8_t *src,int srcc) {
+  int srcp=0,stuck=0;
+  while (srcp<srcc) {
+    struct mj_midi_event event;
+    uint32_t errorc=parser->errorc;
+    int err=mj_midi_parse(&event,parser,src+srcp,srcc-srcp);
+    if ((err<0)||(err>srcc-srcp)) mj_fuzz_fail("Parser consumed outside the read.");
+    if (parser->errorc<errorc) mj_fuzz_fail("Parser error count went backward.");
+    if (!err) {
+      if ((event.opcode!=MJ_MIDI_SYSEX_END)||stuck) mj_fuzz_fail("Parser made no progress.");
+      stuck=1;
+    } else {
+      stuck=0;
+    }
+    if (event.opcode==MJ_MIDI_SYSEX_DATA) {
+      if (
+        (parser->sysexc<1)||(parser->sysexv<src+srcp)||(parser->sysexv+parser->sysexc!=src+srcp+err)
+      ) mj_fuzz_fail("Sysex payload isn't the end of what was consumed.");
+      mj_fuzz_hash(&result->events,parser->sysexv,parser->sysexc);
+    } else if (event.opcode) {
+      mj_fuzz_hash(&result->events,&event,sizeof(event));
+    }
+    srcp+=err;
+  }
+}
+
+/* One run: (src) in reads of sizes given by (seed). Zero for all in one, 1 for one byte each.
+ */
+
+static int mj_fuzz_read_size(uint32_t *seed,int remaining) {
+  if (!*seed) return remaining;
+  if (*seed==1) return 1;
+  *seed^=*seed<<13;
+  *seed^=*seed>>17;
+  *seed^=*seed<<5;
+  int readc=(*seed&0x100)?(1+(*seed&0x0f)):(1+(*seed&0xff));
+  if (readc>remaining) readc=remaining;
+  return readc;
+}
+
+static void mj_fuzz_run(struct mj_fuzz_result *result,const uint8_t *src,int srcc,uint32_t seed) {
+  memset(result,0,sizeof(struct mj_fuzz_result));
+  mj_fuzz.result=result;
+  struct mj_output_device *device=mj_output_connect_device(&mj_fuzz.output,0);
+  if (!device) mj_fuzz_fail("Failed to connect device.");
+  struct mj_midi_parser parser={0};
+  int srcp=0;
+  while (srcp<srcc) {
+    int readc=mj_fuzz_read_size(&seed,srcc-srcp);
+    uint8_t *readv=malloc(readc);
+    if (!readv) mj_fuzz_fail("Out of memory.");
+    memcpy(readv,src+srcp,readc);
+    mj_fuzz_parse(result,&parser,readv,readc);
+    mj_fuzz.readv=readv;
+    mj_fuzz.readc=readc;
+    if (mj_output_events(&mj_fuzz.output,device,readv,readc,0)<0) mj_fuzz_fail("mj_output_events failed.");
+    mj_fuzz.readv=0;
+    mj_fuzz.readc=0;
+    free(readv);
+    srcp+=readc;
+  }
+  if (
+    (parser.status!=device->parser.status)||(parser.bufc!=device->parser.bufc)||(parser.sysex!=device->parser.sysex)||
+    (parser.errorc!=device->parser.errorc)||memcmp(parser.buf,device->parser.buf,sizeof(parser.buf))
+  ) {
+    mj_fuzz_fail("Parser state differs between mj_midi_parse and mj_output_events.");
+  }
+  result->errorc=parser.errorc;
+  memcpy(result->realtimev,parser.realtimev,sizeof(result->realtimev));
+  int i=0;
+  for (;i<device->playerc;i++) {
+    const struct mj_output_device *player=device->playerv[i];
+    mj_fuzz_hash(&result->state,player->keyv,sizeof(player->keyv));
+    mj_fuzz_hash(&result->state,player->absv,sizeof(player->absv));
+  }
+  if (mj_output_disconnect_device(&mj_fuzz.output,device)<0) mj_fuzz_fail("Failed to disconnect device.");
+  mj_fuzz.result=0;
+}
+
+/* One input.
+ */
+
+int LLVMFuzzerTestOneInput(const uint8_t *data,size_t size) {
+  if ((size<1)||(size>MJ_FUZZ_INPUT_LIMIT)) return 0;
+  if (!mj_fuzz.ready) {
+    mj_fuzz.output.backend=&mj_fuzz_backend;
+    mj_fuzz.output.sysex=mj_fuzz_sysex;
+    if (mj_output_ready(&mj_fuzz.output)<0) mj_fuzz_fail("Failed to initialize output.");
+    mj_fuzz.ready=1;
+  }
+  struct mj_fuzz_result whole,bytes,split;
+  mj_fuzz_run(&whole,data+1,size-1,0);
+  mj_fuzz_run(&bytes,data+1,size-1,1);
+  mj_fuzz_run(&split,data+1,size-1,0x100|data[0]);
+  if (memcmp(&whole,&bytes,sizeof(struct mj_fuzz_result))) mj_fuzz_fail("One-byte reads changed the output.");
+  if (memcmp(&whole,&split,sizeof(struct mj_fuzz_result))) mj_fuzz_fail("Split reads changed the output.");
+  return 0;
+}
+
+#if !MJ_LIBFUZZER
+
+/* Seed corpus.
+ * Split seed first, then a little of everything the parser distinguishes.
+ */
+
+static const struct mj_fuzz_seed {
+  const char *name;
+  int c;
+  const uint8_t *v;
+} mj_fuzz_seedv[]={
+#define SEED(name,...) {name,sizeof((const uint8_t[]){__VA_ARGS__}),(const uint8_t[]){__VA_ARGS__}}
+  SEED("notes",0x00,0x90,0x3c,0x40,0x80,0x3c,0x40,0x90,0x3e,0x7f,0x80,0x3e,0x00),
+  SEED("running",0x17,0x90,0x3c,0x40,0x3e,0x40,0x40,0x40,0x3c,0x00,0x3e,0x00,0x40,0x00),
+  SEED("chords",0x2a,0x90,0x3c,0x40,0x91,0x40,0x40,0x92,0x43,0x40,0x80,0x3c,0x00,0x81,0x40,0x00,0x82,0x43,0x00),
+  SEED("cc",0x33,0xb0,0x01,0x00,0x01,0x40,0x01,0x7f,0x07,0x7f,0x0a,0x40,0x4a,0x10,0x40,0x7f,0x40,0x00),
+  SEED("cc14",0x44,0xb0,0x01,0x40,0x21,0x10,0x01,0x7f,0x21,0x7f,0xb1,0x07,0x00,0x27,0x01),
+  SEED("voice",0x55,0xe0,0x00,0x40,0xe0,0x7f,0x7f,0xc0,0x05,0xd0,0x40,0xa0,0x3c,0x20,0xe1,0x00,0x00),
+  SEED("sysex",0x66,0xf0,0x7e,0x7f,0x09,0x01,0xf7,0x90,0x3c,0x40,0xf0,0x43,0x10,0x4c,0x00,0x00,0x7e,0x00,0xf7,0x80,0x3c,0x00),
+  SEED("sysex-cut",0x77,0xf0,0x01,0x02,0x03,0x90,0x3c,0x40,0xf0,0x04,0xf0,0x05,0xf7,0xf7,0x80,0x3c,0x00),
+  SEED("realtime",0x88,0x90,0xf8,0x3c,0xf8,0x40,0xfe,0x80,0xfa,0x3c,0xfc,0x00,0xff,0xf9,0xfd,0xfb),
+  SEED("sysex-realtime",0x99,0xf0,0x01,0xf8,0x02,0x03,0xfe,0x04,0x05,0x06,0x07,0x08,0x09,0x0a,0x0b,0x0c,0x0d,0x0e,0x0f,0x10,0x11,0xf8,0xf7),
+  SEED("common",0xaa,0xf1,0x10,0xf2,0x00,0x40,0xf3,0x05,0xf6,0xf4,0xf5,0x90,0x3c,0x40,0x3c,0x00,0xf1,0x90,0x3e,0x40),
+  SEED("stray",0xbb,0x3c,0x40,0xf7,0x80,0x3c,0x90,0xb0,0x01,0xc0,0xf2,0x01,0x90,0x3c),
+#undef SEED
+};
+
+static int mj_fuzz_write_corpus(const char *dir) {
+  mkdir(dir,0755);
+  const struct mj_fuzz_seed *seed=mj_fuzz_seedv;
+  int i=sizeof(mj_fuzz_seedv)/sizeof(mj_fuzz_seedv[0]);
+  for (;i-->0;seed++) {
+    char path[1024];
+    if (snprintf(path,sizeof(path),"%s/%s",dir,seed->name)>=sizeof(path)) return -1;
+    int fd=open(path,O_WRONLY|O_CREAT|O_TRUNC,0644);
+    if (fd<0) {
+      fprintf(stderr,"%s: Failed to open for writing.\n",path);
+      return -1;
+    }
+    int err=write(fd,seed->v,seed->c);
+    close(fd);
+    if (err!=seed->c) return -1;
+  }
+  return 0;
+}
+
+/* Replay files.
+ */
+
+static uint8_t mj_fuzz_input[MJ_FUZZ_INPUT_LIMIT];
+
+static int mj_fuzz_fd(int fd) {
+  int c=0;
+  while (c<MJ_FUZZ_INPUT_LIMIT) {
+    int err=read(fd,mj_fuzz_input+c,MJ_FUZZ_INPUT_LIMIT-c);
+    if (err<=0) break;
+    c+=err;
+  }
+  LLVMFuzzerTestOneInput(mj_fuzz_input,c);
+  return 0;
+}
+
+static int mj_fuzz_path(const char *path) {
+  struct stat st;
+  if (stat(path,&st)<0) {
+    fprintf(stderr,"%s: Not found.\n",path);
+    return -1;
+  }
+  if (S_ISDIR(st.st_mode)) {
+    DIR *dir=opendir(path);
+    if (!dir) return -1;
+    struct dirent *de;
+    int err=0;
+    while ((de=readdir(dir))) {
+      if (de->d_name[0]=='.') continue;
+      char subpath[1024];
+      if (snprintf(subpath,sizeof(subpath),"%s/%s",path,de->d_name)>=sizeof(subpath)) continue;
+      if (mj_fuzz_path(subpath)<0) err=-1;
+    }
+    closedir(dir);
+    return err;
+  }
+  int fd=open(path,O_RDONLY);
+  if (fd<0) return -1;
+  mj_fuzz_fd(fd);
+  close(fd);
+  return 0;
+}
+
+/* Main.
+ */
+
+int main(int argc,char **argv) {
+  int argp=1,status=0;
+  for (;argp<argc;argp++) {
+    const char *arg=argv[argp];
+    if (!memcmp(arg,"--corpus=",9)) {
+      if (mj_fuzz_write_corpus(arg+9)<0) return 1;
+    } else if (arg[0]=='-') {
+      fprintf(stderr,
+        "Usage: %s [--corpus=DIR] [FILE|DIR...]\n"
+        "  Runs each file, or stdin if none, and aborts at the first failed check. --corpus writes the seeds there first.\n",
+        argv[0]
+      );
+      return 1;
+    } else {
+      if (mj_fuzz_path(arg)<0) status=1;
+    }
+  }
+  if (argc<2) mj_fuzz_fd(0);
+  if (mj_fuzz.ready) mj_output_cleanup(&mj_fuzz.output);
+  return status;
+}
+
+#endif
@@ -0,0 +1,232 @@
+/* mj_microbench.c
+ * The translation hot path alone, in ns/message: No threads, no fds, no syscalls.
+ * Each pattern is generated in memory, then fed in (rxsize) reads to mj_midi_parse alone,
+ * and to mj_output_events with the default map and a backend that discards everything.
+ * Best of (repeat) runs, to keep the scheduler out of it. mj_bench measures the whole daemon instead.
+ */
+
+#include "midjoy.h"
+
+/* Globals.
+ */
+
+static struct mj_microbench {
+  int msgc;
+  int rxsize;
+  int repeat;
+  const char *pattern; // Null for all.
+  uint64_t writec,writeeventc; // Null sink's tally, for the current run.
+} mj_microbench={
+  .msgc=1000000,
+  .rxsize=4096,
+  .repeat=5,
+};
+
+/* Patterns.
+ * Each writes one message at (dst) and returns its length. (status) is Running Status so far, for those that use it.
+ *   notes: Note On and Note Off storm, each with its status byte, across 40 notes.
+ *   running: Same, but Running Status with velocity-zero Note Off.
+ *   cc: Mod wheel sweeping under Running Status (ABS_RY in the default map), and Volume every fourth message, which maps to nothing.
+ *     Axis values coalesce within a read, so expect far fewer uinput events than messages.
+ *   sysex: A 64-byte dump, then a Note On or Off.
+ *   realtime: Notes with MIDI Clock between every byte, like a clocked keyboard at its worst.
+ */
+
+#define MJ_MICROBENCH_SYSEX_SIZE 64
+#define MJ_MICROBENCH_MESSAGE_LIMIT (MJ_MICROBENCH_SYSEX_SIZE+2)
+
+static int mj_microbench_notes(uint8_t *dst,int p,uint8_t *status) {
+  dst[0]=(p&1)?0x80:0x90;
+  dst[1]=0x30+(p>>1)%40;
+  dst[2]=0x40;
+  return 3;
+}
+
+static int mj_microbench_running(uint8_t *dst,int p,uint8_t *status) {
+  int dstc=0;
+  if (*status!=0x90) dst[dstc++]=*status=0x90;
+  dst[dstc++]=0x30+(p>>1)%40;
+  dst[dstc++]=(p&1)?0x00:0x40;
+  return dstc;
+}
+
+static int mj_microbench_cc(uint8_t *dst,int p,uint8_t *status) {
+  int dstc=0;
+  if (*status!=0xb0) dst[dstc++]=*status=0xb0;
+  dst[dstc++]=((p&3)==3)?0x07:0x01;
+  dst[dstc++]=p&0x7f;
+  return dstc;
+}
+
+static int mj_microbench_sysex(uint8_t *dst,int p,uint8_t *status) {
+  if (p&1) return mj_microbench_notes(dst,p>>1,status);
+  dst[0]=0xf0;
+  int i=0;
+  for (;i<MJ_MICROBENCH_SYSEX_SIZE;i++) dst[1+i]=(p+i)&0x7f;
+  dst[1+MJ_MICROBENCH_SYSEX_SIZE]=0xf7;
+  return 2+MJ_MICROBENCH_SYSEX_SIZE;
+}
+
+static int mj_microbench_realtime(uint8_t *dst,int p,uint8_t *status) {
+  uint8_t msg[3];
+  mj_microbench_notes(msg,p,status);
+  dst[0]=msg[0];
+  dst[1]=0xf8;
+  dst[2]=msg[1];
+  dst[3]=0xf8;
+  dst[4]=msg[2];
+  dst[5]=0xf8;
+  return 6;
+}
+
+static const struct mj_microbench_pattern {
+  const char *name;
+  int (*gen)(uint8_t *dst,int p,uint8_t *status);
+} mj_microbench_patternv[]={
+  {"notes",mj_microbench_notes},
+  {"running",mj_microbench_running},
+  {"cc",mj_microbench_cc},
+  {"sysex",mj_microbench_sysex},
+  {"realtime",mj_microbench_realtime},
+};
+
+/* Null sink.
+ */
+
+static int mj_microbench_open(struct mj_output *output,const char *path,int devid,int player,const struct mj_map_profile *profile) {
+  return 0;
+}
+
+static int mj_microbench_write(struct mj_output *output,struct mj_output_device *device,const void *src,int srcc) {
+  mj_microbench.writec++;
+  mj_microbench.writeeventc+=srcc/sizeof(struct input_event);
+  return 0;
+}
+
+static const struct mj_output_backend mj_microbench_backend={
+  .prefix="",
+  .open=mj_microbench_open,
+  .write=mj_microbench_write,
+};
+
+/* Timed passes. Each returns elapsed ns, or <0 on error.
+ */
+
+static int64_t mj_microbench_parse(const uint8_t *src,int srcc,int *eventc) {
+  struct mj_midi_parser parser={0};
+  struct mj_midi_event event;
+  *eventc=0;
+  int64_t starttime=mj_now();
+  int readp=0;
+  for (;readp<srcc;readp+=mj_microbench.rxsize) {
+    int readc=srcc-readp;
+    if (readc>mj_microbench.rxsize) readc=mj_microbench.rxsize;
+    int srcp=0;
+    while (srcp<readc) {
+      srcp+=mj_midi_parse(&event,&parser,src+readp+srcp,readc-srcp);
+      if (event.opcode) (*eventc)++;
+    }
+  }
+  return mj_now()-starttime;
+}
+
+static int64_t mj_microbench_translate(struct mj_output *output,const uint8_t *src,int srcc) {
+  struct mj_output_device *device=mj_output_connect_device(output,0);
+  if (!device) return -1;
+  mj_microbench.writec=mj_microbench.writeeventc=0;
+  int64_t starttime=mj_now();
+  int readp=0;
+  for (;readp<srcc;readp+=mj_microbench.rxsize) {
+    int readc=srcc-readp;
+    if (readc>mj_microbench.rxsize) readc=mj_microbench.rxsize;
+    if (mj_output_events(output,device,src+readp,readc,0)<0) return -1;
+  }
+  int64_t elapsed=mj_now()-starttime;
+  if (mj_output_disconnect_device(output,device)<0) return -1;
+  return elapsed;
+}
+
+/* Run one pattern and print its line.
+ */
+
+static int mj_microbench_run(struct mj_output *output,const struct mj_microbench_pattern *pattern) {
+  uint8_t *src=malloc((size_t)mj_microbench.msgc*MJ_MICROBENCH_MESSAGE_LIMIT);
+  if (!src) return -1;
+  uint8_t status=0;
+  int srcc=0,p=0;
+  for (;p<mj_microbench.msgc;p++) srcc+=pattern->gen(src+srcc,p,&status);
+
+  int64_t parsebest=INT64_MAX,translatebest=INT64_MAX;
+  int eventc=0,i=0;
+  for (;i<mj_microbench.repeat;i++) {
+    int64_t elapsed=mj_microbench_parse(src,srcc,&eventc);
+    if (elapsed<parsebest) parsebest=elapsed;
+    if ((elapsed=mj_microbench_translate(output,src,srcc))<0) {
+      free(src);
+      return -1;
+    }
+    if (elapsed<translatebest) translatebest=elapsed;
+  }
+  free(src);
+
+  fprintf(stdout,"%-9s %8.2f ns/msg parse %8.2f ns/msg translate %6.2f bytes/msg %6.2f events/msg %6.2f uinput events/msg %6.3f writes/msg\n",
+    pattern->name,
+    (double)parsebest/mj_microbench.msgc,
+    (double)translatebest/mj_microbench.msgc,
+    (double)srcc/mj_microbench.msgc,
+    (double)eventc/mj_microbench.msgc,
+    (double)mj_microbench.writeeventc/mj_microbench.msgc,
+    (double)mj_microbench.writec/mj_microbench.msgc
+  );
+  return 0;
+}
+
+/* Main.
+ */
+
+int main(int argc,char **argv) {
+  int argp=1;
+  for (;argp<argc;argp++) {
+    const char *arg=argv[argp];
+    if (!memcmp(arg,"--messages=",11)) mj_microbench.msgc=atoi(arg+11);
+    else if (!memcmp(arg,"--rxsize=",9)) mj_microbench.rxsize=atoi(arg+9);
+    else if (!memcmp(arg,"--repeat=",9)) mj_microbench.repeat=atoi(arg+9);
+    else if (!memcmp(arg,"--pattern=",10)) mj_microbench.pattern=arg+10;
+    else {
+      fprintf(stderr,
+        "Usage: %s [--messages=1000000] [--rxsize=4096] [--repeat=5] [--pattern=notes|running|cc|sysex|realtime]\n"
+        "  Every pattern if none given. Output goes to a null sink through the default map.\n",
+        argv[0]
+      );
+      return 1;
+    }
+  }
+  if ((mj_microbench.msgc<1)||(mj_microbench.msgc>INT_MAX/MJ_MICROBENCH_MESSAGE_LIMIT)||(mj_microbench.rxsize<1)||(mj_microbench.repeat<1)) {
+    fprintf(stderr,"%s: Invalid configuration.\n",argv[0]);
+    return 1;
+  }
+
+  struct mj_output output={.backend=&mj_microbench_backend};
+  if (mj_output_ready(&output)<0) {
+    fprintf(stderr,"%s: Failed to initialize.\n",argv[0]);
+    return 1;
+  }
+  fprintf(stdout,"%d messages, rxsize %d, best of %d\n",mj_microbench.msgc,mj_microbench.rxsize,mj_microbench.repeat);
+  int status=0,matchc=0;
+  const struct mj_microbench_pattern *pattern=mj_microbench_patternv;
+  int i=sizeof(mj_microbench_patternv)/sizeof(mj_microbench_patternv[0]);
+  for (;i-->0;pattern++) {
+    if (mj_microbench.pattern&&strcmp(mj_microbench.pattern,pattern->name)) continue;
+    matchc++;
+    if (mj_microbench_run(&output,pattern)<0) {
+      fprintf(stderr,"%s: Failed.\n",pattern->name);
+      status=1;
+    }
+  }
+  if (!matchc) {
+    fprintf(stderr,"%s: Unknown pattern '%s'.\n",argv[0],mj_microbench.pattern);
+    status=1;
+  }
+  mj_output_cleanup(&output);
+  return status;
+}
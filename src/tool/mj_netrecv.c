@@ -0,0 +1,234 @@
+/* mj_netrecv.c
+ * Far side of midjoy's "udp:" and "unix:" outputs: Receives frames and replays them into uinput (or a file).
+ * One joystick per (devid,player), created when its HELLO arrives and dropped on BYE.
+ */
+
+#include "midjoy.h"
+#include <unistd.h>
+#include <signal.h>
+#include <errno.h>
+#include <endian.h>
+#include <sys/socket.h>
+
+#define MJ_NETRECV_DEVICE_LIMIT 256
+
+/* Globals.
+ */
+
+struct mj_netrecv_device {
+  int devid,player;
+  int fd; // Zero until HELLO.
+  uint32_t seq; // Last seen.
+  uint64_t framec,lostc;
+  struct mj_net_hello hello;
+};
+
+static struct mj_netrecv {
+  const char *listen;
+  const char *dstdev;
+  int kind;
+  int fd;
+  struct mj_netrecv_device *devicev;
+  int devicec,devicea;
+  uint64_t badc; // Frames we couldn't make sense of.
+  volatile int sigc;
+} mj_netrecv={
+  .dstdev="/dev/uinput",
+};
+
+static void mj_netrecv_rcvsig(int sigid) {
+  mj_netrecv.sigc++;
+}
+
+/* Device list.
+ */
+
+static struct mj_netrecv_device *mj_netrecv_device_get(int devid,int player,int create) {
+  struct mj_netrecv_device *device=mj_netrecv.devicev;
+  int i=mj_netrecv.devicec;
+  for (;i-->0;device++) {
+    if ((device->devid==devid)&&(device->player==player)) return device;
+  }
+  if (!create) return 0;
+  if (mj_netrecv.devicec>=MJ_NETRECV_DEVICE_LIMIT) return 0;
+  if (mj_netrecv.devicec>=mj_netrecv.devicea) {
+    int na=mj_netrecv.devicea+8;
+    void *nv=realloc(mj_netrecv.devicev,sizeof(struct mj_netrecv_device)*na);
+    if (!nv) return 0;
+    mj_netrecv.devicev=nv;
+    mj_netrecv.devicea=na;
+  }
+  device=mj_netrecv.devicev+mj_netrecv.devicec++;
+  memset(device,0,sizeof(struct mj_netrecv_device));
+  device->devid=devid;
+  device->player=player;
+  return device;
+}
+
+static void mj_netrecv_device_close(struct mj_netrecv_device *device) {
+  if (device->fd>0) {
+    close(device->fd);
+    fprintf(stderr,"MIDI %d player %d: Closed. frames=%llu lost=%llu\n",
+      device->devid,device->player+1,(unsigned long long)device->framec,(unsigned long long)device->lostc
+    );
+  }
+  device->fd=0;
+}
+
+/* Sequence: Count the gap since the last frame, if any.
+ */
+
+static void mj_netrecv_sequence(struct mj_netrecv_device *device,uint32_t seq) {
+  uint32_t expect=device->seq+1;
+  if (seq!=expect) {
+    if ((int32_t)(seq-expect)>0) {
+      device->lostc+=seq-expect;
+      fprintf(stderr,"MIDI %d player %d: Lost %u frames.\n",device->devid,device->player+1,seq-expect);
+    } else {
+      // Behind us: Reordered or duplicated. Deliver it anyway, but don't back up.
+      device->framec++;
+      return;
+    }
+  }
+  device->seq=seq;
+  device->framec++;
+}
+
+/* HELLO.
+ * A repeat with the same capabilities is just a sequence point.
+ * Seq zero means the sender opened it anew; recreate so the far end sees a fresh joystick, like a local reconnect.
+ */
+
+static void mj_netrecv_hello(const struct mj_net_header *header,const struct mj_net_hello *hello) {
+  int devid=le32toh(header->devid);
+  uint32_t seq=le32toh(header->seq);
+  struct mj_netrecv_device *device=mj_netrecv_device_get(devid,header->player,1);
+  if (!device) return;
+  if (device->fd>0) {
+    if (seq&&!memcmp(&device->hello,hello,sizeof(struct mj_net_hello))) {
+      mj_netrecv_sequence(device,seq);
+      return;
+    }
+    mj_netrecv_device_close(device);
+  }
+  static struct mj_map_profile profile={0}; // Big; only the capabilities matter.
+  mj_net_hello_decode(&profile,hello);
+  int fd=mj_output_open_sink(mj_netrecv.dstdev,devid,header->player,&profile);
+  if (fd<0) return;
+  device->fd=fd;
+  device->seq=seq;
+  device->framec=1;
+  device->lostc=0;
+  memcpy(&device->hello,hello,sizeof(struct mj_net_hello));
+  fprintf(stderr,"MIDI %d player %d: Opened.\n",devid,header->player+1);
+}
+
+/* EVENTS.
+ * Timestamps are left zero; uinput fills them in.
+ */
+
+static void mj_netrecv_events(const struct mj_net_header *header,const struct mj_net_event *src,int eventc) {
+  struct mj_netrecv_device *device=mj_netrecv_device_get(le32toh(header->devid),header->player,0);
+  if (!device||(device->fd<=0)) return; // Waiting for HELLO.
+  mj_netrecv_sequence(device,le32toh(header->seq));
+  struct input_event eventv[MJ_OUTPUT_EVENT_LIMIT]={0};
+  if (eventc>MJ_OUTPUT_EVENT_LIMIT) eventc=MJ_OUTPUT_EVENT_LIMIT;
+  int i=0;
+  for (;i<eventc;i++) {
+    eventv[i].type=le16toh(src[i].type);
+    eventv[i].code=le16toh(src[i].code);
+    eventv[i].value=le32toh(src[i].value);
+  }
+  int len=sizeof(struct input_event)*eventc;
+  if (write(device->fd,eventv,len)!=len) {
+    fprintf(stderr,"MIDI %d player %d: Write failed: %m\n",device->devid,device->player+1);
+    mj_netrecv_device_close(device);
+  }
+}
+
+/* Receive one frame.
+ */
+
+static void mj_netrecv_frame(const void *src,int srcc) {
+  const struct mj_net_header *header=src;
+  if (
+    (srcc<sizeof(struct mj_net_header))||
+    (header->magic[0]!='M')||(header->magic[1]!='J')||
+    (header->version!=MJ_NET_VERSION)
+  ) {
+    mj_netrecv.badc++;
+    return;
+  }
+  const void *body=header+1;
+  int bodyc=srcc-sizeof(struct mj_net_header);
+  switch (header->kind) {
+    case MJ_NET_HELLO: {
+        if (bodyc<sizeof(struct mj_net_hello)) break;
+        mj_netrecv_hello(header,body);
+      } return;
+    case MJ_NET_EVENTS: {
+        int eventc=le16toh(header->eventc);
+        if (eventc*sizeof(struct mj_net_event)>bodyc) break;
+        mj_netrecv_events(header,body,eventc);
+      } return;
+    case MJ_NET_BYE: {
+        struct mj_netrecv_device *device=mj_netrecv_device_get(le32toh(header->devid),header->player,0);
+        if (device) mj_netrecv_device_close(device);
+      } return;
+  }
+  mj_netrecv.badc++;
+}
+
+/* Main.
+ */
+
+int main(int argc,char **argv) {
+  int argp=1;
+  for (;argp<argc;argp++) {
+    const char *arg=argv[argp];
+    if (!memcmp(arg,"--listen=udp:",13)) {
+      mj_netrecv.kind=MJ_NET_UDP;
+      mj_netrecv.listen=arg+13;
+    } else if (!memcmp(arg,"--listen=unix:",14)) {
+      mj_netrecv.kind=MJ_NET_UNIX;
+      mj_netrecv.listen=arg+14;
+    } else if (!memcmp(arg,"--dstdev=",9)) {
+      mj_netrecv.dstdev=arg+9;
+    } else {
+      fprintf(stderr,"Unexpected argument '%s'\n",arg);
+      mj_netrecv.listen=0;
+      break;
+    }
+  }
+  if (!mj_netrecv.listen) {
+    fprintf(stderr,
+      "Usage: %s --listen=udp:HOST:PORT|unix:PATH [--dstdev=PATH]\n"
+      "  Receives frames from midjoy --dstdev=udp:... or unix:..., and creates matching joysticks here.\n"
+      "  dstdev defaults to \"/dev/uinput\". \"file:PATH\" to capture raw input_events instead.\n",
+      argv[0]
+    );
+    return 1;
+  }
+
+  signal(SIGINT,mj_netrecv_rcvsig);
+  signal(SIGTERM,mj_netrecv_rcvsig);
+  if ((mj_netrecv.fd=mj_net_socket(mj_netrecv.kind,mj_netrecv.listen,1))<0) return 1;
+  fprintf(stderr,"Listening on %s.\n",mj_netrecv.listen);
+
+  char buf[MJ_NET_FRAME_LIMIT];
+  while (!mj_netrecv.sigc) {
+    int bufc=recv(mj_netrecv.fd,buf,sizeof(buf),0);
+    if (bufc<0) {
+      if (errno==EINTR) continue;
+      fprintf(stderr,"recv: %m\n");
+      break;
+    }
+    mj_netrecv_frame(buf,bufc);
+  }
+
+  while (mj_netrecv.devicec-->0) mj_netrecv_device_close(mj_netrecv.devicev+mj_netrecv.devicec);
+  if (mj_netrecv.badc) fprintf(stderr,"Dropped %llu malformed frames.\n",(unsigned long long)mj_netrecv.badc);
+  close(mj_netrecv.fd);
+  if (mj_netrecv.kind==MJ_NET_UNIX) unlink(mj_netrecv.listen);
+  return 0;
+}
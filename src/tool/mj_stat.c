@@ -0,0 +1,207 @@
+/* mj_stat.c
+ * Reads a running midjoy's stats page (--stats) and prints rates per device, like vmstat.
+ * Never talks to the daemon; it only maps the file read-only.
+ */
+
+#include "midjoy.h"
+#include <unistd.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <errno.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#define MJ_STAT_HEADER_INTERVAL 20 /* Repeat column headers every so many rows. */
+
+/* Globals.
+ */
+
+static struct mj_stat {
+  const char *path;
+  int interval; // s
+  int count; // reports, zero for forever
+  int opcodes; // Print cumulative counts per opcode, once.
+  const void *map;
+  size_t mapsize;
+  const struct mj_stats_header *header;
+  int slotc;
+  struct mj_stats_slot *prevv; // Last report's counters, per slot.
+  int64_t prevtime;
+  int rowc;
+} mj_stat={
+  .path=MJ_STATS_DEFAULT_PATH,
+  .interval=1,
+};
+
+/* Open and validate the page.
+ */
+
+static int mj_stat_open() {
+  int fd=open(mj_stat.path,O_RDONLY|O_CLOEXEC);
+  if (fd<0) {
+    fprintf(stderr,"%s: %m\n",mj_stat.path);
+    return -1;
+  }
+  struct stat st;
+  if ((fstat(fd,&st)<0)||(st.st_size<sizeof(struct mj_stats_header))) {
+    fprintf(stderr,"%s: Not a stats page.\n",mj_stat.path);
+    close(fd);
+    return -1;
+  }
+  mj_stat.mapsize=st.st_size;
+  mj_stat.map=mmap(0,mj_stat.mapsize,PROT_READ,MAP_SHARED,fd,0);
+  close(fd);
+  if (mj_stat.map==MAP_FAILED) {
+    mj_stat.map=0;
+    return -1;
+  }
+  mj_stat.header=mj_stat.map;
+  if (
+    memcmp(mj_stat.header->magic,MJ_STATS_MAGIC,8)||
+    (mj_stat.header->slotsize!=sizeof(struct mj_stats_slot))||
+    (mj_stat.header->slotc>(mj_stat.mapsize-sizeof(struct mj_stats_header))/sizeof(struct mj_stats_slot))
+  ) {
+    fprintf(stderr,"%s: Not a stats page, or from a different version of midjoy.\n",mj_stat.path);
+    return -1;
+  }
+  mj_stat.slotc=mj_stat.header->slotc;
+  if (!(mj_stat.prevv=calloc(mj_stat.slotc,sizeof(struct mj_stats_slot)))) return -1;
+  return 0;
+}
+
+static const struct mj_stats_slot *mj_stat_slot(int p) {
+  return (const struct mj_stats_slot*)((const char*)mj_stat.map+sizeof(struct mj_stats_header))+p;
+}
+
+/* Copy one slot's counters, each whole.
+ */
+
+#define LOAD(field) dst->field=__atomic_load_n(&src->field,__ATOMIC_RELAXED);
+
+static void mj_stat_load(struct mj_stats_slot *dst,const struct mj_stats_slot *src) {
+  LOAD(devid)
+  LOAD(connected)
+  LOAD(connectc)
+  LOAD(disconnectc)
+  LOAD(readc)
+  LOAD(bytec)
+  LOAD(errorc)
+  int i=0;
+  for (;i<MJ_STATS_SYSTEM_COUNT;i++) LOAD(systemv[i])
+  for (i=0;i<MJ_STATS_VOICE_COUNT;i++) LOAD(voicev[i])
+  LOAD(eventc)
+  LOAD(writec)
+  LOAD(lastevent)
+}
+
+#undef LOAD
+
+static uint64_t mj_stat_sum_messages(const struct mj_stats_slot *slot) {
+  uint64_t sum=0;
+  int i=0;
+  for (;i<MJ_STATS_OPCODE_COUNT;i++) sum+=mj_stats_msgc(slot,i);
+  return sum;
+}
+
+/* One report.
+ * The first is averaged since the daemon started, like vmstat's first line.
+ */
+
+static void mj_stat_report() {
+  int64_t now=mj_now();
+  int64_t since=mj_stat.prevtime?mj_stat.prevtime:mj_stat.header->starttime;
+  double sec=(now-since)/1e9;
+  if (sec<=0.0) sec=1e-9;
+
+  int pid=__atomic_load_n(&mj_stat.header->pid,__ATOMIC_ACQUIRE);
+  if (!pid) fprintf(stdout,"(midjoy has exited; counts are final)\n");
+  else if ((kill(pid,0)<0)&&(errno==ESRCH)) fprintf(stdout,"(midjoy pid %d is gone; counts are stale)\n",pid);
+
+  int i=0;
+  for (;i<mj_stat.slotc;i++) {
+    struct mj_stats_slot slot;
+    mj_stat_load(&slot,mj_stat_slot(i));
+    if (slot.devid<0) break;
+    const struct mj_stats_slot *prev=mj_stat.prevv+i;
+    if (!(mj_stat.rowc++%MJ_STAT_HEADER_INTERVAL)) {
+      fprintf(stdout,"devid conn   bytes/s   reads/s    msgs/s  events/s  writes/s  errors  connects  idle_ms\n");
+    }
+    int64_t idle=slot.lastevent?(now-slot.lastevent)/1000000:-1;
+    fprintf(stdout,"%5d %4s %9.0f %9.0f %9.0f %9.0f %9.0f %7llu %4llu/%-4llu %8lld\n",
+      slot.devid,slot.connected?"yes":"no",
+      (slot.bytec-prev->bytec)/sec,
+      (slot.readc-prev->readc)/sec,
+      (mj_stat_sum_messages(&slot)-mj_stat_sum_messages(prev))/sec,
+      (slot.eventc-prev->eventc)/sec,
+      (slot.writec-prev->writec)/sec,
+      (unsigned long long)(slot.errorc-prev->errorc),
+      (unsigned long long)slot.connectc,(unsigned long long)slot.disconnectc,
+      (long long)idle
+    );
+    mj_stat.prevv[i]=slot;
+  }
+  mj_stat.prevtime=now;
+  fflush(stdout);
+}
+
+/* Cumulative counts by opcode.
+ */
+
+static void mj_stat_report_opcodes() {
+  static const char *namev[MJ_STATS_OPCODE_COUNT]={
+    "note_off","note_on","aftertouch","control","program","pressure","pitch",
+    "sysex","mtc","song_pos","song_sel","f4","f5","tune","f7",
+    "clock","f9","start","continue","stop","fd","active","reset",
+  };
+  int i=0;
+  for (;i<mj_stat.slotc;i++) {
+    struct mj_stats_slot slot;
+    mj_stat_load(&slot,mj_stat_slot(i));
+    if (slot.devid<0) break;
+    fprintf(stdout,"MIDI %d:",slot.devid);
+    int j=0;
+    for (;j<MJ_STATS_OPCODE_COUNT;j++) {
+      uint64_t msgc=mj_stats_msgc(&slot,j);
+      if (msgc) fprintf(stdout," %s=%llu",namev[j],(unsigned long long)msgc);
+    }
+    fprintf(stdout,"\n");
+  }
+}
+
+/* Main.
+ */
+
+int main(int argc,char **argv) {
+  int argp=1,positionalc=0;
+  for (;argp<argc;argp++) {
+    const char *arg=argv[argp];
+    if (!strcmp(arg,"--opcodes")) mj_stat.opcodes=1;
+    else if ((arg[0]=='-')||(positionalc>=3)) {
+      fprintf(stderr,
+        "Usage: %s [--opcodes] [PATH [INTERVAL [COUNT]]]\n"
+        "  PATH defaults to %s. INTERVAL in seconds, default 1. COUNT zero or absent for forever.\n"
+        "  --opcodes: Print cumulative messages by opcode and exit.\n",
+        argv[0],MJ_STATS_DEFAULT_PATH
+      );
+      return 1;
+    } else switch (positionalc++) {
+      case 0: mj_stat.path=arg; break;
+      case 1: mj_stat.interval=atoi(arg); break;
+      case 2: mj_stat.count=atoi(arg); break;
+    }
+  }
+  if (mj_stat.interval<1) mj_stat.interval=1;
+  if (mj_stat_open()<0) return 1;
+
+  if (mj_stat.opcodes) {
+    mj_stat_report_opcodes();
+    return 0;
+  }
+  int reportc=0;
+  while (1) {
+    mj_stat_report();
+    if (mj_stat.count&&(++reportc>=mj_stat.count)) break;
+    sleep(mj_stat.interval);
+  }
+  return 0;
+}